@@ -1,49 +1,305 @@
 // netsend.cpp : Program to send a string to a specific UDP port 
 //               on the localhost. The string and the port number
 //               are to be supplied as commandline arguments.
+//               Optionally the string is sent a number of times,
+//               a batch of datagrams per system call.
+//
+//               With -l, netsend is a load generator instead: it sends
+//               datagrams to a range of ports at a given rate for a given
+//               time and reports the rate achieved every second. Each
+//               datagram carries a ProbeHeader -- a sequence number and
+//               send timestamp -- for the receiver to measure latency and
+//               loss with.
 // 
 
 #include "stdafx.h"
+#include "datagram.h"
+#include "latency.h"
 
-int _tmain(int argc, _TCHAR* argv[])
+typedef std::chrono::steady_clock Clock;
+
+/* load generator settings, see Usage() */
+struct LoadOptions {
+    double m_rate;              // datagrams/sec over all threads, 0 for as fast as possible
+    size_t m_minsize;           // payload sizes are uniformly distributed
+    size_t m_maxsize;           // over [m_minsize, m_maxsize]
+    unsigned m_seconds;
+    unsigned m_threads;
+    unsigned short m_port;      // first destination port
+    unsigned m_ports;           // number of destination ports
+    size_t m_batch;             // datagrams per system call
+
+    LoadOptions()
+        : m_rate(0)
+        , m_minsize(32)
+        , m_maxsize(32)
+        , m_seconds(10)
+        , m_threads(1)
+        , m_port(5000)
+        , m_ports(1)
+        , m_batch(DatagramSender::DEFAULT_BATCH_SIZE)
+    {}
+};
+
+/*
+ * Sends datagrams from a number of threads, each with its own socket and
+ * its share of the rate. Each thread paces itself by sending a batch when
+ * the datagrams in it are due -- so at low rates the batches are
+ * partial -- and sleeping until the next one is.
+ */
+class LoadGenerator {
+    LoadOptions m_options;
+    std::atomic<unsigned long long> m_packets;
+    std::atomic<unsigned long long> m_bytes;
+    std::atomic<bool> m_fStop;
+
+    LoadGenerator(const LoadGenerator&);
+    LoadGenerator& operator=(const LoadGenerator&);
+
+    void SenderProc(unsigned thread)
+    {
+        try {
+            DatagramSender sender(m_options.m_batch);
+            std::vector<char> payload(m_options.m_batch * m_options.m_maxsize);
+            std::vector<Datagram> batch(m_options.m_batch);
+            std::vector<struct sockaddr_in> addrs;
+            std::vector<uint64_t> seqs(m_options.m_ports);     // per destination port
+            for (unsigned i=0; i<m_options.m_ports; i++)
+                addrs.push_back(UdpSocket::LoopbackAddress(static_cast<unsigned short>(m_options.m_port + i)));
+            std::minstd_rand rng(thread + 1);
+            std::uniform_int_distribution<size_t> sizes(m_options.m_minsize, m_options.m_maxsize);
+            double rate = m_options.m_rate / m_options.m_threads;
+
+            unsigned long long sent = 0;
+            size_t nextport = thread % addrs.size();
+            Clock::time_point start = Clock::now();
+            while (!m_fStop.load(std::memory_order_relaxed)) {
+                size_t n = m_options.m_batch;
+                if (rate > 0) {
+                    // the number of datagrams due by now, or wait for the next one
+                    double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+                    unsigned long long due = static_cast<unsigned long long>(elapsed * rate) + 1;
+                    if (due <= sent) {
+                        std::chrono::duration<double> wait((sent + 1) / rate - elapsed);
+                        std::this_thread::sleep_for(std::chrono::duration_cast<Clock::duration>(wait));
+                        continue;
+                    }
+                    if (due - sent < n)
+                        n = static_cast<size_t>(due - sent);
+                }
+                size_t cb = 0;
+                uint64_t now = MonotonicNanos();
+                for (size_t i=0; i<n; i++) {
+                    Datagram& d = batch[i];
+                    char* buf = &payload[i * m_options.m_maxsize];
+                    d.m_data = buf;
+                    d.m_len = sizes(rng);
+                    d.m_truncated = false;
+                    d.m_addr = addrs[nextport];
+                    if (d.m_len >= sizeof(ProbeHeader))
+                        ProbeHeader::Write(buf, seqs[nextport]++, now);
+                    nextport = (nextport + 1) % addrs.size();
+                    cb += d.m_len;
+                }
+                if (sender.Send(&batch[0], n) < n)
+                    break;
+                sent += n;
+                m_packets.fetch_add(n, std::memory_order_relaxed);
+                m_bytes.fetch_add(cb, std::memory_order_relaxed);
+            }
+        } catch (std::exception& e) {
+            std::cerr << "std::exception: " << e.what() << std::endl;
+        }
+    }
+
+    static void Report(const char* label, unsigned long long packets, unsigned long long bytes, double secs)
+    {
+        std::cout << label << ": " << static_cast<unsigned long long>(packets / secs) << " pkts/s, "
+                  << (bytes * 8 / secs) / 1e6 << " Mbit/s" << std::endl;
+    }
+
+public:
+    LoadGenerator(const LoadOptions& options)
+        : m_options(options)
+        , m_packets(0)
+        , m_bytes(0)
+        , m_fStop(false)
+    {}
+
+    /* sends for the configured time, printing the rates achieved every second */
+    void Run()
+    {
+        std::vector<std::thread> threads;
+        for (unsigned i=0; i<m_options.m_threads; i++)
+            threads.push_back(std::thread(&LoadGenerator::SenderProc, this, i));
+
+        Clock::time_point start = Clock::now();
+        Clock::time_point last = start;
+        unsigned long long lastpackets = 0, lastbytes = 0;
+        for (unsigned s=1; s<=m_options.m_seconds; s++) {
+            std::this_thread::sleep_until(start + std::chrono::seconds(s));
+            Clock::time_point now = Clock::now();
+            unsigned long long packets = m_packets.load(), bytes = m_bytes.load();
+            std::string label = std::to_string(s) + "s";
+            Report(label.c_str(), packets - lastpackets, bytes - lastbytes,
+                std::chrono::duration<double>(now - last).count());
+            last = now;
+            lastpackets = packets;
+            lastbytes = bytes;
+        }
+        m_fStop = true;
+        for (size_t i=0; i<threads.size(); i++)
+            threads[i].join();
+
+        Report("total", m_packets.load(), m_bytes.load(),
+            std::chrono::duration<double>(Clock::now() - start).count());
+    }
+};
+
+static void Usage()
+{
+    std::cerr << "Usage:-\n\n\tnetsend <message> <port> [count [batch]]\n"
+        "\tnetsend -l [-r rate] [-s size|min-max] [-d seconds] [-t threads]\n"
+        "\t           [-p port] [-n ports] [-b batch]\n\n"
+        "\t-r  datagrams/sec over all threads, 0 for unpaced (default 0)\n"
+        "\t-s  payload size, or sizes uniformly distributed over min-max (default 32);\n"
+        "\t    payloads of 24 bytes or more carry a sequence number and timestamp\n"
+        "\t-d  duration in seconds (default 10)\n"
+        "\t-t  sender threads (default 1)\n"
+        "\t-p  first destination port (default 5000)\n"
+        "\t-n  destination ports, datagrams round-robin over them (default 1)\n"
+        "\t-b  datagrams per system call (default 32)" << std::endl;
+}
+
+/**
+ * Parses the -l options.
+ * Returns:
+ *  false if they're invalid
+ */
+static bool ParseLoadOptions(int argc, _TCHAR* argv[], LoadOptions& options)
 {
-    if (argc < 3) {
-        std::cerr << "Usage:-\n\n\tnetsend <message> <port>" << std::endl;
-        return 1;
+    for (int i=2; i<argc; i+=2) {
+        if (i + 1 >= argc)
+            return false;
+        _TCHAR* ep = 0;
+        const _TCHAR* arg = argv[i + 1];
+        long value = ::_tcstol(arg, &ep, 10);
+        if (::_tcscmp(argv[i], _T("-r")) == 0) {
+            options.m_rate = ::_tcstod(arg, &ep);
+            if (options.m_rate < 0)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-s")) == 0) {
+            options.m_minsize = options.m_maxsize = value;
+            if (*ep == _T('-'))
+                options.m_maxsize = ::_tcstol(ep + 1, &ep, 10);
+            if (value < 0 || options.m_minsize > options.m_maxsize || options.m_maxsize > 65507)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-d")) == 0) {
+            options.m_seconds = value;
+            if (value <= 0)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-t")) == 0) {
+            options.m_threads = value;
+            if (value <= 0)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-p")) == 0) {
+            options.m_port = static_cast<unsigned short>(value);
+            if (value <= 0 || value > 65535)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-n")) == 0) {
+            options.m_ports = value;
+            if (value <= 0)
+                return false;
+        } else if (::_tcscmp(argv[i], _T("-b")) == 0) {
+            options.m_batch = value;
+            if (value <= 0)
+                return false;
+        } else {
+            return false;
+        }
+        if (*ep != 0)
+            return false;
     }
+    return options.m_port + options.m_ports - 1 <= 65535;
+}
 
-    wchar_t* ep = 0;
-    int port = ::wcstol(argv[2], &ep, 10);
-    if (port == 0 || port == -1 || port > 65535) {
-        std::cerr << "Invalid port number specified." << std::endl;
-        return 1;
+static void SendRepeatedly(const _TCHAR* message, unsigned short port, size_t count, size_t batch)
+{
+    DatagramSender sender(batch);
+
+    // every datagram of a batch points at the same message
+    Datagram d;
+    d.m_data = reinterpret_cast<const char*>(message);
+    d.m_len = ::_tcslen(message)*sizeof(_TCHAR);
+    d.m_truncated = false;
+    d.m_addr = UdpSocket::LoopbackAddress(port);
+    std::vector<Datagram> datagrams(batch, d);
+
+    size_t sent = 0;
+    while (sent < count) {
+        size_t n = count - sent;
+        if (n > datagrams.size())
+            n = datagrams.size();
+        size_t rc = sender.Send(&datagrams[0], n);
+        sent += rc;
+        if (rc < n)
+            break;
     }
+    std::cerr << "Sent " << sent << " datagram(s) of " << d.m_len
+              << " bytes to port " << port << std::endl;
+}
 
+int _tmain(int argc, _TCHAR* argv[])
+{
+    LoadOptions options;
+    bool fLoad = argc > 1 && ::_tcscmp(argv[1], _T("-l")) == 0;
+    long port = 0, count = 1, batch = DatagramSender::DEFAULT_BATCH_SIZE;
+    if (fLoad) {
+        if (!ParseLoadOptions(argc, argv, options)) {
+            Usage();
+            return 1;
+        }
+    } else {
+        if (argc < 3) {
+            Usage();
+            return 1;
+        }
+
+        _TCHAR* ep = 0;
+        port = ::_tcstol(argv[2], &ep, 10);
+        if (port <= 0 || port > 65535) {
+            std::cerr << "Invalid port number specified." << std::endl;
+            return 1;
+        }
+        if (argc > 3)
+            count = ::_tcstol(argv[3], &ep, 10);
+        if (argc > 4)
+            batch = ::_tcstol(argv[4], &ep, 10);
+        if (count <= 0 || batch <= 0) {
+            std::cerr << "Invalid count or batch size specified." << std::endl;
+            return 1;
+        }
+    }
+
+#ifdef _WIN32
     WSADATA wsad = {0};
     ::WSAStartup(MAKEWORD(2, 2), &wsad);
+#endif
 
-    SOCKET socket = ::WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, 0);
-    if (socket != INVALID_SOCKET) {
-        struct sockaddr_in to = {0};
-        to.sin_family = AF_INET;
-        to.sin_port = ::htons(port);
-        to.sin_addr.s_addr = ::inet_addr("127.0.0.1");
-        int cbSent = ::sendto(socket, reinterpret_cast<const char*>(argv[1]),
-            ::wcslen(argv[1])*sizeof(_TCHAR), 
-            0,
-            reinterpret_cast<const sockaddr*>(&to),
-            sizeof(to));
-        if (cbSent != SOCKET_ERROR) {
-            std::cerr << "Sent " << cbSent << " bytes to port " << port << std::endl;
+    try {
+        if (fLoad) {
+            LoadGenerator generator(options);
+            generator.Run();
         } else {
-            std::cerr << "Error sending data to port " << port << ", error code: " 
-                      << ::WSAGetLastError() << std::endl;
+            SendRepeatedly(argv[1], static_cast<unsigned short>(port), count, batch);
         }
-
-        ::closesocket(socket);
+    } catch (std::exception& e) {
+        std::cerr << "std::exception: " << e.what() << std::endl;
     }
 
+#ifdef _WIN32
     ::WSACleanup();
+#endif
 
     return 0;
 }
@@ -5,6 +5,7 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
 
 #include <stdio.h>
@@ -14,5 +15,25 @@
 
 // TODO: reference additional headers your program requires here
 #include <WinSock2.h>
+#else
+// just enough of the Win32 vocabulary for netsend to build on Linux
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define _tmain main
+typedef char _TCHAR;
+#define _T(x) x
+#define _tcstol strtol
+#define _tcstod strtod
+#define _tcslen strlen
+#define _tcscmp strcmp
+#endif
 
 #include <iostream>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <random>
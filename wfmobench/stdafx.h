@@ -0,0 +1,44 @@
+// stdafx.h : include file for standard system include files,
+// or project specific include files that are used frequently, but
+// are changed infrequently
+//
+
+#pragma once
+
+#ifdef _WIN32
+#include "targetver.h"
+
+#include <stdio.h>
+#include <tchar.h>
+
+#include <WinSock2.h>
+#include <crtdbg.h>
+#else
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define _tmain main
+typedef char _TCHAR;
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+inline int closesocket(SOCKET s) { return ::close(s); }
+#endif
+
+#include <stdlib.h>
+#include <new>
+#include <iostream>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <random>
+#include <string>
+#include <sstream>
+#include <vector>
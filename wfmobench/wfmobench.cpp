@@ -0,0 +1,1327 @@
+// wfmobench.cpp : Microbenchmarks for WFMOHandler.
+//
+// Each benchmark registers a number of handles/timers with a WFMOHandler
+// and times one operation against the last one registered, the worst case
+// for any lookup that is linear in the number of registrations.
+//
+// Usage: wfmobench [--json] [--label <label>] [<benchmark>...]
+//
+// Only the benchmarks named are run, all of them by default: dispatch,
+// batch, churn, adjusttimer, alloc, timerchurn, timeraccuracy, timerslack,
+// post, coroutine (when built as C++20), wakelatency (with busy polling
+// too), loopgroup, recv (with io_uring too, on Linux), reuseport (Linux)
+// and udp.
+// With --json every result is printed as a JSON object on a line of its
+// own, tagged with the label -- a commit id, say -- so that the results of
+// different runs can be compared.
+//
+
+#include "stdafx.h"
+#include "wfmohandler.h"
+#include "asyncsocket.h"
+#include "loopgroup.h"
+#include "latency.h"
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * Every allocation made by the process is counted so that benchmarks can
+ * report allocations per operation. The replacement operators are kept out
+ * of line: inlined into their callers, GCC pairs malloc() or free() with
+ * the other operator and warns with -Wmismatched-new-delete.
+ */
+static std::atomic<size_t> g_allocations(0);
+
+#ifdef __GNUC__
+#define BENCH_NOINLINE __attribute__((noinline))
+#else
+#define BENCH_NOINLINE
+#endif
+
+BENCH_NOINLINE void* operator new(size_t cb)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = ::malloc(cb != 0 ? cb : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+BENCH_NOINLINE void operator delete(void* p) noexcept
+{
+    ::free(p);
+}
+BENCH_NOINLINE void operator delete(void* p, size_t) noexcept
+{
+    ::free(p);
+}
+
+/*
+ * A manual reset event that can be registered with WFMOHandler --
+ * a Win32 event on Windows and an eventfd on Linux.
+ */
+class BenchEvent {
+    WFMOHandler::WaitHandle m_h;
+    BenchEvent(const BenchEvent&);
+    BenchEvent& operator=(const BenchEvent&);
+public:
+#ifdef _WIN32
+    BenchEvent() : m_h(::CreateEvent(NULL, TRUE, FALSE, NULL)) {}
+    ~BenchEvent() { ::CloseHandle(m_h); }
+    void Set() { ::SetEvent(m_h); }
+    void Reset() { ::ResetEvent(m_h); }
+#else
+    BenchEvent() : m_h(::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) {}
+    ~BenchEvent() { ::close(m_h); }
+    void Set() { uint64_t one = 1; ssize_t rc = ::write(m_h, &one, sizeof(one)); (void)rc; }
+    void Reset() { uint64_t n = 0; ssize_t rc = ::read(m_h, &n, sizeof(n)); (void)rc; }
+#endif
+    operator WFMOHandler::WaitHandle() { return m_h; }
+};
+
+/*
+ * A non-blocking UDP socket bound to an ephemeral loopback port -- with
+ * an event selected for FD_READ on Windows.
+ */
+class BenchSocket {
+    SOCKET m_socket;
+#ifdef _WIN32
+    WSAEVENT m_event;
+#endif
+    struct sockaddr_in m_addr;
+    BenchSocket(const BenchSocket&);
+    BenchSocket& operator=(const BenchSocket&);
+public:
+    BenchSocket()
+        : m_socket(::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP))
+#ifdef _WIN32
+        , m_event(::WSACreateEvent())
+#endif
+    {
+        ::memset(&m_addr, 0, sizeof(m_addr));
+        m_addr.sin_family = AF_INET;
+        m_addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        int rcvbuf = 1024*1024;
+        ::setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&rcvbuf), sizeof(rcvbuf));
+        ::bind(m_socket, reinterpret_cast<const sockaddr*>(&m_addr), sizeof(m_addr));
+#ifdef _WIN32
+        int len = sizeof(m_addr);
+        ::WSAEventSelect(m_socket, m_event, FD_READ);   // also makes it non-blocking
+#else
+        socklen_t len = sizeof(m_addr);
+        ::fcntl(m_socket, F_SETFL, ::fcntl(m_socket, F_GETFL) | O_NONBLOCK);
+#endif
+        ::getsockname(m_socket, reinterpret_cast<sockaddr*>(&m_addr), &len);
+    }
+    ~BenchSocket()
+    {
+        ::closesocket(m_socket);
+#ifdef _WIN32
+        ::WSACloseEvent(m_event);
+#endif
+    }
+    /* returns false once there are no more datagrams to read */
+    bool Recv(char* buf, int len)
+    {
+        return ::recv(m_socket, buf, len, 0) >= 0;
+    }
+    /* sends a datagram to a loopback port, retrying while the send buffer is full */
+    void SendTo(unsigned short port, const char* buf, int len)
+    {
+        struct sockaddr_in to = m_addr;
+        to.sin_port = htons(port);
+        while (::sendto(m_socket, buf, len, 0, reinterpret_cast<const sockaddr*>(&to), sizeof(to)) < 0)
+            std::this_thread::yield();
+    }
+    void SendTo(const BenchSocket& to, const char* buf, int len)
+    { SendTo(to.Port(), buf, len); }
+    unsigned short Port() const { return ntohs(m_addr.sin_port); }
+#ifdef _WIN32
+    /* re-arms the event before the socket is drained */
+    void Reset() { ::WSAResetEvent(m_event); }
+    operator WFMOHandler::WaitHandle() { return m_event; }
+#else
+    void Reset() {}
+    operator WFMOHandler::WaitHandle() { return m_socket; }
+#endif
+};
+
+static bool g_fJson = false;
+static std::string g_label;
+static std::vector<std::string> g_selected;
+
+/* whether the benchmark was asked for on the command line */
+static bool Selected(const char* benchmark)
+{
+    if (g_selected.empty())
+        return true;
+    for (size_t i=0; i<g_selected.size(); i++) {
+        if (g_selected[i] == benchmark)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Prints a result, as text or as a JSON object.
+ * Parameters:
+ *  name          - what was measured
+ *  registrations - handles/timers registered, 0 if that doesn't apply
+ *  metric        - the unit of value
+ */
+static void Result(const char* name, size_t registrations, const char* metric, double value)
+{
+    // large values are rates, their fractions are noise
+    std::ostringstream formatted;
+    if (value >= 1000)
+        formatted << static_cast<unsigned long long>(value);
+    else
+        formatted << value;
+
+    if (g_fJson) {
+        std::cout << "{\"label\":\"" << g_label << "\",\"name\":\"" << name
+            << "\",\"registrations\":" << registrations
+            << ",\"metric\":\"" << metric << "\",\"value\":" << formatted.str() << "}" << std::endl;
+        return;
+    }
+    std::cout << name;
+    if (registrations != 0)
+        std::cout << " with " << registrations << " registrations";
+    std::cout << ": " << formatted.str() << " " << metric << std::endl;
+}
+
+static void Report(const char* name, size_t registrations, size_t ops, Clock::duration elapsed)
+{
+    double secs = std::chrono::duration<double>(elapsed).count();
+    Result(name, registrations, "ops/s", ops / secs);
+}
+
+/*
+ * Events dispatched per second when the last registered handle is the one
+ * being signalled. Its handler re-signals it, so the worker thread goes
+ * straight back to dispatching it.
+ */
+class DispatchBench : public WFMOHandler {
+    std::vector<BenchEvent*> m_events;
+    size_t m_target;
+    std::atomic<size_t> m_count;
+public:
+    DispatchBench(size_t registrations, size_t target)
+        : m_target(target)
+        , m_count(0)
+    {
+        for (size_t i=0; i<registrations; i++) {
+            BenchEvent* pEvent = new BenchEvent();
+            m_events.push_back(pEvent);
+            AddWaitHandle(*pEvent, std::bind(&DispatchBench::OnSignalled, this, pEvent));
+        }
+    }
+    ~DispatchBench()
+    {
+        Stop();
+        for (size_t i=0; i<m_events.size(); i++)
+            delete m_events[i];
+    }
+    void OnSignalled(BenchEvent* pEvent)
+    {
+        pEvent->Reset();
+        if (++m_count < m_target)
+            pEvent->Set();
+    }
+    void Run()
+    {
+        Start();
+        Clock::time_point start = Clock::now();
+        m_events.back()->Set();
+        while (m_count < m_target)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        Report("dispatch", m_events.size(), m_target, Clock::now() - start);
+    }
+};
+
+/*
+ * Events dispatched per second when all the registered handles are busy,
+ * each handler re-signalling its own handle, and how many of them each
+ * wake-up of the worker thread serves.
+ */
+class BatchBench : public WFMOHandler {
+    std::vector<BenchEvent*> m_events;
+    size_t m_target;
+    std::atomic<size_t> m_count;
+public:
+    BatchBench(size_t registrations, size_t target)
+        : m_target(target)
+        , m_count(0)
+    {
+        for (size_t i=0; i<registrations; i++) {
+            BenchEvent* pEvent = new BenchEvent();
+            m_events.push_back(pEvent);
+            AddWaitHandle(*pEvent, std::bind(&BatchBench::OnSignalled, this, pEvent));
+        }
+    }
+    ~BatchBench()
+    {
+        Stop();
+        for (size_t i=0; i<m_events.size(); i++)
+            delete m_events[i];
+    }
+    void OnSignalled(BenchEvent* pEvent)
+    {
+        pEvent->Reset();
+        if (++m_count < m_target)
+            pEvent->Set();
+    }
+    void Run()
+    {
+        Start();
+        Clock::time_point start = Clock::now();
+        for (size_t i=0; i<m_events.size(); i++)
+            m_events[i]->Set();
+        while (m_count < m_target)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        Report("all busy dispatch", m_events.size(), m_target, Clock::now() - start);
+        BatchStats stats = GetBatchStats();
+        Result("all busy dispatch", m_events.size(), "events/wake-up", static_cast<double>(stats.m_events) / stats.m_wakeups);
+        Result("all busy dispatch", m_events.size(), "largest batch", static_cast<double>(stats.m_maxbatch));
+    }
+};
+
+/*
+ * RemoveWaitHandle/AddWaitHandle pairs per second on the last registered
+ * handle, as seen by the calling thread. The calls only queue commands,
+ * the worker thread looks up and removes the handle. Then the same pairs
+ * made by a task on the worker thread, until they have been applied.
+ */
+class ChurnBench : public WFMOHandler {
+    std::vector<BenchEvent*> m_events;
+    std::atomic<bool> m_fDone;
+
+    void ChurnOnLoop(size_t iterations)
+    {
+        BenchEvent& last = *m_events.back();
+        for (size_t i=0; i<iterations; i++) {
+            RemoveWaitHandle(last);
+            AddWaitHandle(last, &ChurnBench::Nop);
+        }
+        // runs after the commands the pairs may have queued
+        Post(std::bind(&ChurnBench::OnDone, this));
+    }
+    void OnDone() { m_fDone = true; }
+
+public:
+    ChurnBench(size_t registrations)
+        : m_fDone(false)
+    {
+        for (size_t i=0; i<registrations; i++) {
+            m_events.push_back(new BenchEvent());
+            AddWaitHandle(*m_events.back(), &ChurnBench::Nop);
+        }
+    }
+    ~ChurnBench()
+    {
+        Stop();
+        for (size_t i=0; i<m_events.size(); i++)
+            delete m_events[i];
+    }
+    static void Nop() {}
+    void Run(size_t iterations)
+    {
+        Start();
+        BenchEvent& last = *m_events.back();
+        Clock::time_point start = Clock::now();
+        for (size_t i=0; i<iterations; i++) {
+            RemoveWaitHandle(last);
+            AddWaitHandle(last, &ChurnBench::Nop);
+        }
+        Report("remove+add", m_events.size(), iterations, Clock::now() - start);
+
+        start = Clock::now();
+        Post(std::bind(&ChurnBench::ChurnOnLoop, this, iterations));
+        while (!m_fDone)
+            std::this_thread::yield();
+        Report("remove+add on the loop", m_events.size(), iterations, Clock::now() - start);
+    }
+};
+
+/*
+ * AdjustTimer calls per second on the last timer added.
+ */
+class AdjustTimerBench : public WFMOHandler {
+    size_t m_timers;
+    unsigned m_lastid;
+public:
+    AdjustTimerBench(size_t timers)
+        : m_timers(timers)
+        , m_lastid(0)
+    {
+        for (size_t i=0; i<timers; i++)
+            m_lastid = AddTimer(60*1000, false, &AdjustTimerBench::Nop);
+    }
+    ~AdjustTimerBench()
+    {
+        Stop();
+    }
+    static void Nop() {}
+    void Run(size_t iterations)
+    {
+        Start();
+        Clock::time_point start = Clock::now();
+        for (size_t i=0; i<iterations; i++)
+            AdjustTimer(m_lastid, 60*1000, false);
+        Report("adjusttimer", m_timers, iterations, Clock::now() - start);
+    }
+};
+
+/*
+ * AddTimer/RemoveTimer pairs per second with a number of timers already
+ * pending in the timer wheel.
+ */
+class TimerChurnBench : public WFMOHandler {
+    size_t m_timers;
+public:
+    TimerChurnBench(size_t timers)
+        : m_timers(timers)
+    {
+        for (size_t i=0; i<timers; i++)
+            AddTimer(static_cast<unsigned>(1000 + i % (3600*1000)), false, &TimerChurnBench::Nop);
+    }
+    ~TimerChurnBench()
+    {
+        Stop();
+    }
+    static void Nop() {}
+    void Run(size_t iterations)
+    {
+        Start();
+        Clock::time_point start = Clock::now();
+        for (size_t i=0; i<iterations; i++)
+            RemoveTimer(AddTimer(static_cast<unsigned>(1000 + i % 60000), false, &TimerChurnBench::Nop));
+        Report("addtimer+removetimer", m_timers, iterations, Clock::now() - start);
+    }
+};
+
+/*
+ * Heap allocations per registration, counted over every thread. Handles
+ * are removed and added again with a std::bind() handler, a lambda and a
+ * functor too large to be held inline, and timers added and removed. The
+ * calls are made in rounds that the worker thread catches up with, after
+ * a warm-up round that lets the handler pool grow to its working set.
+ */
+class AllocBench : public WFMOHandler {
+    static const size_t ROUND = 1000;
+
+    std::vector<BenchEvent*> m_events;
+    std::atomic<bool> m_fSynced;
+
+    // a functor that doesn't fit in a Callable
+    struct Oversize {
+        char m_state[256];
+        void operator()() const {}
+    };
+
+    void OnSignal(BenchEvent*) {}
+    void OnSynced() { m_fSynced = true; }
+    static void Nop() {}
+
+    /* waits until the worker thread has applied the commands queued so far */
+    void Sync()
+    {
+        m_fSynced = false;
+        AddTimer(0, false, std::bind(&AllocBench::OnSynced, this));
+        while (!m_fSynced)
+            std::this_thread::yield();
+    }
+
+    template<typename Handler>
+    void ChurnHandles(Handler handler)
+    {
+        BenchEvent& last = *m_events.back();
+        for (size_t i=0; i<ROUND; i++) {
+            RemoveWaitHandle(last);
+            AddWaitHandle(last, handler);
+        }
+        Sync();
+    }
+
+    template<typename Handler>
+    void ChurnTimers(Handler handler)
+    {
+        for (size_t i=0; i<ROUND; i++)
+            RemoveTimer(AddTimer(60*1000, false, handler));
+        Sync();
+    }
+
+    template<typename Handler>
+    void MeasureHandles(const char* name, Handler handler, size_t rounds)
+    {
+        ChurnHandles(handler);
+        size_t allocations = g_allocations.load();
+        for (size_t i=0; i<rounds; i++)
+            ChurnHandles(handler);
+        allocations = g_allocations.load() - allocations;
+        Result(name, m_events.size(), "allocs/op", static_cast<double>(allocations) / (rounds * ROUND));
+    }
+
+public:
+    AllocBench(size_t registrations)
+        : m_fSynced(false)
+    {
+        for (size_t i=0; i<registrations; i++) {
+            m_events.push_back(new BenchEvent());
+            AddWaitHandle(*m_events.back(), &AllocBench::Nop);
+        }
+    }
+    ~AllocBench()
+    {
+        Stop();
+        for (size_t i=0; i<m_events.size(); i++)
+            delete m_events[i];
+    }
+    void Run(size_t rounds)
+    {
+        Start();
+        BenchEvent* pEvent = m_events.back();
+        MeasureHandles("alloc remove+add bind", std::bind(&AllocBench::OnSignal, this, pEvent), rounds);
+        AllocBench* pThis = this;
+        MeasureHandles("alloc remove+add lambda", [pThis, pEvent]() { pThis->OnSignal(pEvent); }, rounds);
+        MeasureHandles("alloc remove+add oversize", Oversize(), rounds);
+
+        ChurnTimers(std::bind(&AllocBench::OnSignal, this, pEvent));
+        size_t allocations = g_allocations.load();
+        for (size_t i=0; i<rounds; i++)
+            ChurnTimers(std::bind(&AllocBench::OnSignal, this, pEvent));
+        allocations = g_allocations.load() - allocations;
+        Result("alloc addtimer+removetimer", m_events.size(), "allocs/op",
+            static_cast<double>(allocations) / (rounds * ROUND));
+    }
+};
+
+/*
+ * Tasks posted per second from a number of threads, until the worker
+ * thread has run them all, and the worker's wake-ups per task: posts are
+ * coalesced, so a burst costs a wake-up rather than one per post. Neither
+ * the task's allocation from the loop's BlockPool nor its queueing takes a
+ * lock, so the posting threads only contend on the heads of the pool's
+ * free list and the command queue.
+ */
+class PostBench : public WFMOHandler {
+    std::atomic<size_t> m_ran;
+    size_t m_threads;
+    size_t m_posts;     // per thread
+
+    void OnTask() { m_ran.fetch_add(1, std::memory_order_relaxed); }
+
+    void Poster()
+    {
+        for (size_t i=0; i<m_posts; i++)
+            Post(std::bind(&PostBench::OnTask, this));
+    }
+
+public:
+    PostBench(size_t threads, size_t posts)
+        : m_ran(0)
+        , m_threads(threads)
+        , m_posts(posts)
+    {}
+    ~PostBench()
+    {
+        Stop();
+    }
+    void Run()
+    {
+        Start();
+        Metrics before;
+        GetMetrics(before);
+        Clock::time_point start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t i=0; i<m_threads; i++)
+            threads.push_back(std::thread(&PostBench::Poster, this));
+        for (size_t i=0; i<threads.size(); i++)
+            threads[i].join();
+        size_t total = m_threads * m_posts;
+        while (m_ran < total)
+            std::this_thread::yield();
+        Clock::duration elapsed = Clock::now() - start;
+        Metrics after;
+        bool fMetrics = GetMetrics(after);
+
+        std::string name = "post from " + std::to_string(m_threads) + " threads";
+        Report(name.c_str(), 0, total, elapsed);
+        if (fMetrics)
+            Result(name.c_str(), 0, "wakeups/post", static_cast<double>(after.m_wakeups - before.m_wakeups) / total);
+    }
+};
+
+#if WFMOHANDLER_COROUTINES
+/*
+ * Coroutines started per second, each of which awaits a signalled event
+ * twice, and the heap allocations that costs -- their frames and the
+ * registrations come from pools. Timers aren't awaited, their millisecond
+ * ticks would be all that's measured.
+ */
+class CoroutineBench : public WFMOHandler {
+    static const size_t ROUND = 1000;
+
+    BenchEvent m_event;
+    std::atomic<size_t> m_finished;
+
+    LoopTask Task()
+    {
+        co_await Readable(m_event);
+        co_await Readable(m_event);
+        m_finished.fetch_add(1);
+    }
+
+    /*
+     * Runs a round of coroutines one after the other, the event can only
+     * be awaited by one at a time
+     */
+    void RunRound()
+    {
+        for (size_t i=0; i<ROUND; i++) {
+            size_t target = m_finished + 1;
+            Task();
+            while (m_finished < target)
+                std::this_thread::yield();
+        }
+    }
+
+public:
+    CoroutineBench()
+        : m_finished(0)
+    {}
+    ~CoroutineBench()
+    {
+        Stop();
+    }
+    void Run(size_t rounds)
+    {
+        Start();
+        m_event.Set();  // left signalled
+        RunRound();     // warm-up
+        size_t allocations = g_allocations.load();
+        Clock::time_point start = Clock::now();
+        for (size_t i=0; i<rounds; i++)
+            RunRound();
+        Clock::duration elapsed = Clock::now() - start;
+        allocations = g_allocations.load() - allocations;
+        Report("coroutine readable x2", 0, rounds * ROUND, elapsed);
+        Result("coroutine readable x2", 0, "allocs/op", static_cast<double>(allocations) / (rounds * ROUND));
+    }
+};
+#endif
+
+/*
+ * How late timers go off while the worker thread is kept busy by a handle
+ * that is always signalled. One-off timers due over the next 100ms are
+ * added from another thread, and their handlers measure the time between
+ * when they were due and when they ran.
+ */
+class TimerAccuracyBench : public WFMOHandler {
+    BenchEvent m_busy;
+    size_t m_timers;
+    LatencyHistogram m_lateness;    // worker thread only until Stop()
+    std::atomic<size_t> m_fired;
+public:
+    TimerAccuracyBench(size_t timers)
+        : m_timers(timers)
+        , m_fired(0)
+    {
+        AddWaitHandle(m_busy, std::bind(&TimerAccuracyBench::OnBusy, this));
+    }
+    ~TimerAccuracyBench()
+    {
+        Stop();
+    }
+    void OnBusy()
+    {
+        // stays signalled, so the worker thread goes straight back to it
+    }
+    void OnTimer(uint64_t due)
+    {
+        uint64_t now = MonotonicNanos();
+        m_lateness.Record(now > due ? now - due : 0);
+        m_fired++;
+    }
+    void Run()
+    {
+        Start();
+        m_busy.Set();
+        std::minstd_rand rng(1);
+        for (size_t i=0; i<m_timers; i++) {
+            unsigned ms = 1 + rng() % 100;
+            AddTimer(ms, false, std::bind(&TimerAccuracyBench::OnTimer, this, MonotonicNanos() + ms * 1000000ULL));
+        }
+        while (m_fired < m_timers)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        Stop();
+        Result("timer lateness p50", m_timers, "us", m_lateness.Percentile(50) / 1000.0);
+        Result("timer lateness p99", m_timers, "us", m_lateness.Percentile(99) / 1000.0);
+        Result("timer lateness max", m_timers, "us", m_lateness.Max() / 1000.0);
+    }
+};
+
+/*
+ * Wake-ups per second of a loop that has nothing but repeat timers to run,
+ * for a number of timers and a slack. Their intervals are spread over
+ * PERIOD_MS to twice that, so that their expiries are spread out as those
+ * of per-session timers are, and without slack every millisecond or so
+ * has one due.
+ */
+class TimerSlackBench : public WFMOHandler {
+    size_t m_timers;
+    unsigned m_slack;
+    std::atomic<size_t> m_fired;
+
+    void OnTimer() { m_fired.fetch_add(1, std::memory_order_relaxed); }
+
+public:
+    static const unsigned PERIOD_MS = 100;
+    static const unsigned DURATION_MS = 2000;
+
+    TimerSlackBench(size_t timers, unsigned slack)
+        : m_timers(timers)
+        , m_slack(slack)
+        , m_fired(0)
+    {}
+    ~TimerSlackBench()
+    {
+        Stop();
+    }
+    void Run()
+    {
+        std::minstd_rand rng(1);
+        for (size_t i=0; i<m_timers; i++)
+            AddTimer(PERIOD_MS + rng() % PERIOD_MS, true, std::bind(&TimerSlackBench::OnTimer, this), m_slack);
+        Start();
+        // past the wake-ups that apply the AddTimer() commands
+        std::this_thread::sleep_for(std::chrono::milliseconds(PERIOD_MS));
+        Metrics before;
+        GetMetrics(before);
+        size_t fired = m_fired;
+        Clock::time_point start = Clock::now();
+        std::this_thread::sleep_for(std::chrono::milliseconds(DURATION_MS));
+        Metrics after;
+        bool fMetrics = GetMetrics(after);
+        double secs = std::chrono::duration<double>(Clock::now() - start).count();
+        fired = m_fired - fired;
+        Stop();
+
+        std::string name = "repeat timers slack " + std::to_string(m_slack) + "ms";
+        Result(name.c_str(), m_timers, "timers/s", fired / secs);
+        if (fMetrics) {
+            uint64_t wakeups = after.m_wakeups - before.m_wakeups;
+            Result(name.c_str(), m_timers, "wakeups/s", wakeups / secs);
+            Result(name.c_str(), m_timers, "timers/wakeup", wakeups > 0 ? static_cast<double>(fired) / wakeups : 0);
+        }
+    }
+};
+
+// std::chrono::milliseconds takes these by reference
+const unsigned TimerSlackBench::PERIOD_MS;
+const unsigned TimerSlackBench::DURATION_MS;
+
+/*
+ * The time from a handler on one WFMOHandler signalling a handle to the
+ * handler of that handle running on another WFMOHandler's thread. Two
+ * loops bounce a wake-up back and forth, blocking in the kernel between
+ * wake-ups or, with busy polling, spinning first. Spinning only pays with
+ * a core per loop.
+ */
+class WakeLatencyBench {
+    class Loop : public WFMOHandler {
+    public:
+        BenchEvent m_event;
+        Loop* m_pPeer;
+        std::atomic<uint64_t> m_sentns;     // when the peer signalled m_event
+        LatencyHistogram m_latency;         // this loop's thread only until Stop()
+        std::atomic<size_t>* m_pCount;
+        size_t m_target;
+
+        Loop(std::atomic<size_t>* pCount, size_t target, unsigned usBusyPoll)
+            : m_pPeer(NULL), m_sentns(0), m_pCount(pCount), m_target(target)
+        {
+            if (usBusyPoll > 0)
+                EnableBusyPoll(usBusyPoll, 0);
+            AddWaitHandle(m_event, std::bind(&Loop::OnWoken, this));
+        }
+        ~Loop()
+        {
+            Stop();
+        }
+        void OnWoken()
+        {
+            m_event.Reset();
+            m_latency.Record(MonotonicNanos() - m_sentns.load());
+            if (++*m_pCount < m_target)
+                Wake(m_pPeer);
+        }
+        static void Wake(Loop* pLoop)
+        {
+            pLoop->m_sentns = MonotonicNanos();
+            pLoop->m_event.Set();
+        }
+    };
+
+    std::atomic<size_t> m_count;
+    size_t m_target;
+    unsigned m_usBusyPoll;
+public:
+    WakeLatencyBench(size_t target, unsigned usBusyPoll = 0)
+        : m_count(0)
+        , m_target(target)
+        , m_usBusyPoll(usBusyPoll)
+    {}
+    void Run()
+    {
+        Loop a(&m_count, m_target, m_usBusyPoll), b(&m_count, m_target, m_usBusyPoll);
+        a.m_pPeer = &b;
+        b.m_pPeer = &a;
+        a.Start();
+        b.Start();
+        Clock::time_point start = Clock::now();
+        Loop::Wake(&a);
+        while (m_count < m_target)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        Clock::duration elapsed = Clock::now() - start;
+        a.Stop();
+        b.Stop();
+        // the loops took turns, each has half the wake-ups
+        LatencyHistogram& h = a.m_latency;
+        h.Add(b.m_latency);
+        std::string name = "cross-thread wake";
+        if (m_usBusyPoll > 0)
+            name += ", busy poll " + std::to_string(m_usBusyPoll) + "us";
+        Report(name.c_str(), 0, m_target, elapsed);
+        Result((name + " p50").c_str(), 0, "us", h.Percentile(50) / 1000.0);
+        Result((name + " p99").c_str(), 0, "us", h.Percentile(99) / 1000.0);
+        Result((name + " max").c_str(), 0, "us", h.Max() / 1000.0);
+        if (m_usBusyPoll > 0) {
+            WFMOHandler::BusyPollStats sa = a.GetBusyPollStats(), sb = b.GetBusyPollStats();
+            uint64_t spins = sa.m_spins + sb.m_spins;
+            uint64_t spinningns = sa.m_spinningns + sb.m_spinningns;
+            uint64_t waitingns = spinningns + sa.m_sleepingns + sb.m_sleepingns;
+            Result((name + " spin hits").c_str(), 0, "%",
+                spins > 0 ? 100.0 * (sa.m_spinhits + sb.m_spinhits) / spins : 0.0);
+            Result((name + " waiting spent spinning").c_str(), 0, "%",
+                waitingns > 0 ? 100.0 * spinningns / waitingns : 0.0);
+        }
+    }
+};
+
+/*
+ * A LoopGroup of two loops. Messages sent per second from one loop's
+ * worker thread to the other's with Send(), and the receiving loop's
+ * wake-ups per message. Then a handle migrated back and forth between the
+ * loops, each move timed until its handler has run on the new loop, and
+ * the loads the group counts once it's done.
+ */
+class LoopGroupBench {
+    typedef LoopGroup<WFMOHandler> Group;
+
+    Group m_group;
+    std::atomic<size_t> m_received;
+    std::atomic<size_t> m_arrived;  // the loop the migrated handle's handler last ran on
+
+    static void OnMessage(void* pContext, void*)
+    {
+        LoopGroupBench* pThis = static_cast<LoopGroupBench*>(pContext);
+        pThis->m_received.fetch_add(1, std::memory_order_relaxed);
+    }
+    void Sender(size_t messages)
+    {
+        for (size_t i=0; i<messages; i++) {
+            while (!m_group.Send(0, 1, &LoopGroupBench::OnMessage, this, NULL))
+                std::this_thread::yield();
+        }
+    }
+    void OnSignalled(BenchEvent* pEvent)
+    {
+        pEvent->Reset();
+        m_arrived = m_group.CurrentLoop();
+    }
+
+public:
+    LoopGroupBench()
+        : m_group(2, Group::LEAST_LOADED)
+        , m_received(0)
+        , m_arrived(Group::NO_LOOP)
+    {}
+    void Run(size_t messages, size_t migrations)
+    {
+        m_group.Start(false);
+
+        WFMOHandler::Metrics before;
+        m_group[1].GetMetrics(before);
+        Clock::time_point start = Clock::now();
+        m_group[0].Post(std::bind(&LoopGroupBench::Sender, this, messages));
+        while (m_received < messages)
+            std::this_thread::yield();
+        Clock::duration elapsed = Clock::now() - start;
+        WFMOHandler::Metrics after;
+        bool fMetrics = m_group[1].GetMetrics(after);
+        Report("loopgroup send", 0, messages, elapsed);
+        if (fMetrics)
+            Result("loopgroup send", 0, "wakeups/message",
+                static_cast<double>(after.m_wakeups - before.m_wakeups) / messages);
+
+        // the event is set until the handler has run on the loop the handle
+        // went to, the old loop may reset it on the way out
+        BenchEvent event;
+        size_t at = m_group.AddWaitHandle(event, std::bind(&LoopGroupBench::OnSignalled, this, &event));
+        while (m_arrived != at) {
+            event.Set();
+            std::this_thread::yield();
+        }
+        start = Clock::now();
+        for (size_t i=0; i<migrations; i++) {
+            size_t to = 1 - at;
+            m_group.MigrateWaitHandle(event, at, to, std::bind(&LoopGroupBench::OnSignalled, this, &event));
+            while (m_arrived != to) {
+                event.Set();
+                std::this_thread::yield();
+            }
+            at = to;
+        }
+        elapsed = Clock::now() - start;
+        Report("loopgroup migrate", 0, migrations, elapsed);
+        Result("loopgroup migrate", 0, "handles counted", static_cast<double>(m_group.Load(0) + m_group.Load(1)));
+        m_group.RemoveWaitHandle(at, event);
+        m_group.Stop();
+    }
+};
+
+/*
+ * Datagrams handled per second as they are spread over a growing number of
+ * UDP sockets, with the handlers run inline on the worker thread or in the
+ * dispatch pool. Each datagram costs the handler a few microseconds of CPU,
+ * standing in for parsing or logging it. The sender keeps a bounded number
+ * of datagrams outstanding so that none are dropped.
+ */
+class SocketBench : public WFMOHandler {
+    std::vector<BenchSocket*> m_sockets;
+    BenchSocket m_sender;
+    bool m_fPooled;
+    std::atomic<size_t> m_count;
+public:
+    static const unsigned WORK_US = 5;
+    static const size_t WINDOW = 256;
+
+    SocketBench(size_t sockets, bool fPooled)
+        : m_fPooled(fPooled)
+        , m_count(0)
+    {
+        if (fPooled)
+            EnableDispatchPool();
+        for (size_t i=0; i<sockets; i++) {
+            BenchSocket* pSocket = new BenchSocket();
+            m_sockets.push_back(pSocket);
+            AddWaitHandle(*pSocket, std::bind(&SocketBench::OnReadable, this, pSocket));
+        }
+    }
+    ~SocketBench()
+    {
+        Stop();
+        for (size_t i=0; i<m_sockets.size(); i++)
+            delete m_sockets[i];
+    }
+    void OnReadable(BenchSocket* pSocket)
+    {
+        char buf[64];
+        pSocket->Reset();
+        while (pSocket->Recv(buf, sizeof(buf))) {
+            Clock::time_point until = Clock::now() + std::chrono::microseconds(WORK_US);
+            while (Clock::now() < until)
+                ;
+            m_count++;
+        }
+    }
+    void Run(size_t datagrams)
+    {
+        Start();
+        char buf[32] = {0};
+        Clock::time_point start = Clock::now();
+        for (size_t sent=0; sent<datagrams; sent++) {
+            while (sent - m_count >= WINDOW)
+                std::this_thread::yield();
+            m_sender.SendTo(*m_sockets[sent % m_sockets.size()], buf, sizeof(buf));
+        }
+        while (m_count < datagrams)
+            std::this_thread::yield();
+        Report(m_fPooled ? "udp pooled" : "udp inline", m_sockets.size(), datagrams, Clock::now() - start);
+    }
+};
+
+// std::chrono::microseconds takes it by reference
+const unsigned SocketBench::WORK_US;
+
+/*
+ * Datagrams received per second, and allocations made per datagram, by a
+ * single UDP socket. The legacy receiver is what the sample's AsyncSocket
+ * used to do: allocate a 64K buffer per call and read one datagram per
+ * readiness event, fed one sendto() at a time like the old netsend. The
+ * others are AsyncSocket and DatagramSender moving a batch of datagrams
+ * per system call, a batch of 1 being the cost of one call per datagram.
+ * With io_uring the sender still sends batches of that size, but the
+ * socket is registered with AddReceiveHandle() and gets WINDOW buffers.
+ * The receiving side's system calls per datagram are counted as well:
+ * the waits plus the receive calls for epoll, the io_uring_enter() calls
+ * for io_uring.
+ */
+class ReceiveBench : public WFMOHandler {
+    BenchSocket m_legacy;
+    AsyncSocket m_socket;
+    DatagramSender m_sender;
+    bool m_fLegacy;
+    bool m_fUring;
+    size_t m_nBatch;
+    std::atomic<size_t> m_count;
+public:
+    static const size_t WINDOW = 256;
+
+    ReceiveBench(bool fLegacy, size_t nBatch, bool fUring = false)
+        : m_socket(0, std::bind(&ReceiveBench::OnDatagrams, this, std::placeholders::_1, std::placeholders::_2),
+            AsyncSocket::DEFAULT_BUFFER_SIZE, fUring ? WINDOW : nBatch)
+        , m_sender(fLegacy ? 1 : nBatch)
+        , m_fLegacy(fLegacy)
+        , m_fUring(false)
+        , m_nBatch(fLegacy ? 1 : nBatch)
+        , m_count(0)
+    {
+#if WFMOHANDLER_IO_URING
+        m_fUring = fUring && EnableIoUring();
+#endif
+        if (fLegacy)
+            AddWaitHandle(m_legacy, std::bind(&ReceiveBench::OnLegacyReadable, this));
+        else
+            m_socket.Register(*this);
+    }
+    /* false if io_uring was asked for and isn't available */
+    bool IsReady(bool fUring) const
+    { return m_fUring == fUring; }
+    ~ReceiveBench()
+    {
+        Stop();
+    }
+    void OnLegacyReadable()
+    {
+        std::vector<char> buf(64*1024);
+        if (m_legacy.Recv(&buf[0], static_cast<int>(buf.size())))
+            m_count++;
+        else
+            m_legacy.Reset();
+    }
+    void OnDatagrams(const AsyncSocket::Datagram* pDatagrams, size_t count)
+    {
+        (void)pDatagrams;
+        m_count += count;
+    }
+    void Run(size_t datagrams)
+    {
+        char buf[32] = {0};
+        Datagram d;
+        d.m_data = buf;
+        d.m_len = sizeof(buf);
+        d.m_truncated = false;
+        d.m_addr = UdpSocket::LoopbackAddress(m_fLegacy ? m_legacy.Port() : m_socket.Port());
+        std::vector<Datagram> batch(m_nBatch, d);
+
+        Start();
+        size_t allocations = g_allocations.load();
+        Clock::time_point start = Clock::now();
+        for (size_t sent=0; sent<datagrams; ) {
+            size_t n = datagrams - sent < m_nBatch ? datagrams - sent : m_nBatch;
+            while (sent + n - m_count > WINDOW)
+                std::this_thread::yield();
+            sent += m_sender.Send(&batch[0], n);
+        }
+        while (m_count < datagrams)
+            std::this_thread::yield();
+        Clock::duration elapsed = Clock::now() - start;
+        allocations = g_allocations.load() - allocations;
+        Stop();
+        std::string name = m_fLegacy ? std::string("udp recv legacy")
+            : (m_fUring ? "udp recv uring batch " : "udp recv batch ") + std::to_string(m_nBatch);
+        Report(name.c_str(), 0, datagrams, elapsed);
+        Result(name.c_str(), 0, "allocations/packet", static_cast<double>(allocations) / datagrams);
+        Metrics metrics;
+        if (!m_fLegacy && GetMetrics(metrics)) {
+            uint64_t syscalls = m_fUring ? metrics.m_ringenters : metrics.m_wakeups + m_socket.ReceiveCalls();
+            Result(name.c_str(), 0, "syscalls/packet", static_cast<double>(syscalls) / datagrams);
+        }
+    }
+};
+
+#ifndef _WIN32
+/*
+ * Datagrams handled per second by one loop per core, for a growing number
+ * of cores. Each loop is pinned to its core and has its own AsyncSocket
+ * bound to the same port with SO_REUSEPORT, and the kernel spreads the
+ * sender's FLOWS flows -- a socket each -- across them. Like in
+ * SocketBench, each datagram costs its handler WORK_US of CPU and the
+ * sender keeps a bounded number of datagrams outstanding. Linux only,
+ * Windows has no SO_REUSEPORT.
+ */
+class ReusePortBench {
+    struct Loop : public WFMOHandler {
+        AsyncSocket m_socket;
+        std::atomic<size_t> m_count;
+        Loop(unsigned short port, unsigned cpu)
+            : m_socket(port, std::bind(&Loop::OnDatagrams, this, std::placeholders::_1, std::placeholders::_2),
+                AsyncSocket::DEFAULT_BUFFER_SIZE, AsyncSocket::DEFAULT_BUFFER_COUNT, true)
+            , m_count(0)
+        {
+            PinWorkerThread(cpu);
+            m_socket.Register(*this);
+        }
+        ~Loop()
+        {
+            Stop();
+        }
+        void OnDatagrams(const AsyncSocket::Datagram* pDatagrams, size_t count)
+        {
+            (void)pDatagrams;
+            Clock::time_point until = Clock::now() + std::chrono::microseconds(WORK_US * count);
+            while (Clock::now() < until)
+                ;
+            m_count.fetch_add(count, std::memory_order_relaxed);
+        }
+    };
+    std::vector<Loop*> m_loops;
+    std::vector<DatagramSender*> m_senders;
+public:
+    static const unsigned WORK_US = 5;
+    static const size_t WINDOW = 128;   // the sockets' default buffers hold less than SocketBench's
+    static const size_t FLOWS = 16;
+    static const size_t BATCH = 32;
+
+    ReusePortBench(unsigned cores)
+    {
+        unsigned short port = 0;
+        for (unsigned cpu=0; cpu<cores; cpu++) {
+            m_loops.push_back(new Loop(port, cpu));
+            port = m_loops[0]->m_socket.Port();
+        }
+        for (size_t i=0; i<FLOWS; i++)
+            m_senders.push_back(new DatagramSender(BATCH));
+    }
+    ~ReusePortBench()
+    {
+        for (size_t i=0; i<m_loops.size(); i++)
+            delete m_loops[i];
+        for (size_t i=0; i<m_senders.size(); i++)
+            delete m_senders[i];
+    }
+    size_t Received() const
+    {
+        size_t n = 0;
+        for (size_t i=0; i<m_loops.size(); i++)
+            n += m_loops[i]->m_count.load(std::memory_order_relaxed);
+        return n;
+    }
+    void Run(size_t datagrams)
+    {
+        for (size_t i=0; i<m_loops.size(); i++) {
+            if (!m_loops[i]->Start()) {
+                std::cerr << "reuseport: can't start a loop on cpu " << i << std::endl;
+                return;
+            }
+        }
+        char buf[32] = {0};
+        Datagram d;
+        d.m_data = buf;
+        d.m_len = sizeof(buf);
+        d.m_truncated = false;
+        d.m_addr = UdpSocket::LoopbackAddress(m_loops[0]->m_socket.Port());
+        std::vector<Datagram> batch(BATCH, d);
+
+        Clock::time_point start = Clock::now();
+        for (size_t sent=0, flow=0; sent<datagrams; flow++) {
+            size_t n = datagrams - sent < BATCH ? datagrams - sent : BATCH;
+            while (sent + n - Received() > WINDOW)
+                std::this_thread::yield();
+            sent += m_senders[flow % FLOWS]->Send(&batch[0], n);
+        }
+        while (Received() < datagrams)
+            std::this_thread::yield();
+        Clock::duration elapsed = Clock::now() - start;
+
+        // how evenly the kernel spread the flows
+        size_t busiest = 0;
+        for (size_t i=0; i<m_loops.size(); i++) {
+            size_t n = m_loops[i]->m_count.load(std::memory_order_relaxed);
+            busiest = n > busiest ? n : busiest;
+        }
+        std::string name = "reuseport " + std::to_string(m_loops.size()) + " cores";
+        Report(name.c_str(), 0, datagrams, elapsed);
+        Result(name.c_str(), 0, "busiest loop share", static_cast<double>(busiest) / datagrams);
+    }
+};
+#endif
+
+/*
+ * The per-timer kernel object approach WFMOHandler used before the timer
+ * wheel, as a baseline for TimerChurnBench: create, arm, cancel and close
+ * a waitable timer (timerfd on Linux) per timer.
+ */
+static void KernelTimerBench(size_t iterations)
+{
+    Clock::time_point start = Clock::now();
+    for (size_t i=0; i<iterations; i++) {
+#ifdef _WIN32
+        HANDLE h = ::CreateWaitableTimer(NULL, TRUE, NULL);
+        LARGE_INTEGER due = {0, 0};
+        due.QuadPart = -10000LL * static_cast<LONGLONG>(1000 + i % 60000);
+        ::SetWaitableTimer(h, &due, 0, NULL, NULL, FALSE);
+        ::CancelWaitableTimer(h);
+        ::CloseHandle(h);
+#else
+        int fd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+        struct itimerspec its = {};
+        its.it_value.tv_sec = 1 + static_cast<time_t>(i % 60);
+        ::timerfd_settime(fd, 0, &its, NULL);
+        its.it_value.tv_sec = 0;
+        ::timerfd_settime(fd, 0, &its, NULL);
+        ::close(fd);
+#endif
+    }
+    Report("kernel timer arm+cancel", 0, iterations, Clock::now() - start);
+}
+
+/* command line arguments are ASCII */
+static std::string Narrow(const _TCHAR* arg)
+{
+    std::string s;
+    while (*arg != 0)
+        s += static_cast<char>(*arg++);
+    return s;
+}
+
+int _tmain(int argc, _TCHAR* argv[])
+{
+    for (int i=1; i<argc; i++) {
+        std::string arg = Narrow(argv[i]);
+        if (arg == "--json")
+            g_fJson = true;
+        else if (arg == "--label" && i+1 < argc)
+            g_label = Narrow(argv[++i]);
+        else
+            g_selected.push_back(arg);
+    }
+
+#ifdef _WIN32
+    WSADATA wsad = {0};
+    ::WSAStartup(MAKEWORD(2, 2), &wsad);
+#endif
+
+    Result("hardware concurrency", 0, "threads", std::thread::hardware_concurrency());
+
+    const size_t registrations[] = { 1, 62, 10000 };
+    for (size_t i=0; i<sizeof(registrations)/sizeof(registrations[0]); i++) {
+        size_t n = registrations[i];
+        if (Selected("dispatch")) { DispatchBench b(n, 200000); b.Run(); }
+        if (Selected("batch")) { BatchBench b(n, 1000000); b.Run(); }
+        if (Selected("churn")) { ChurnBench b(n); b.Run(100000); }
+        if (Selected("adjusttimer")) { AdjustTimerBench b(n); b.Run(100000); }
+        if (Selected("alloc")) { AllocBench b(n); b.Run(100); }
+    }
+
+    if (Selected("timerchurn")) {
+        KernelTimerBench(100000);
+        const size_t timers[] = { 62, 10000, 1000000 };
+        for (size_t i=0; i<sizeof(timers)/sizeof(timers[0]); i++) {
+            TimerChurnBench b(timers[i]);
+            b.Run(1000000);
+        }
+    }
+
+    if (Selected("timeraccuracy")) {
+        const size_t timers[] = { 100, 10000 };
+        for (size_t i=0; i<sizeof(timers)/sizeof(timers[0]); i++) {
+            TimerAccuracyBench b(timers[i]);
+            b.Run();
+        }
+    }
+
+    if (Selected("timerslack")) {
+        const size_t timers[] = { 100, 1000, 10000 };
+        const unsigned slacks[] = { 0, 10, 50 };
+        for (size_t i=0; i<sizeof(timers)/sizeof(timers[0]); i++) {
+            for (size_t j=0; j<sizeof(slacks)/sizeof(slacks[0]); j++) {
+                TimerSlackBench b(timers[i], slacks[j]);
+                b.Run();
+            }
+        }
+    }
+
+    if (Selected("post")) {
+        const size_t threads[] = { 1, 2, 4 };
+        for (size_t i=0; i<sizeof(threads)/sizeof(threads[0]); i++) {
+            PostBench b(threads[i], 1000000 / threads[i]);
+            b.Run();
+        }
+    }
+
+#if WFMOHANDLER_COROUTINES
+    if (Selected("coroutine")) {
+        CoroutineBench b;
+        b.Run(20);
+    }
+#endif
+
+    if (Selected("wakelatency")) {
+        const unsigned busypoll[] = { 0, 20, 100 };
+        for (size_t i=0; i<sizeof(busypoll)/sizeof(busypoll[0]); i++) {
+            WakeLatencyBench b(100000, busypoll[i]);
+            b.Run();
+        }
+    }
+
+    if (Selected("loopgroup")) {
+        LoopGroupBench b;
+        b.Run(1000000, 10000);
+    }
+
+    if (Selected("recv")) {
+        { ReceiveBench b(true, 1); b.Run(200000); }
+        const size_t batches[] = { 1, 8, 32, 64 };
+        for (size_t i=0; i<sizeof(batches)/sizeof(batches[0]); i++) {
+            ReceiveBench b(false, batches[i]);
+            b.Run(200000);
+        }
+#if WFMOHANDLER_IO_URING
+        for (size_t i=0; i<sizeof(batches)/sizeof(batches[0]); i++) {
+            ReceiveBench b(false, batches[i], true);
+            if (b.IsReady(true))
+                b.Run(200000);
+        }
+#endif
+    }
+
+#ifndef _WIN32
+    if (Selected("reuseport")) {
+        // 1, 2, 4, ... cores, and all of them
+        unsigned nCores = std::thread::hardware_concurrency();
+        for (unsigned cores=1; ; cores*=2) {
+            if (cores > nCores)
+                cores = nCores;
+            ReusePortBench b(cores > 0 ? cores : 1);
+            b.Run(200000);
+            if (cores >= nCores)
+                break;
+        }
+    }
+#endif
+
+    if (Selected("udp")) {
+        const size_t sockets[] = { 1, 4, 16, 64, 256 };
+        for (size_t i=0; i<sizeof(sockets)/sizeof(sockets[0]); i++) {
+            { SocketBench b(sockets[i], false); b.Run(100000); }
+            { SocketBench b(sockets[i], true); b.Run(100000); }
+        }
+    }
+
+#ifdef _WIN32
+    ::WSACleanup();
+#endif
+    return 0;
+}
@@ -0,0 +1,409 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+// WinSock2.h has to come before Windows.h, which wfmohandler.h includes
+#include "datagram.h"
+#include <functional>
+#include "wfmohandler.h"
+
+/*
+ * A simple class that implements an asynchronous 'recv' UDP socket.
+ * Socket binds to loopback address!
+ *
+ * Datagrams are received into a slab of fixed size buffers that the socket
+ * allocates once, up front, so the receive path does not allocate. Every
+ * readiness event reads the socket until it would block or the receive
+ * budget is spent, and the datagrams are handed to the receive handler as
+ * spans into the slab, a slab-full at a time. On Linux a slab-full is read
+ * with one recvmmsg() call. The budget caps the datagrams and bytes read
+ * per event, so that a flooded socket leaves the rest for the loop's next
+ * iteration, see SetReceiveBudget(). On a loop that uses io_uring,
+ * Register() has the ring receive the datagrams instead, into buffers of
+ * its own. Otherwise Register() moves the slab to the loop's NUMA node, if
+ * it has one.
+ */
+class AsyncSocket : public UdpSocket {
+public:
+    typedef ::Datagram Datagram;
+
+    /*
+     * Called with the datagrams received, in the order they arrived. The
+     * data is only valid until the handler returns.
+     */
+    typedef std::function<void (const Datagram* pDatagrams, size_t count)> ReceiveHandler;
+
+    static const size_t DEFAULT_BUFFER_SIZE = 2048;     // bytes per datagram
+    static const size_t DEFAULT_BUFFER_COUNT = 32;      // datagrams per handler call
+
+    /**
+     * Creates the socket and binds it to the given loopback port.
+     * Parameters:
+     *  port     - port to bind to, 0 for an ephemeral port (see Port())
+     *  handler  - receives the datagrams; if empty, their sizes are
+     *             logged to std::cerr
+     *  cbBuffer - size of a buffer, longer datagrams are truncated
+     *  nBuffers - number of buffers in the slab, which is also the batch
+     *             size: the most datagrams read per system call (Linux)
+     *             and passed per handler call
+     *  fReusePort - share the port with other sockets bound with
+     *             SO_REUSEPORT, one per event loop say (Linux only)
+     * Throws:
+     *  std::runtime_error if the socket can't be created
+     */
+    AsyncSocket(unsigned short port,
+            ReceiveHandler handler = ReceiveHandler(),
+            size_t cbBuffer = DEFAULT_BUFFER_SIZE,
+            size_t nBuffers = DEFAULT_BUFFER_COUNT,
+            bool fReusePort = false)
+        : UdpSocket(port, true, fReusePort)
+        , m_handler(handler)
+        , m_cbBuffer(cbBuffer)
+        , m_cbSlab(cbBuffer * (nBuffers > 0 ? nBuffers : 1))
+        , m_pSlab(static_cast<char*>(NumaMemory::Allocate(m_cbSlab, NumaMemory::ANY_NODE)))
+        , m_datagrams(nBuffers > 0 ? nBuffers : 1)
+        , m_maxdatagrams(0)
+        , m_maxbytes(0)
+        , m_receivecalls(0)
+        , m_cutoffs(0)
+#ifdef _WIN32
+        , m_event(::WSACreateEvent())
+#else
+        , m_msgs(m_datagrams.size())
+        , m_iovecs(m_datagrams.size())
+#endif
+    {
+        if (m_pSlab == NULL) {
+#ifdef _WIN32
+            if (m_event != NULL) ::WSACloseEvent(m_event);
+#endif
+            throw std::bad_alloc();
+        }
+#ifdef _WIN32
+        // put it in 'async' mode
+        if (m_event == NULL || ::WSAEventSelect(m_socket, m_event, FD_READ) != 0) {
+            std::cerr << "Error initializing AsyncSocket, error code: " << LastError() << std::endl;
+            if (m_event != NULL) ::WSACloseEvent(m_event);
+            NumaMemory::Free(m_pSlab, m_cbSlab);
+            throw std::runtime_error("socket creation error");
+        }
+#else
+        // the headers point at the slab until it moves, only the lengths change
+        for (size_t i=0; i<m_datagrams.size(); i++) {
+            m_iovecs[i].iov_base = Buffer(i);
+            m_iovecs[i].iov_len = m_cbBuffer;
+            struct msghdr& hdr = m_msgs[i].msg_hdr;
+            ::memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &m_datagrams[i].m_addr;
+            hdr.msg_iov = &m_iovecs[i];
+            hdr.msg_iovlen = 1;
+        }
+#endif
+    }
+    ~AsyncSocket()
+    {
+#ifdef _WIN32
+        Close();
+        ::WSACloseEvent(m_event);
+#endif
+        NumaMemory::Free(m_pSlab, m_cbSlab);
+    }
+
+    /* for direct access to the handle to register with WFMOHandler */
+    operator WFMOHandler::WaitHandle()
+    {
+#ifdef _WIN32
+        return m_event;
+#else
+        return m_socket;
+#endif
+    }
+
+    /**
+     * Registers the socket with a loop: with AddReceiveHandle(), using as
+     * many buffers as the slab has, if the loop uses io_uring, otherwise
+     * with ReadIncomingPackets() as the handler, after moving the slab to
+     * the loop's NUMA node. Must be called before any datagram is read.
+     * Parameters:
+     *  loop   - the loop
+     *  limits - the handle's priority & rate limit, see
+     *           WFMOHandler::HandleLimits
+     * Returns:
+     *  what AddWaitHandle()/AddReceiveHandle() returned
+     */
+    bool Register(WFMOHandler& loop, const WFMOHandler::HandleLimits& limits = WFMOHandler::HandleLimits())
+    {
+#if WFMOHANDLER_IO_URING
+        if (loop.UsesIoUring())
+            return loop.AddReceiveHandle(*this,
+                std::bind(&AsyncSocket::Deliver, this, std::placeholders::_1, std::placeholders::_2),
+                m_cbBuffer, static_cast<unsigned>(m_datagrams.size()), limits);
+#endif
+        if (loop.NumaNode() != NumaMemory::ANY_NODE)
+            PlaceSlab(loop.NumaNode());
+        return loop.AddWaitHandle(*this, std::bind(&AsyncSocket::ReadIncomingPackets, this), limits);
+    }
+
+    /**
+     * Caps what ReadIncomingPackets() reads per readiness event. What's
+     * left in the socket is read on the loop's next iteration, after the
+     * other handles that are ready have had their turn. The bytes are
+     * checked after each slab-full, so a read may go over by up to one.
+     * Once the budget is spent the socket is peeked at, one more system
+     * call, to tell whether it cut the read short, see BudgetCutoffs().
+     * The ring's receives aren't affected: the ring delivers a slab-full
+     * at most per wake-up anyway.
+     * Must be called before Register().
+     * Parameters:
+     *  maxDatagrams - most datagrams per event, 0 for no limit
+     *  maxBytes     - most bytes per event, 0 for no limit
+     */
+    void SetReceiveBudget(size_t maxDatagrams, size_t maxBytes)
+    {
+        m_maxdatagrams = maxDatagrams;
+        m_maxbytes = maxBytes;
+    }
+
+    /*
+     * The receive system calls made by ReadIncomingPackets(), to be read
+     * once the loop has stopped
+     */
+    uint64_t ReceiveCalls() const
+    { return m_receivecalls; }
+
+    /*
+     * The times ReadIncomingPackets() stopped on its receive budget with
+     * datagrams left in the socket, to be read once the loop has stopped
+     */
+    uint64_t BudgetCutoffs() const
+    { return m_cutoffs; }
+
+    /*
+     * Reads the incoming packets in the socket's recv buffer, all of them
+     * or as many as the receive budget allows, handing them to the receive
+     * handler. This is the handler to register with WFMOHandler.
+     */
+    void ReadIncomingPackets()
+    {
+#ifdef _WIN32
+        // reset the event before draining: FD_READ is re-enabled by recvfrom(),
+        // so a packet arriving after the last call, or left behind by the
+        // budget, signals it again
+        ::WSAResetEvent(m_event);
+#endif
+        size_t nLeft = m_maxdatagrams > 0 ? m_maxdatagrams : static_cast<size_t>(-1);
+        size_t cbLeft = m_maxbytes > 0 ? m_maxbytes : static_cast<size_t>(-1);
+        for (;;) {
+            size_t nMax = nLeft < m_datagrams.size() ? nLeft : m_datagrams.size();
+            size_t n = ReceiveBatch(nMax);
+            if (n > 0)
+                Deliver(&m_datagrams[0], n);
+            if (n < nMax)
+                break;      // a short batch means the socket ran dry
+            size_t cb = 0;
+            for (size_t i=0; i<n; i++)
+                cb += m_datagrams[i].m_len;
+            nLeft -= n;
+            cbLeft = cb < cbLeft ? cbLeft - cb : 0;
+            if (nLeft == 0 || cbLeft == 0) {
+                // a budget spent on the socket's last datagram left nothing behind
+                if (IsPending())
+                    m_cutoffs++;
+                break;
+            }
+        }
+    }
+
+    /**
+     * Receives a datagram into buf without blocking, for the socket's
+     * owner to read it itself rather than through the receive handler --
+     * as WFMOHandler::Recv() does.
+     * Returns:
+     *  false if there was nothing to receive
+     */
+    bool ReceiveFrom(char* buf, size_t cbBuf, Datagram& d)
+    {
+#ifdef _WIN32
+        ::WSAResetEvent(m_event);   // see ReadIncomingPackets()
+        return ReceiveInto(buf, cbBuf, d);
+#else
+        socklen_t fromlen = sizeof(d.m_addr);
+        ssize_t cbRecd;
+        do {
+            // MSG_TRUNC returns the full length of a datagram that didn't fit
+            cbRecd = ::recvfrom(m_socket, buf, cbBuf, MSG_DONTWAIT|MSG_TRUNC,
+                reinterpret_cast<sockaddr*>(&d.m_addr), &fromlen);
+        } while (cbRecd < 0 && errno == EINTR);
+        if (cbRecd < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+                std::cerr << "Error receiving data from port " << m_port
+                      << ", error code: " << errno << std::endl;
+            return false;
+        }
+        d.m_data = buf;
+        d.m_truncated = static_cast<size_t>(cbRecd) > cbBuf;
+        d.m_len = d.m_truncated ? cbBuf : cbRecd;
+        return true;
+#endif
+    }
+
+private:
+    AsyncSocket();
+    AsyncSocket(const AsyncSocket&);
+    AsyncSocket& operator=(const AsyncSocket&);
+
+    /**
+     * Fills the slab with as many datagrams as can be read without
+     * blocking, nMax at most.
+     * Returns:
+     *  the number of datagrams read
+     */
+    size_t ReceiveBatch(size_t nMax)
+    {
+#ifdef _WIN32
+        size_t n = 0;
+        while (n < nMax) {
+            m_receivecalls++;
+            if (!ReceiveOne(n, m_datagrams[n]))
+                break;
+            n++;
+        }
+        return n;
+#else
+        for (size_t i=0; i<nMax; i++)
+            m_msgs[i].msg_hdr.msg_namelen = sizeof(m_datagrams[i].m_addr);
+        int rc;
+        do {
+            m_receivecalls++;
+            rc = ::recvmmsg(m_socket, &m_msgs[0], static_cast<unsigned>(nMax), MSG_DONTWAIT, NULL);
+        } while (rc < 0 && errno == EINTR);
+        if (rc < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+                std::cerr << "Error receiving data from port " << m_port
+                      << ", error code: " << errno << std::endl;
+            return 0;
+        }
+        for (int i=0; i<rc; i++) {
+            Datagram& d = m_datagrams[i];
+            d.m_data = Buffer(i);
+            d.m_len = m_msgs[i].msg_len;
+            d.m_truncated = (m_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+        }
+        return rc;
+#endif
+    }
+
+    /*
+     * Whether a datagram is waiting to be read, which is peeked at rather
+     * than read
+     */
+    bool IsPending()
+    {
+        char c;
+        m_receivecalls++;
+#ifdef _WIN32
+        // a datagram longer than the byte peeked at fails with WSAEMSGSIZE
+        return ::recv(m_socket, &c, 1, MSG_PEEK) != SOCKET_ERROR || LastError() == WSAEMSGSIZE;
+#else
+        ssize_t rc;
+        do {
+            rc = ::recv(m_socket, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+        } while (rc < 0 && errno == EINTR);
+        return rc >= 0;
+#endif
+    }
+
+#ifdef _WIN32
+    /* Receives a datagram into buffer i of the slab */
+    bool ReceiveOne(size_t i, Datagram& d)
+    {
+        return ReceiveInto(Buffer(i), m_cbBuffer, d);
+    }
+
+    /**
+     * Receives a datagram into buf.
+     * Returns:
+     *  false if there was nothing to receive
+     */
+    bool ReceiveInto(char* buf, size_t cbBuf, Datagram& d)
+    {
+        int fromlen = sizeof(d.m_addr);
+        int cbRecd = ::recvfrom(m_socket,
+            buf,
+            static_cast<int>(cbBuf),
+            0,
+            reinterpret_cast<sockaddr*>(&d.m_addr),
+            &fromlen);
+        if (cbRecd >= 0) {
+            d.m_data = buf;
+            d.m_len = cbRecd;
+            d.m_truncated = false;
+            return true;
+        }
+
+        int rc = LastError();
+        if (rc == WSAEMSGSIZE) {
+            d.m_data = buf;
+            d.m_len = cbBuf;
+            d.m_truncated = true;
+            return true;
+        }
+        if (rc != WSAEWOULDBLOCK) {
+            // something else went wrong
+            std::cerr << "Error receiving data from port " << m_port
+                  << ", error code: " << rc << std::endl;
+        }
+        return false;
+    }
+#endif
+
+    char* Buffer(size_t i)
+    { return m_pSlab + i * m_cbBuffer; }
+
+    /* Reallocates the slab on a NUMA node, it's kept where it is if that fails */
+    void PlaceSlab(int node)
+    {
+        char* pSlab = static_cast<char*>(NumaMemory::Allocate(m_cbSlab, node));
+        if (pSlab == NULL)
+            return;
+        NumaMemory::Free(m_pSlab, m_cbSlab);
+        m_pSlab = pSlab;
+#ifndef _WIN32
+        for (size_t i=0; i<m_iovecs.size(); i++)
+            m_iovecs[i].iov_base = Buffer(i);
+#endif
+    }
+
+    void Deliver(const Datagram* pDatagrams, size_t count)
+    {
+        if (m_handler) {
+            m_handler(pDatagrams, count);
+            return;
+        }
+        for (size_t i=0; i<count; i++)
+            std::cerr << pDatagrams[i].m_len << " bytes received on port " << m_port << std::endl;
+    }
+
+    ReceiveHandler m_handler;
+    size_t m_cbBuffer;
+    size_t m_cbSlab;
+    char* m_pSlab;                          // the buffers, m_cbBuffer bytes each
+    std::vector<Datagram> m_datagrams;      // one per buffer
+    size_t m_maxdatagrams;                  // see SetReceiveBudget()
+    size_t m_maxbytes;
+    uint64_t m_receivecalls;                // see ReceiveCalls()
+    uint64_t m_cutoffs;                     // see BudgetCutoffs()
+#ifdef _WIN32
+    WSAEVENT m_event;
+#else
+    std::vector<struct mmsghdr> m_msgs;     // one per buffer, for recvmmsg()
+    std::vector<struct iovec> m_iovecs;
+#endif
+};
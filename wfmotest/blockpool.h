@@ -0,0 +1,265 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <atomic>
+#include "numa.h"
+
+/*
+ * A small object allocator. Blocks of up to MAX_BLOCK bytes are carved out
+ * of chunks of about 16K in power of two size classes and go back to the
+ * free list of their class when freed, so once a pool has grown to the
+ * program's working set, allocating from it no longer touches the heap.
+ * Chunks are only returned when the pool is destroyed. Larger requests are
+ * passed on to operator new.
+ *
+ * Blocks are 16 byte aligned. Any thread may allocate and free without
+ * taking a lock: each free list is a Treiber stack whose head carries a
+ * count of the pops made from it, so a pop that raced with others fails
+ * its compare-exchange instead of installing a link that has since
+ * changed. The links sit in a 16 byte header in front of each block, so a
+ * pop that loses the race never reads memory the block's new owner is
+ * writing to. The head packs the block's address into 44 bits, which
+ * holds the 48 bit user address space of x64 and ARM64.
+ *
+ * Once PlaceOnNode() has been called, chunks are NUMA_CHUNK_SIZE pages
+ * allocated on a NUMA node instead.
+ */
+class BlockPool {
+public:
+    static const size_t MIN_BLOCK = 16;
+    static const size_t MAX_BLOCK = 4096;
+    static const size_t CHUNK_SIZE = 16384;
+    static const size_t NUMA_CHUNK_SIZE = 65536;
+
+    BlockPool()
+        : m_chunks(NULL)
+        , m_node(NumaMemory::ANY_NODE)
+    {
+        for (size_t i=0; i<CLASSES; i++)
+            m_free[i].store(0, std::memory_order_relaxed);
+    }
+    ~BlockPool()
+    {
+        while (Chunk* pChunk = m_chunks.load(std::memory_order_relaxed)) {
+            m_chunks.store(pChunk->m_hdr.m_next, std::memory_order_relaxed);
+            Release(pChunk);
+        }
+    }
+
+    /**
+     * Has the chunks the pool grows by from now on come from a NUMA node.
+     * Blocks already carved out stay where they are.
+     * Parameters:
+     *  node - the node, NumaMemory::ANY_NODE to go back to operator new
+     */
+    void PlaceOnNode(int node)
+    {
+        m_node.store(node, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns a block of at least cb bytes.
+     * Throws:
+     *  std::bad_alloc if the pool can't grow
+     */
+    void* Allocate(size_t cb)
+    {
+        if (cb > MAX_BLOCK)
+            return ::operator new(cb);
+        size_t c = ClassOf(cb);
+        uint64_t head = m_free[c].load(std::memory_order_acquire);
+        for (;;) {
+            Link* p = LinkOf(head);
+            if (p == NULL) {
+                Grow(c);
+                head = m_free[c].load(std::memory_order_acquire);
+                continue;
+            }
+            // should another thread have taken p since head was read, this
+            // reads a stale link and the pop count fails the exchange
+            Link* pNext = p->m_next.load(std::memory_order_relaxed);
+            if (m_free[c].compare_exchange_weak(head, Pack(pNext, PopsOf(head) + 1),
+                    std::memory_order_acquire, std::memory_order_acquire))
+                return p + 1;
+        }
+    }
+
+    /* Returns a block, cb being the size it was allocated with */
+    void Free(void* p, size_t cb)
+    {
+        if (p == NULL)
+            return;
+        if (cb > MAX_BLOCK) {
+            ::operator delete(p);
+            return;
+        }
+        Link* pLink = static_cast<Link*>(p) - 1;
+        Push(ClassOf(cb), pLink, pLink);
+    }
+
+    /* Destroys an object constructed in a block of this pool */
+    template<typename T>
+    void Delete(T* p)
+    {
+        if (p == NULL)
+            return;
+        p->~T();
+        Free(p, sizeof(T));
+    }
+
+private:
+    static const size_t CLASSES = 9;    // 16, 32, ... 4096
+    static const int POPS_SHIFT = 44;   // a free list head's pop count is in the bits above this
+
+    // the header in front of every block, linking it into its free list
+    struct Link {
+        std::atomic<Link*> m_next;
+        char m_pad[MIN_BLOCK - sizeof(std::atomic<Link*>)];
+    };
+    // chunk header, padded so that the blocks after it stay 16 byte aligned
+    union Chunk {
+        struct Header {
+            Chunk* m_next;
+            size_t m_cbMapped;          // size of a chunk from NumaMemory, 0 if from operator new
+        } m_hdr;
+        char m_pad[MIN_BLOCK];
+    };
+
+    static size_t ClassOf(size_t cb)
+    {
+        size_t c = 0;
+        for (size_t size=MIN_BLOCK; size<cb; size<<=1)
+            c++;
+        return c;
+    }
+
+    // a free list head: the block's address over 16, and the pop count
+    static uint64_t Pack(Link* p, uint64_t pops)
+    { return (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(p)) >> 4) | (pops << POPS_SHIFT); }
+    static Link* LinkOf(uint64_t head)
+    { return reinterpret_cast<Link*>(static_cast<uintptr_t>((head & ((uint64_t(1) << POPS_SHIFT) - 1)) << 4)); }
+    static uint64_t PopsOf(uint64_t head)
+    { return head >> POPS_SHIFT; }
+
+    /* pushes the blocks pFirst..pLast, already linked, onto free list c */
+    void Push(size_t c, Link* pFirst, Link* pLast)
+    {
+        uint64_t head = m_free[c].load(std::memory_order_relaxed);
+        do {
+            pLast->m_next.store(LinkOf(head), std::memory_order_relaxed);
+        } while (!m_free[c].compare_exchange_weak(head, Pack(pFirst, PopsOf(head)),
+                std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    static void Release(Chunk* pChunk)
+    {
+        if (pChunk->m_hdr.m_cbMapped != 0)
+            NumaMemory::Free(pChunk, pChunk->m_hdr.m_cbMapped);
+        else
+            ::operator delete(pChunk);
+    }
+
+    /* carves a new chunk into blocks of class c and frees them */
+    void Grow(size_t c)
+    {
+        size_t stride = sizeof(Link) + (MIN_BLOCK << c);
+        size_t cbChunk = sizeof(Chunk) + CHUNK_SIZE / (MIN_BLOCK << c) * stride;
+        Chunk* pChunk = NULL;
+        int node = m_node.load(std::memory_order_relaxed);
+        if (node != NumaMemory::ANY_NODE) {
+            // the header comes out of the pages, which are whole already
+            cbChunk = NUMA_CHUNK_SIZE;
+            pChunk = static_cast<Chunk*>(NumaMemory::Allocate(cbChunk, node));
+            if (pChunk == NULL)
+                throw std::bad_alloc();
+            pChunk->m_hdr.m_cbMapped = cbChunk;
+        } else {
+            pChunk = static_cast<Chunk*>(::operator new(cbChunk));
+            pChunk->m_hdr.m_cbMapped = 0;
+        }
+        if ((reinterpret_cast<uintptr_t>(pChunk) + cbChunk) >> 4 >> POPS_SHIFT != 0) {
+            Release(pChunk);    // beyond what a free list head can address
+            throw std::bad_alloc();
+        }
+        pChunk->m_hdr.m_next = m_chunks.load(std::memory_order_relaxed);
+        while (!m_chunks.compare_exchange_weak(pChunk->m_hdr.m_next, pChunk,
+                std::memory_order_relaxed, std::memory_order_relaxed))
+            ;
+        char* pEnd = reinterpret_cast<char*>(pChunk) + cbChunk;
+        Link* pFirst = NULL;
+        Link* pLast = NULL;
+        for (char* p=reinterpret_cast<char*>(pChunk + 1); p+stride<=pEnd; p+=stride) {
+            Link* pLink = new (p) Link;
+            if (pLast != NULL)
+                pLast->m_next.store(pLink, std::memory_order_relaxed);
+            else
+                pFirst = pLink;
+            pLast = pLink;
+        }
+        Push(c, pFirst, pLast);
+    }
+
+    std::atomic<uint64_t> m_free[CLASSES];
+    std::atomic<Chunk*> m_chunks;
+    std::atomic<int> m_node;            // where chunks come from, see PlaceOnNode()
+
+    BlockPool(const BlockPool&);
+    BlockPool& operator=(const BlockPool&);
+};
+
+/*
+ * An STL allocator on top of a BlockPool, for the node based containers
+ * of objects whose lifetime the pool's owner controls.
+ */
+template<typename T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+    typedef T* pointer;
+    typedef const T* const_pointer;
+    typedef T& reference;
+    typedef const T& const_reference;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    template<typename U> struct rebind { typedef PoolAllocator<U> other; };
+
+    PoolAllocator(BlockPool& pool)
+        : m_pPool(&pool)
+    {}
+    template<typename U>
+    PoolAllocator(const PoolAllocator<U>& other)
+        : m_pPool(other.Pool())
+    {}
+
+    T* allocate(size_t n)
+    { return static_cast<T*>(m_pPool->Allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n)
+    { m_pPool->Free(p, n * sizeof(T)); }
+
+    size_t max_size() const
+    { return static_cast<size_t>(-1) / sizeof(T); }
+
+    BlockPool* Pool() const
+    { return m_pPool; }
+
+private:
+    BlockPool* m_pPool;
+};
+
+template<typename T, typename U>
+inline bool operator==(const PoolAllocator<T>& a, const PoolAllocator<U>& b)
+{ return a.Pool() == b.Pool(); }
+template<typename T, typename U>
+inline bool operator!=(const PoolAllocator<T>& a, const PoolAllocator<U>& b)
+{ return a.Pool() != b.Pool(); }
@@ -0,0 +1,130 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * The spin budget of an event loop that polls for ready handles before it
+ * blocks in the kernel, and where the loop's waiting time went.
+ *
+ * The budget adapts the way KVM's halt polling does. A wait that blocks
+ * and is woken by an event within the largest budget shows that spinning
+ * a little longer would have caught the event without the sleep, so the
+ * budget doubles. A wait that blocks for longer, woken by an event or a
+ * timer, shows the loop is idle, so the budget halves, down to 0, and an
+ * idle loop stops burning CPU. An event caught while spinning leaves the
+ * budget as it is.
+ *
+ * Written by the worker thread only; the counters may be read from any.
+ */
+class BusyPoll {
+public:
+    static const unsigned DEFAULT_MAX_US = 50;      // see Enable()
+    static const unsigned DEFAULT_SOCKET_US = 50;
+
+    BusyPoll()
+        : m_maxns(0), m_budgetns(0), m_socketus(0)
+        , m_spins(0), m_spinhits(0), m_sleeps(0), m_spinningns(0), m_sleepingns(0)
+    {}
+
+    /**
+     * Parameters:
+     *  usMax    - most microseconds to spin per wait, 0 for none
+     *  usSocket - SO_BUSY_POLL for the loop's sockets, 0 to leave it alone
+     */
+    void Enable(unsigned usMax, unsigned usSocket)
+    {
+        m_maxns = static_cast<uint64_t>(usMax) * 1000;
+        m_socketus = usSocket;
+        m_budgetns.store(m_maxns, std::memory_order_relaxed);
+    }
+
+    bool IsEnabled() const
+    { return m_maxns != 0; }
+
+    unsigned SocketUs() const
+    { return m_socketus; }
+
+    /**
+     * Returns:
+     *  nanoseconds to spin before a wait that times out after msTimeout
+     *  (-1 for never), 0 to block at once
+     */
+    uint64_t Budget(int64_t msTimeout) const
+    {
+        uint64_t ns = m_budgetns.load(std::memory_order_relaxed);
+        if (msTimeout >= 0 && ns > static_cast<uint64_t>(msTimeout) * 1000000)
+            ns = static_cast<uint64_t>(msTimeout) * 1000000;
+        return ns;
+    }
+
+    /* A spin of ns has ended, fReady if it found something to do */
+    void Spun(uint64_t ns, bool fReady)
+    {
+        Add(m_spins, 1);
+        Add(m_spinningns, ns);
+        if (fReady)
+            Add(m_spinhits, 1);
+    }
+
+    /*
+     * A blocking wait of ns has returned, fReady if not on a timeout. A
+     * long wait shrinks the budget however it ended.
+     */
+    void Slept(uint64_t ns, bool fReady)
+    {
+        Add(m_sleeps, 1);
+        Add(m_sleepingns, ns);
+        uint64_t budget = m_budgetns.load(std::memory_order_relaxed);
+        if (ns <= m_maxns) {
+            if (!fReady)
+                return;     // a timer due soon says nothing about events
+            if (budget < GROW_START_NS)
+                budget = GROW_START_NS;
+            else
+                budget *= 2;
+            if (budget > m_maxns)
+                budget = m_maxns;
+        } else {
+            budget /= 2;
+            if (budget < GROW_START_NS)
+                budget = 0;
+        }
+        m_budgetns.store(budget, std::memory_order_relaxed);
+    }
+
+    uint64_t BudgetNs() const { return m_budgetns.load(std::memory_order_relaxed); }
+    uint64_t Spins() const { return m_spins.load(std::memory_order_relaxed); }
+    uint64_t SpinHits() const { return m_spinhits.load(std::memory_order_relaxed); }
+    uint64_t Sleeps() const { return m_sleeps.load(std::memory_order_relaxed); }
+    uint64_t SpinningNs() const { return m_spinningns.load(std::memory_order_relaxed); }
+    uint64_t SleepingNs() const { return m_sleepingns.load(std::memory_order_relaxed); }
+
+private:
+    static const uint64_t GROW_START_NS = 2000;    // a budget grows from this, shrinks to 0 below it
+
+    // single writer, so no read-modify-write is needed
+    static void Add(std::atomic<uint64_t>& counter, uint64_t n)
+    { counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+
+    uint64_t m_maxns;                   // 0 if busy polling is off
+    std::atomic<uint64_t> m_budgetns;   // current spin per wait
+    unsigned m_socketus;
+    std::atomic<uint64_t> m_spins;      // waits that spun first
+    std::atomic<uint64_t> m_spinhits;   // spins that found something to do
+    std::atomic<uint64_t> m_sleeps;     // waits that blocked
+    std::atomic<uint64_t> m_spinningns;
+    std::atomic<uint64_t> m_sleepingns;
+
+    BusyPoll(const BusyPoll&);
+    BusyPoll& operator=(const BusyPoll&);
+};
@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <string.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "blockpool.h"
+
+/*
+ * A move-only, type erased void() function object. Functors of up to
+ * INLINE_SIZE bytes -- a std::bind() of a member function, its object
+ * and a couple of arguments, or a lambda with a few captures -- are held
+ * in the object itself, so constructing one doesn't allocate. Larger ones,
+ * ones aligned beyond 8 bytes and ones that might throw when moved go to a
+ * block of the BlockPool given to the constructor.
+ *
+ * Unlike std::function, the functor is only ever moved, so it may be a
+ * move-only type.
+ */
+class Callable {
+public:
+    static const size_t INLINE_SIZE = 56;
+
+private:
+    union Storage {
+        void* m_align1;
+        double m_align2;
+        long long m_align3;
+        char m_buf[INLINE_SIZE];
+    };
+
+public:
+    /**
+     * Parameters:
+     *  f    - the functor, moved into the Callable
+     *  pool - where a functor that doesn't fit inline is placed, must
+     *         outlive the Callable
+     * Throws:
+     *  std::bad_alloc, or whatever moving f throws
+     */
+    template<typename F>
+    Callable(F f, BlockPool& pool)
+        : m_ops(NULL)
+    {
+        Construct(f, pool, std::integral_constant<bool, FitsInline<F>::value>());
+    }
+
+    Callable(Callable&& other)
+        : m_ops(other.m_ops)
+    {
+        if (m_ops != NULL) {
+            m_ops->m_move(&m_storage, &other.m_storage);
+            other.m_ops = NULL;
+        }
+    }
+
+    ~Callable()
+    {
+        if (m_ops != NULL)
+            m_ops->m_destroy(&m_storage);
+    }
+
+    void operator()()
+    { m_ops->m_invoke(&m_storage); }
+
+    /* whether a functor of type F is held without allocating */
+    template<typename F>
+    struct FitsInline {
+        static const bool value = sizeof(F) <= INLINE_SIZE
+            && std::alignment_of<F>::value <= std::alignment_of<Storage>::value
+            && std::is_nothrow_move_constructible<F>::value;
+    };
+
+private:
+    // what a functor held out of line leaves in m_storage
+    struct Remote {
+        void* m_pTarget;
+        BlockPool* m_pPool;
+    };
+
+    struct Ops {
+        void (*m_invoke)(void* pStorage);
+        void (*m_move)(void* pTo, void* pFrom);     // leaves pFrom destroyed
+        void (*m_destroy)(void* pStorage);
+    };
+
+    template<typename F>
+    struct InlineOps {
+        static void Invoke(void* pStorage)
+        { (*static_cast<F*>(pStorage))(); }
+        static void Move(void* pTo, void* pFrom)
+        {
+            F* pF = static_cast<F*>(pFrom);
+            new (pTo) F(std::move(*pF));
+            pF->~F();
+        }
+        static void Destroy(void* pStorage)
+        { static_cast<F*>(pStorage)->~F(); }
+        static const Ops s_ops;
+    };
+
+    template<typename F>
+    struct RemoteOps {
+        static void Invoke(void* pStorage)
+        { (*static_cast<F*>(static_cast<Remote*>(pStorage)->m_pTarget))(); }
+        static void Move(void* pTo, void* pFrom)
+        { ::memcpy(pTo, pFrom, sizeof(Remote)); }
+        static void Destroy(void* pStorage)
+        {
+            Remote* pRemote = static_cast<Remote*>(pStorage);
+            pRemote->m_pPool->Delete(static_cast<F*>(pRemote->m_pTarget));
+        }
+        static const Ops s_ops;
+    };
+
+    template<typename F>
+    void Construct(F& f, BlockPool&, std::true_type)
+    {
+        new (&m_storage) F(std::move(f));
+        m_ops = &InlineOps<F>::s_ops;
+    }
+
+    template<typename F>
+    void Construct(F& f, BlockPool& pool, std::false_type)
+    {
+        static_assert(std::alignment_of<F>::value <= BlockPool::MIN_BLOCK, "functor is over-aligned");
+        void* p = pool.Allocate(sizeof(F));
+        try {
+            new (p) F(std::move(f));
+        } catch (...) {
+            pool.Free(p, sizeof(F));
+            throw;
+        }
+        Remote* pRemote = reinterpret_cast<Remote*>(&m_storage);
+        pRemote->m_pTarget = p;
+        pRemote->m_pPool = &pool;
+        m_ops = &RemoteOps<F>::s_ops;
+    }
+
+    Storage m_storage;
+    const Ops* m_ops;   // NULL once moved from
+
+    Callable(const Callable&);
+    Callable& operator=(const Callable&);
+};
+
+template<typename F>
+const Callable::Ops Callable::InlineOps<F>::s_ops = {
+    &Callable::InlineOps<F>::Invoke, &Callable::InlineOps<F>::Move, &Callable::InlineOps<F>::Destroy
+};
+
+template<typename F>
+const Callable::Ops Callable::RemoteOps<F>::s_ops = {
+    &Callable::RemoteOps<F>::Invoke, &Callable::RemoteOps<F>::Move, &Callable::RemoteOps<F>::Destroy
+};
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#else
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+#include <string.h>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+
+/* A datagram and the address it came from, or is going to */
+struct Datagram {
+    const char* m_data;
+    size_t m_len;
+    bool m_truncated;           // larger than its buffer, m_data holds its first m_len bytes
+    struct sockaddr_in m_addr;
+};
+
+/*
+ * A UDP socket bound to the loopback address.
+ */
+class UdpSocket {
+public:
+#ifdef _WIN32
+    typedef SOCKET Socket;
+#else
+    typedef int Socket;
+#endif
+
+    /* the port the socket is bound to */
+    unsigned short Port() const
+    { return m_port; }
+
+    /* the socket error code of the last failed call */
+    static int LastError()
+    {
+#ifdef _WIN32
+        return ::WSAGetLastError();
+#else
+        return errno;
+#endif
+    }
+
+    /* a loopback address, for Datagram::m_addr */
+    static struct sockaddr_in LoopbackAddress(unsigned short port)
+    {
+        struct sockaddr_in sin;
+        ::memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(port);
+        sin.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+        return sin;
+    }
+
+protected:
+    /**
+     * Creates the socket and binds it.
+     * Parameters:
+     *  port         - port to bind to, 0 for an ephemeral port
+     *  fNonBlocking - put the socket in non-blocking mode. On Windows
+     *                 WSAEventSelect() does that instead.
+     *  fReusePort   - let other sockets with fReusePort bind the same
+     *                 port, the kernel spreads the datagrams across them
+     *                 by flow. Linux only, it fails on Windows.
+     * Throws:
+     *  std::runtime_error if the socket can't be created
+     */
+    UdpSocket(unsigned short port, bool fNonBlocking, bool fReusePort = false)
+        : m_port(port)
+#ifdef _WIN32
+        , m_socket(::WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, 0))
+#else
+        , m_socket(::socket(AF_INET, SOCK_DGRAM|SOCK_CLOEXEC|(fNonBlocking ? SOCK_NONBLOCK : 0), IPPROTO_UDP))
+#endif
+    {
+        (void)fNonBlocking;
+        struct sockaddr_in sin = LoopbackAddress(port);
+#ifdef _WIN32
+        int len = sizeof(sin);
+#else
+        socklen_t len = sizeof(sin);
+#endif
+        if (m_socket != InvalidSocket()
+            && (!fReusePort || EnableReusePort())
+            && ::bind(m_socket, reinterpret_cast<const sockaddr*>(&sin), sizeof(sin)) == 0
+            && ::getsockname(m_socket, reinterpret_cast<sockaddr*>(&sin), &len) == 0) {
+            m_port = ntohs(sin.sin_port);
+            return;
+        }
+
+        std::cerr << "Error initializing socket, error code: " << LastError() << std::endl;
+
+        Close();
+        throw std::runtime_error("socket creation error");
+    }
+    ~UdpSocket()
+    {
+        Close();
+    }
+
+    static Socket InvalidSocket()
+    {
+#ifdef _WIN32
+        return INVALID_SOCKET;
+#else
+        return -1;
+#endif
+    }
+
+    /* SO_REUSEPORT, which has to be set before the socket is bound */
+    bool EnableReusePort()
+    {
+#ifdef _WIN32
+        // SO_REUSEADDR lets a port be bound twice but doesn't balance the load
+        ::WSASetLastError(WSAEOPNOTSUPP);
+        return false;
+#else
+        int on = 1;
+        return ::setsockopt(m_socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0;
+#endif
+    }
+
+    void Close()
+    {
+        if (m_socket != InvalidSocket()) {
+#ifdef _WIN32
+            ::closesocket(m_socket);
+#else
+            ::close(m_socket);
+#endif
+            m_socket = InvalidSocket();
+        }
+    }
+
+    unsigned short m_port;
+    Socket m_socket;
+
+private:
+    UdpSocket();
+    UdpSocket(const UdpSocket&);
+    UdpSocket& operator=(const UdpSocket&);
+};
+
+/*
+ * A blocking UDP socket that sends arrays of datagrams, up to a batch of
+ * them per system call -- sendmmsg() on Linux. Windows has no equivalent,
+ * so there each datagram costs a sendto().
+ */
+class DatagramSender : public UdpSocket {
+public:
+    static const size_t DEFAULT_BATCH_SIZE = 32;
+
+    /**
+     * Parameters:
+     *  nBatch - the most datagrams sent per system call
+     * Throws:
+     *  std::runtime_error if the socket can't be created
+     */
+    DatagramSender(size_t nBatch = DEFAULT_BATCH_SIZE)
+        : UdpSocket(0, false)
+#ifndef _WIN32
+        , m_msgs(nBatch > 0 ? nBatch : 1)
+        , m_iovecs(m_msgs.size())
+#endif
+    {
+        (void)nBatch;
+    }
+
+    /**
+     * Sends the datagrams, each to its m_addr. Blocks while the send
+     * buffer is full.
+     * Returns:
+     *  the number of datagrams sent, less than count only on an error
+     */
+    size_t Send(const Datagram* pDatagrams, size_t count)
+    {
+        size_t sent = 0;
+        while (sent < count) {
+#ifdef _WIN32
+            const Datagram& d = pDatagrams[sent];
+            if (::sendto(m_socket, d.m_data, static_cast<int>(d.m_len), 0,
+                    reinterpret_cast<const sockaddr*>(&d.m_addr), sizeof(d.m_addr)) == SOCKET_ERROR)
+                break;
+            sent++;
+#else
+            size_t n = count - sent;
+            if (n > m_msgs.size())
+                n = m_msgs.size();
+            for (size_t i=0; i<n; i++) {
+                const Datagram& d = pDatagrams[sent + i];
+                m_iovecs[i].iov_base = const_cast<char*>(d.m_data);
+                m_iovecs[i].iov_len = d.m_len;
+                struct msghdr& hdr = m_msgs[i].msg_hdr;
+                ::memset(&hdr, 0, sizeof(hdr));
+                hdr.msg_name = const_cast<struct sockaddr_in*>(&d.m_addr);
+                hdr.msg_namelen = sizeof(d.m_addr);
+                hdr.msg_iov = &m_iovecs[i];
+                hdr.msg_iovlen = 1;
+            }
+            int rc = ::sendmmsg(m_socket, &m_msgs[0], static_cast<unsigned>(n), 0);
+            if (rc < 0) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            sent += rc;
+#endif
+        }
+        if (sent < count)
+            std::cerr << "Error sending datagrams, error code: " << LastError() << std::endl;
+        return sent;
+    }
+
+private:
+#ifndef _WIN32
+    std::vector<struct mmsghdr> m_msgs;
+    std::vector<struct iovec> m_iovecs;
+#endif
+};
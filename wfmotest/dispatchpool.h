@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/**
+ * A work-stealing thread pool that WFMOHandler can hand handler invocations
+ * to, so that a slow handler does not hold up the others.
+ *
+ * Each pool thread has its own task queue. Submitted tasks are spread over
+ * the queues round-robin; a thread runs the tasks of its own queue and,
+ * when that is empty, steals from the others'. Queues are served in FIFO
+ * order -- the tasks come from the outside rather than from other tasks,
+ * so there is no locality to gain from LIFO, only handlers to starve.
+ * Idle threads sleep until a task is submitted.
+ *
+ * Tasks are plain function pointers with two context pointers, so
+ * submitting one does not allocate.
+ */
+class DispatchPool {
+public:
+    typedef void (*TaskProc)(void* pContext, void* pArg);
+
+    DispatchPool()
+        : m_nextqueue(0)
+        , m_pending(0)
+        , m_idle(0)
+        , m_fQuit(false)
+    {}
+    ~DispatchPool()
+    {
+        Stop();
+    }
+
+    /**
+     * Starts the pool threads.
+     * Parameters:
+     *  nThreads - number of threads, 0 for one per processor core
+     * Returns:
+     *  true if the threads were started
+     */
+    bool Start(unsigned nThreads = 0)
+    {
+        if (!m_threads.empty())
+            return true;
+        if (nThreads == 0)
+            nThreads = std::thread::hardware_concurrency();
+        if (nThreads == 0)
+            nThreads = 1;
+        m_fQuit = false;
+        m_queues.clear();
+        for (unsigned i=0; i<nThreads; i++)
+            m_queues.push_back(new Queue());
+        try {
+            for (unsigned i=0; i<nThreads; i++)
+                m_threads.push_back(new std::thread(&DispatchPool::ThreadProc, this, i));
+        } catch (...) {
+            Stop();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Stops the pool threads once all the tasks that were submitted
+     * have been run.
+     */
+    void Stop()
+    {
+        {
+            std::lock_guard<std::mutex> l(m_idlelock);
+            m_fQuit = true;
+        }
+        m_idlecv.notify_all();
+        for (size_t i=0; i<m_threads.size(); i++) {
+            m_threads[i]->join();
+            delete m_threads[i];
+        }
+        m_threads.clear();
+        for (size_t i=0; i<m_queues.size(); i++)
+            delete m_queues[i];
+        m_queues.clear();
+    }
+
+    /* whether the pool has been started */
+    bool IsRunning() const
+    { return !m_threads.empty(); }
+
+    /* number of pool threads */
+    size_t Size() const
+    { return m_threads.size(); }
+
+    /* Queues a task, to be run by one of the pool threads */
+    void Submit(TaskProc pfn, void* pContext, void* pArg)
+    {
+        Task t = { pfn, pContext, pArg };
+        Queue* q = m_queues[m_nextqueue++ % m_queues.size()];
+        {
+            std::lock_guard<std::mutex> l(q->m_lock);
+            q->m_tasks.push_back(t);
+        }
+        m_pending++;
+        if (m_idle > 0) {
+            // taking the lock makes sure that the idle thread is in wait()
+            std::lock_guard<std::mutex> l(m_idlelock);
+            m_idlecv.notify_one();
+        }
+    }
+
+private:
+    struct Task {
+        TaskProc m_pfn;
+        void* m_pContext;
+        void* m_pArg;
+    };
+    struct Queue {
+        std::mutex m_lock;
+        std::deque<Task> m_tasks;
+    };
+
+    DispatchPool(const DispatchPool&);
+    DispatchPool& operator=(const DispatchPool&);
+
+    /* takes the oldest task from our own queue */
+    bool PopLocal(size_t self, Task& t)
+    {
+        Queue* q = m_queues[self];
+        std::lock_guard<std::mutex> l(q->m_lock);
+        if (q->m_tasks.empty())
+            return false;
+        t = q->m_tasks.front();
+        q->m_tasks.pop_front();
+        return true;
+    }
+
+    /* takes the oldest task from another thread's queue */
+    bool Steal(size_t self, Task& t)
+    {
+        for (size_t i=1; i<m_queues.size(); i++) {
+            Queue* q = m_queues[(self + i) % m_queues.size()];
+            std::unique_lock<std::mutex> l(q->m_lock, std::try_to_lock);
+            if (!l.owns_lock() || q->m_tasks.empty())
+                continue;
+            t = q->m_tasks.front();
+            q->m_tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void ThreadProc(size_t self)
+    {
+        for (;;) {
+            Task t;
+            if (PopLocal(self, t) || Steal(self, t)) {
+                m_pending--;
+                t.m_pfn(t.m_pContext, t.m_pArg);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> l(m_idlelock);
+            if (m_pending > 0)
+                continue;   // a steal attempt lost a race, try again
+            if (m_fQuit)
+                break;
+            m_idle++;
+            if (m_pending == 0 && !m_fQuit)
+                m_idlecv.wait(l);
+            m_idle--;
+        }
+    }
+
+    std::vector<Queue*> m_queues;
+    std::vector<std::thread*> m_threads;
+    std::atomic<size_t> m_nextqueue;
+    std::atomic<size_t> m_pending;      // tasks submitted but not yet taken
+    std::atomic<int> m_idle;            // threads waiting on m_idlecv
+    std::mutex m_idlelock;
+    std::condition_variable m_idlecv;
+    bool m_fQuit;
+};
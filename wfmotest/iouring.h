@@ -0,0 +1,370 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+/*
+ * io_uring support for WFMOHandler on Linux. WFMOHANDLER_IO_URING is 1
+ * when the kernel headers are recent enough (6.0) to have multishot
+ * receives, in which case WFMOHandler gains EnableIoUring() and
+ * AddReceiveHandle(); define it as 0 to leave them out anyway. Whether the
+ * running kernel supports them is only known once EnableIoUring() is
+ * called.
+ */
+#ifndef WFMOHANDLER_IO_URING
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define WFMOHANDLER_IO_URING 1
+#endif
+#endif
+#endif
+#ifndef WFMOHANDLER_IO_URING
+#define WFMOHANDLER_IO_URING 0
+#endif
+
+#if WFMOHANDLER_IO_URING
+#include <linux/io_uring.h>
+#ifndef IORING_RECV_MULTISHOT
+// headers older than the kernels WFMOHandler's io_uring support needs
+#undef WFMOHANDLER_IO_URING
+#define WFMOHANDLER_IO_URING 0
+#endif
+#endif
+
+#if WFMOHANDLER_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <atomic>
+#include "numa.h"
+
+/*
+ * A minimal io_uring, set up and entered through the system calls
+ * themselves, so there's no dependency on liburing. One thread queues
+ * submission entries and reaps completions; the entries queued since the
+ * last call are submitted by the next Enter(), along with waiting for
+ * completions, so a loop iteration costs a single system call.
+ */
+class IoUring {
+public:
+    IoUring()
+        : m_fd(-1), m_pSqRing(NULL), m_cbSqRing(0), m_pCqRing(NULL), m_cbCqRing(0)
+        , m_pSqes(NULL), m_cbSqes(0), m_sqmask(0), m_sqentries(0), m_sqtail(0), m_cqmask(0), m_enters(0)
+    {}
+    ~IoUring()
+    {
+        Close();
+    }
+
+    /**
+     * Sets up the ring.
+     * Parameters:
+     *  nEntries - size of the submission queue, the completion queue is
+     *             made CQ_FACTOR times as large
+     * Returns:
+     *  false if io_uring isn't available, or lacks the features used here
+     */
+    bool Open(unsigned nEntries)
+    {
+        struct io_uring_params params;
+        ::memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE|IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = nEntries * CQ_FACTOR;
+        m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, nEntries, &params));
+        if (m_fd < 0 && errno == EINVAL) {
+            // COOP_TASKRUN is 5.19, try without it
+            params.flags &= ~IORING_SETUP_COOP_TASKRUN;
+            m_fd = static_cast<int>(::syscall(__NR_io_uring_setup, nEntries, &params));
+        }
+        if (m_fd < 0)
+            return false;
+        const unsigned required = IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG;
+        if ((params.features & required) != required) {
+            Close();
+            errno = ENOSYS;
+            return false;
+        }
+
+        // the submission & completion rings share a mapping
+        m_cbSqRing = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cbCqRing = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        size_t cbRing = m_cbSqRing > m_cbCqRing ? m_cbSqRing : m_cbCqRing;
+        void* pRing = ::mmap(NULL, cbRing, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (pRing == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        m_pSqRing = m_pCqRing = static_cast<char*>(pRing);
+        m_cbSqRing = m_cbCqRing = cbRing;
+        m_cbSqes = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* pSqes = ::mmap(NULL, m_cbSqes, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (pSqes == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        m_pSqes = static_cast<struct io_uring_sqe*>(pSqes);
+
+        m_sqhead = reinterpret_cast<unsigned*>(m_pSqRing + params.sq_off.head);
+        m_sqtailp = reinterpret_cast<unsigned*>(m_pSqRing + params.sq_off.tail);
+        m_sqmask = *reinterpret_cast<unsigned*>(m_pSqRing + params.sq_off.ring_mask);
+        m_sqentries = params.sq_entries;
+        m_sqtail = *m_sqtailp;
+        // submission entry i always sits in slot i of the index array
+        unsigned* pArray = reinterpret_cast<unsigned*>(m_pSqRing + params.sq_off.array);
+        for (unsigned i=0; i<m_sqentries; i++)
+            pArray[i] = i;
+        m_cqhead = reinterpret_cast<unsigned*>(m_pCqRing + params.cq_off.head);
+        m_cqtail = reinterpret_cast<unsigned*>(m_pCqRing + params.cq_off.tail);
+        m_cqmask = *reinterpret_cast<unsigned*>(m_pCqRing + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<struct io_uring_cqe*>(m_pCqRing + params.cq_off.cqes);
+        return true;
+    }
+
+    void Close()
+    {
+        if (m_pSqes != NULL) { ::munmap(m_pSqes, m_cbSqes); m_pSqes = NULL; }
+        if (m_pSqRing != NULL) { ::munmap(m_pSqRing, m_cbSqRing); m_pSqRing = m_pCqRing = NULL; }
+        if (m_fd >= 0) { ::close(m_fd); m_fd = -1; }
+    }
+
+    bool IsOpen() const
+    { return m_fd >= 0; }
+
+    /* io_uring_enter() calls made, read from any thread */
+    uint64_t Enters() const
+    { return m_enters.load(std::memory_order_relaxed); }
+
+    /**
+     * Returns a zeroed submission entry to fill in, submitting the queued
+     * ones first if the queue is full.
+     * Returns:
+     *  NULL if the queue is full and can't be submitted
+     */
+    struct io_uring_sqe* GetSqe()
+    {
+        if (m_sqtail - __atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE) >= m_sqentries) {
+            if (Enter(0, false) < 0
+                || m_sqtail - __atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE) >= m_sqentries)
+                return NULL;
+        }
+        struct io_uring_sqe* pSqe = &m_pSqes[m_sqtail & m_sqmask];
+        ::memset(pSqe, 0, sizeof(*pSqe));
+        m_sqtail++;
+        return pSqe;
+    }
+
+    /**
+     * Submits the queued entries and, if fWait, waits for a completion.
+     * Parameters:
+     *  msTimeout - longest wait in milliseconds, -1 for no limit
+     * Returns:
+     *  0 or more on success, -errno otherwise: -ETIME if the wait timed
+     *  out, -EINTR if a signal interrupted it
+     */
+    int Enter(int msTimeout, bool fWait = true)
+    {
+        __atomic_store_n(m_sqtailp, m_sqtail, __ATOMIC_RELEASE);
+        unsigned nSubmit = m_sqtail - __atomic_load_n(m_sqhead, __ATOMIC_ACQUIRE);
+        unsigned flags = 0;
+        unsigned nWait = 0;
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        ::memset(&arg, 0, sizeof(arg));
+        if (fWait) {
+            flags |= IORING_ENTER_GETEVENTS;
+            nWait = 1;
+            if (msTimeout >= 0) {
+                ts.tv_sec = msTimeout / 1000;
+                ts.tv_nsec = static_cast<long long>(msTimeout % 1000) * 1000000;
+                arg.sigmask_sz = _NSIG / 8;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+                flags |= IORING_ENTER_EXT_ARG;
+            }
+        }
+        m_enters.store(m_enters.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        long rc = ::syscall(__NR_io_uring_enter, m_fd, nSubmit, nWait, flags,
+            (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL, sizeof(arg));
+        return rc < 0 ? -errno : static_cast<int>(rc);
+    }
+
+    /* Returns the next completion, NULL if there's none; PopCqe() it once handled */
+    struct io_uring_cqe* PeekCqe()
+    {
+        unsigned head = *m_cqhead;
+        if (head == __atomic_load_n(m_cqtail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &m_cqes[head & m_cqmask];
+    }
+    void PopCqe()
+    {
+        __atomic_store_n(m_cqhead, *m_cqhead + 1, __ATOMIC_RELEASE);
+    }
+
+    /* io_uring_register(), returns 0 or -errno */
+    int Register(unsigned opcode, void* pArg, unsigned nArgs)
+    {
+        long rc = ::syscall(__NR_io_uring_register, m_fd, opcode, pArg, nArgs);
+        return rc < 0 ? -errno : static_cast<int>(rc);
+    }
+
+private:
+    static const unsigned CQ_FACTOR = 4;
+
+    int m_fd;
+    char* m_pSqRing;
+    size_t m_cbSqRing;
+    char* m_pCqRing;
+    size_t m_cbCqRing;
+    struct io_uring_sqe* m_pSqes;
+    size_t m_cbSqes;
+    unsigned* m_sqhead;
+    unsigned* m_sqtailp;
+    unsigned m_sqmask;
+    unsigned m_sqentries;
+    unsigned m_sqtail;              // entries queued, published by Enter()
+    unsigned* m_cqhead;
+    unsigned* m_cqtail;
+    unsigned m_cqmask;
+    struct io_uring_cqe* m_cqes;
+    std::atomic<uint64_t> m_enters;
+
+    IoUring(const IoUring&);
+    IoUring& operator=(const IoUring&);
+};
+
+/*
+ * A ring of provided buffers: buffers of the same size that a multishot
+ * receive picks from as datagrams arrive and that are given back once the
+ * datagrams have been handled. The buffers come from one slab, which can
+ * be placed on a NUMA node.
+ */
+class BufferRing {
+public:
+    BufferRing()
+        : m_pRing(NULL), m_cbRing(0), m_pSlab(NULL), m_cbSlab(0), m_cbBuffer(0), m_nBuffers(0), m_tail(0), m_bgid(0), m_fRegistered(false)
+    {}
+    ~BufferRing()
+    {
+        Free();
+    }
+
+    /**
+     * Allocates the buffers and registers them with a ring.
+     * Parameters:
+     *  ring      - the ring whose receives pick buffers from this one
+     *  bgid      - buffer group id, unique within ring
+     *  cbBuffer  - size of a buffer
+     *  nBuffers  - number of buffers, rounded up to a power of 2
+     *  node      - NUMA node for the buffers, NumaMemory::ANY_NODE for any
+     * Returns:
+     *  0 or -errno
+     */
+    int Open(IoUring& ring, unsigned short bgid, size_t cbBuffer, unsigned nBuffers, int node = NumaMemory::ANY_NODE)
+    {
+        Free();
+        m_nBuffers = 1;
+        while (m_nBuffers < nBuffers && m_nBuffers < MAX_BUFFERS)
+            m_nBuffers <<= 1;
+        m_cbBuffer = cbBuffer;
+        m_cbSlab = m_cbBuffer * m_nBuffers;
+        m_pSlab = static_cast<char*>(NumaMemory::Allocate(m_cbSlab, node));
+        if (m_pSlab == NULL)
+            return -ENOMEM;
+        m_cbRing = m_nBuffers * sizeof(struct io_uring_buf);
+        void* p = ::mmap(NULL, m_cbRing, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return -errno;
+        m_pRing = static_cast<struct io_uring_buf_ring*>(p);
+
+        struct io_uring_buf_reg reg;
+        ::memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(m_pRing);
+        reg.ring_entries = m_nBuffers;
+        reg.bgid = bgid;
+        int rc = ring.Register(IORING_REGISTER_PBUF_RING, &reg, 1);
+        if (rc < 0)
+            return rc;
+        m_bgid = bgid;
+        m_fRegistered = true;
+        for (unsigned i=0; i<m_nBuffers; i++)
+            Recycle(static_cast<unsigned short>(i));
+        Publish();
+        return 0;
+    }
+
+    /* Unregisters the buffers, which the ring must not be using any more */
+    void Close(IoUring& ring)
+    {
+        if (!m_fRegistered)
+            return;
+        struct io_uring_buf_reg reg;
+        ::memset(&reg, 0, sizeof(reg));
+        reg.bgid = m_bgid;
+        ring.Register(IORING_UNREGISTER_PBUF_RING, &reg, 1);
+        m_fRegistered = false;
+    }
+
+    bool IsOpen() const { return m_fRegistered; }
+    unsigned short GroupId() const { return m_bgid; }
+    unsigned Count() const { return m_nBuffers; }
+    char* Buffer(unsigned short bid) { return m_pSlab + bid * m_cbBuffer; }
+
+    /* Queues a buffer to be given back to the ring by Publish() */
+    void Recycle(unsigned short bid)
+    {
+        // the entries start at the top of the ring -- in C++ the header's
+        // bufs member doesn't, its empty struct takes a byte -- and the
+        // first entry's resv field is the ring's tail
+        struct io_uring_buf* pBuf = reinterpret_cast<struct io_uring_buf*>(m_pRing) + (m_tail & (m_nBuffers - 1));
+        pBuf->addr = reinterpret_cast<uint64_t>(Buffer(bid));
+        pBuf->len = static_cast<uint32_t>(m_cbBuffer);
+        pBuf->bid = bid;
+        m_tail++;
+    }
+    void Publish()
+    {
+        __atomic_store_n(&m_pRing->tail, m_tail, __ATOMIC_RELEASE);
+    }
+
+private:
+    static const unsigned MAX_BUFFERS = 32768;
+
+    /* frees the ring and the slab, which must have been unregistered */
+    void Free()
+    {
+        if (m_pRing != NULL) {
+            ::munmap(m_pRing, m_cbRing);
+            m_pRing = NULL;
+        }
+        NumaMemory::Free(m_pSlab, m_cbSlab);
+        m_pSlab = NULL;
+    }
+
+    struct io_uring_buf_ring* m_pRing;
+    size_t m_cbRing;
+    char* m_pSlab;
+    size_t m_cbSlab;
+    size_t m_cbBuffer;
+    unsigned m_nBuffers;
+    unsigned short m_tail;
+    unsigned short m_bgid;
+    bool m_fRegistered;
+
+    BufferRing(const BufferRing&);
+    BufferRing& operator=(const BufferRing&);
+};
+
+#endif
@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <unordered_map>
+#include <iostream>
+#include "monotonic.h"
+
+/*
+ * End-to-end latency probes. The sender stamps each datagram with a
+ * ProbeHeader, and the receiver records the time between the stamp and its
+ * handler seeing the datagram in a LatencyHistogram and checks the
+ * sequence numbers with a SequenceTracker.
+ *
+ * The timestamps come from MonotonicNanos(), which is the same clock in
+ * every process on a machine, so the latencies are only meaningful
+ * between a sender and receiver on the same host.
+ */
+
+/*
+ * The start of a probe datagram's payload, in host byte order -- sender
+ * and receiver share a host.
+ */
+struct ProbeHeader {
+    static const uint32_t MAGIC = 0x57464d4f;   // "WFMO"
+
+    uint32_t m_magic;
+    uint32_t m_reserved;
+    uint64_t m_seq;         // per sender socket and destination port, from 0
+    uint64_t m_sendns;      // MonotonicNanos() when sent
+
+    /* stamps a payload of at least sizeof(ProbeHeader) bytes */
+    static void Write(char* payload, uint64_t seq, uint64_t sendns)
+    {
+        ProbeHeader h;
+        h.m_magic = MAGIC;
+        h.m_reserved = 0;
+        h.m_seq = seq;
+        h.m_sendns = sendns;
+        ::memcpy(payload, &h, sizeof(h));
+    }
+
+    /**
+     * Reads the header of a payload.
+     * Returns:
+     *  false if the payload isn't a probe
+     */
+    static bool Read(const char* payload, size_t len, ProbeHeader& h)
+    {
+        if (len < sizeof(h))
+            return false;
+        ::memcpy(&h, payload, sizeof(h));
+        return h.m_magic == MAGIC;
+    }
+};
+
+/*
+ * A histogram of nanosecond values in the style of HdrHistogram: buckets
+ * are linear within each power of two, so every value is recorded with
+ * the same relative precision, 1/64 (~1.6%), from 1ns to hours. Recording
+ * is a few instructions and never allocates.
+ */
+class LatencyHistogram {
+public:
+    static const unsigned SUB_BITS = 7;
+    static const unsigned SUB_BUCKETS = 1u << SUB_BITS;                 // values below this are exact
+    static const unsigned BUCKETS = SUB_BUCKETS + (64 - SUB_BITS) * (SUB_BUCKETS / 2);
+
+    LatencyHistogram()
+    { Reset(); }
+
+    void Reset()
+    {
+        ::memset(m_counts, 0, sizeof(m_counts));
+        m_count = 0;
+        m_max = 0;
+    }
+
+    void Record(uint64_t value)
+    {
+        m_counts[BucketOf(value)]++;
+        m_count++;
+        if (value > m_max)
+            m_max = value;
+    }
+
+    /* adds the values recorded in another histogram */
+    void Add(const LatencyHistogram& other)
+    {
+        for (unsigned i=0; i<BUCKETS; i++)
+            m_counts[i] += other.m_counts[i];
+        m_count += other.m_count;
+        if (other.m_max > m_max)
+            m_max = other.m_max;
+    }
+
+    uint64_t Count() const
+    { return m_count; }
+
+    uint64_t Max() const
+    { return m_max; }
+
+    /**
+     * The value that percentile (0-100) of the recorded values are at or
+     * below, to the precision of the buckets. 0 if nothing was recorded.
+     */
+    uint64_t Percentile(double percentile) const
+    {
+        if (m_count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * m_count + 0.5);
+        if (rank < 1)
+            rank = 1;
+        uint64_t seen = 0;
+        for (unsigned i=0; i<BUCKETS; i++) {
+            seen += m_counts[i];
+            if (seen >= rank) {
+                uint64_t high = HighestValueOf(i);
+                return high < m_max ? high : m_max;
+            }
+        }
+        return m_max;
+    }
+
+private:
+    static unsigned HighestSetBit(uint64_t x)
+    {
+#if defined(__GNUC__)
+        return 63 - static_cast<unsigned>(__builtin_clzll(x));
+#elif defined(_MSC_VER)
+        unsigned long index = 0;
+        if (_BitScanReverse(&index, static_cast<unsigned long>(x >> 32)))
+            return index + 32;
+        _BitScanReverse(&index, static_cast<unsigned long>(x));
+        return index;
+#else
+        unsigned index = 0;
+        while (x >>= 1) index++;
+        return index;
+#endif
+    }
+
+    static unsigned BucketOf(uint64_t value)
+    {
+        if (value < SUB_BUCKETS)
+            return static_cast<unsigned>(value);
+        // value >> shift lies in [SUB_BUCKETS/2, SUB_BUCKETS)
+        unsigned shift = HighestSetBit(value) - (SUB_BITS - 1);
+        return SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2)
+            + static_cast<unsigned>(value >> shift) - SUB_BUCKETS / 2;
+    }
+
+    static uint64_t HighestValueOf(unsigned bucket)
+    {
+        if (bucket < SUB_BUCKETS)
+            return bucket;
+        unsigned k = bucket - SUB_BUCKETS;
+        unsigned shift = k / (SUB_BUCKETS / 2) + 1;
+        uint64_t top = k % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return ((top + 1) << shift) - 1;
+    }
+
+    uint64_t m_counts[BUCKETS];
+    uint64_t m_count;
+    uint64_t m_max;
+};
+
+/*
+ * Counts lost and reordered datagrams from the sequence numbers of the
+ * probes, per sender. A gap counts the datagrams skipped as lost; if one
+ * of them turns up later it is counted as reordered instead.
+ */
+class SequenceTracker {
+public:
+    SequenceTracker()
+        : m_received(0)
+        , m_lost(0)
+        , m_reordered(0)
+        , m_duplicates(0)
+    {}
+
+    /* sender identifies the sending socket, e.g. its port */
+    void Record(uint32_t sender, uint64_t seq)
+    {
+        m_received++;
+        uint64_t& next = m_next[sender];    // allocates on a sender's first datagram only
+        if (seq == next) {
+            next++;
+        } else if (seq > next) {
+            m_lost += seq - next;
+            next = seq + 1;
+        } else if (m_lost > 0) {
+            // one we gave up on, or a duplicate -- can't tell without a window
+            m_lost--;
+            m_reordered++;
+        } else {
+            m_duplicates++;
+        }
+    }
+
+    uint64_t Received() const { return m_received; }
+    uint64_t Lost() const { return m_lost; }
+    uint64_t Reordered() const { return m_reordered; }
+    uint64_t Duplicates() const { return m_duplicates; }
+
+private:
+    std::unordered_map<uint32_t, uint64_t> m_next;  // next sequence number expected, per sender
+    uint64_t m_received;
+    uint64_t m_lost;
+    uint64_t m_reordered;
+    uint64_t m_duplicates;
+};
+
+/* prints the latency percentiles and the sequence counters on a line */
+inline void PrintLatency(std::ostream& os, const char* label,
+    const LatencyHistogram& h, const SequenceTracker& t)
+{
+    os << label << ": " << h.Count() << " probes"
+       << ", p50 " << h.Percentile(50) / 1000.0 << "us"
+       << ", p99 " << h.Percentile(99) / 1000.0 << "us"
+       << ", p999 " << h.Percentile(99.9) / 1000.0 << "us"
+       << ", max " << h.Max() / 1000.0 << "us"
+       << ", lost " << t.Lost()
+       << ", reordered " << t.Reordered()
+       << ", duplicates " << t.Duplicates() << std::endl;
+}
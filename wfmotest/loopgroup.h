@@ -0,0 +1,315 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <vector>
+#include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <iostream>
+#include "wfmohandler.h"
+#include "spscring.h"
+
+/**
+ * A group of event loops, one per CPU the process may run on by default,
+ * that share a program's handles between them. New registrations are
+ * placed on the loops round robin or on the least loaded loop, a handle
+ * can be migrated from one loop to another, and the loops pass each other
+ * messages through SPSC rings, one per ordered pair of loops -- so an
+ * accept loop handing its sockets to worker loops through them takes no
+ * lock. The registrations made through the group take a short lock of
+ * its own, which keeps the loops' loads exact.
+ *
+ * Loop is WFMOHandler or a class derived from it, with a default
+ * constructor. The loops can be set up through operator[] before Start().
+ */
+template<typename Loop = WFMOHandler>
+class LoopGroup {
+public:
+    typedef WFMOHandler::WaitHandle WaitHandle;
+    typedef DispatchPool::TaskProc TaskProc;
+    // called with a migrated handle the loop it was bound for turned down
+    typedef std::function<void (WaitHandle h)> RejectHandler;
+
+    enum Placement {
+        ROUND_ROBIN,        // each registration goes to the next loop in turn
+        LEAST_LOADED        // to the loop with the fewest handles registered through the group
+    };
+
+    static const size_t NO_LOOP = static_cast<size_t>(-1);
+    static const size_t DEFAULT_RING_SIZE = 1024;
+
+    /**
+     * Creates the loops, which aren't started yet.
+     * Parameters:
+     *  nLoops    - number of loops, 0 for one per CPU in the process's
+     *              affinity mask, see WFMOHandler::AllowedCpus()
+     *  placement - where AddWaitHandle() puts a handle
+     *  nMessages - capacity of each ring of messages, see Send()
+     */
+    LoopGroup(unsigned nLoops = 0, Placement placement = ROUND_ROBIN, size_t nMessages = DEFAULT_RING_SIZE)
+        : m_placement(placement)
+        , m_next(0)
+    {
+        if (nLoops == 0)
+            nLoops = static_cast<unsigned>(WFMOHandler::AllowedCpus().size());
+        for (unsigned i=0; i<nLoops; i++)
+            m_members.push_back(new Member());
+        for (size_t i=0; i<nLoops*nLoops; i++)
+            m_channels.push_back(new Channel(nMessages));
+    }
+    ~LoopGroup()
+    {
+        Stop();
+        for (size_t i=0; i<m_channels.size(); i++)
+            delete m_channels[i];
+        for (size_t i=0; i<m_members.size(); i++)
+            delete m_members[i];
+    }
+
+    /**
+     * Starts the loops.
+     * Parameters:
+     *  fPin - pin loop i to the i-th CPU the process may run on, modulo
+     *         their number
+     * Returns:
+     *  false if a loop failed to start, in which case none is running
+     */
+    bool Start(bool fPin = true)
+    {
+        std::vector<unsigned> cpus = WFMOHandler::AllowedCpus();
+        for (size_t i=0; i<m_members.size(); i++) {
+            Loop& loop = m_members[i]->m_loop;
+            if (fPin)
+                loop.PinWorkerThread(cpus[i % cpus.size()]);
+            if (!loop.Start()) {
+                Stop();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Stops the loops, the messages not delivered yet are dropped */
+    void Stop()
+    {
+        for (size_t i=0; i<m_members.size(); i++)
+            m_members[i]->m_loop.Stop();
+    }
+
+    /* number of loops */
+    size_t Size() const
+    { return m_members.size(); }
+
+    Loop& operator[](size_t i)
+    { return m_members[i]->m_loop; }
+
+    /* the loop whose worker thread is calling, NO_LOOP if none's is */
+    size_t CurrentLoop() const
+    {
+        for (size_t i=0; i<m_members.size(); i++) {
+            if (m_members[i]->m_loop.IsWorkerThread())
+                return i;
+        }
+        return NO_LOOP;
+    }
+
+    /* the handles registered with a loop through the group and not removed */
+    size_t Load(size_t i) const
+    { return m_members[i]->m_handles.load(std::memory_order_relaxed); }
+
+    /* the loop the placement picks for the next registration */
+    size_t Place()
+    {
+        if (m_placement == ROUND_ROBIN)
+            return m_next.fetch_add(1, std::memory_order_relaxed) % m_members.size();
+        size_t best = 0;
+        for (size_t i=1; i<m_members.size(); i++) {
+            if (Load(i) < Load(best))
+                best = i;
+        }
+        return best;
+    }
+
+    /**
+     * Adds a handle to the loop the placement picks, as
+     * WFMOHandler::AddWaitHandle() does.
+     * Returns:
+     *  the loop it went to, for RemoveWaitHandle() and MigrateWaitHandle(),
+     *  NO_LOOP if the loop turned it down
+     */
+    template<typename Handler>
+    size_t AddWaitHandle(WaitHandle h, Handler handler)
+    {
+        size_t i = Place();
+        if (!m_members[i]->m_loop.AddWaitHandle(h, std::move(handler)))
+            return NO_LOOP;
+        Track(i, h);
+        return i;
+    }
+
+    /*
+     * Removes a handle from the loop AddWaitHandle() put it on. The loop's
+     * load only drops if the group had registered the handle there.
+     */
+    void RemoveWaitHandle(size_t loop, WaitHandle h)
+    {
+        Untrack(loop, h);
+        m_members[loop]->m_loop.RemoveWaitHandle(h);
+    }
+
+    /**
+     * Moves a handle from one loop to another. It's registered with the
+     * new loop once the old one holds no reference to it any more, see
+     * WFMOHandler::DetachWaitHandle(), so its handlers never run on both
+     * loops at once. The old loop doesn't call OnWaitHandleRemoved().
+     * The move completes asynchronously: until the handle has arrived --
+     * its handler has run on the new loop, say -- it mustn't be migrated
+     * or removed again, as the old loop may still hold on to it.
+     *
+     * If the new loop's AddWaitHandle() turns the handle down -- it has
+     * been closed in the meantime, say -- the handle is left registered
+     * with neither loop: the group stops counting it and calls rejected,
+     * on the old loop's worker thread, which is then the one to release
+     * it. Without a rejected handler the failure is only logged. A
+     * handle the new loop turns down once it's queued there goes to that
+     * loop's OnWaitHandleRejected() as usual.
+     * Parameters:
+     *  h        - the handle
+     *  from     - the loop it's registered with
+     *  to       - the loop to register it with
+     *  handler  - its handler there
+     *  rejected - see above
+     */
+    template<typename Handler>
+    void MigrateWaitHandle(WaitHandle h, size_t from, size_t to, Handler handler,
+        RejectHandler rejected = RejectHandler())
+    {
+        Untrack(from, h);
+        Track(to, h);
+        Migration<Handler> migration(this, to, h, std::move(handler), std::move(rejected));
+        m_members[from]->m_loop.DetachWaitHandle(h, std::move(migration));
+    }
+
+    /**
+     * Passes a message from one loop to another: pfn(pContext, pArg) is
+     * called on the worker thread of loop to, after the messages sent to
+     * it from the same loop before. The message goes through the ring of
+     * that pair of loops, which only loop from writes to, so sending
+     * takes no lock. The receiving loop is woken up with a Post() once for
+     * a burst of messages, not once for each, so only the first message of
+     * a burst allocates: a task from the receiving loop's lock-free pool.
+     * Calling context: loop from's worker thread -- or a single other
+     * thread that stands in for it
+     * Returns:
+     *  false if the ring is full, the message hasn't been sent
+     */
+    bool Send(size_t from, size_t to, TaskProc pfn, void* pContext, void* pArg)
+    {
+        Channel* pChannel = m_channels[from * m_members.size() + to];
+        Message msg = { pfn, pContext, pArg };
+        if (!pChannel->m_ring.TryPush(msg))
+            return false;
+        // pairs with Drain(), which clears the flag before it looks at the ring
+        if (!pChannel->m_fScheduled.exchange(true, std::memory_order_seq_cst))
+            m_members[to]->m_loop.Post(std::bind(&LoopGroup::Drain, &m_members[to]->m_loop, pChannel));
+        return true;
+    }
+
+private:
+    struct Member {
+        Loop m_loop;
+        std::unordered_set<WaitHandle> m_registered;    // through the group, guarded by m_lock
+        std::atomic<size_t> m_handles;  // m_registered.size(), read without the lock
+        Member() : m_loop(), m_handles(0) {}
+    };
+
+    struct Message {
+        TaskProc m_pfn;
+        void* m_pContext;
+        void* m_pArg;
+    };
+
+    // the messages from one loop to another
+    struct Channel {
+        SpscRing<Message> m_ring;
+        std::atomic<bool> m_fScheduled;     // a Drain() has been posted to the receiver
+        Channel(size_t nMessages) : m_ring(nMessages), m_fScheduled(false) {}
+    };
+
+    // the task DetachWaitHandle() runs for MigrateWaitHandle()
+    template<typename Handler>
+    struct Migration {
+        LoopGroup* m_pGroup;
+        size_t m_to;
+        WaitHandle m_h;
+        Handler m_handler;
+        RejectHandler m_rejected;
+        Migration(LoopGroup* pGroup, size_t to, WaitHandle h, Handler&& handler, RejectHandler&& rejected)
+            : m_pGroup(pGroup), m_to(to), m_h(h), m_handler(std::move(handler)), m_rejected(std::move(rejected))
+        {}
+        void operator()()
+        {
+            if (m_pGroup->m_members[m_to]->m_loop.AddWaitHandle(m_h, std::move(m_handler)))
+                return;
+            m_pGroup->Untrack(m_to, m_h);
+            if (m_rejected)
+                m_rejected(m_h);
+            else
+                std::cerr << "MigrateWaitHandle: loop " << m_to << " turned the handle down" << std::endl;
+        }
+    };
+
+    /* Counts a handle as registered with a loop */
+    void Track(size_t loop, WaitHandle h)
+    {
+        std::lock_guard<std::mutex> l(m_lock);
+        Member* pMember = m_members[loop];
+        pMember->m_registered.insert(h);
+        pMember->m_handles.store(pMember->m_registered.size(), std::memory_order_relaxed);
+    }
+
+    /* Stops counting a handle as registered with a loop, if it was */
+    void Untrack(size_t loop, WaitHandle h)
+    {
+        std::lock_guard<std::mutex> l(m_lock);
+        Member* pMember = m_members[loop];
+        pMember->m_registered.erase(h);
+        pMember->m_handles.store(pMember->m_registered.size(), std::memory_order_relaxed);
+    }
+
+    /*
+     * Delivers a channel's messages on the receiving loop, a ring-full at
+     * most before it lets the loop get on with its handles
+     */
+    static void Drain(Loop* pLoop, Channel* pChannel)
+    {
+        pChannel->m_fScheduled.store(false, std::memory_order_seq_cst);
+        Message msg;
+        for (size_t n=pChannel->m_ring.Capacity(); n>0; n--) {
+            if (!pChannel->m_ring.TryPop(msg))
+                return;
+            msg.m_pfn(msg.m_pContext, msg.m_pArg);
+        }
+        if (!pChannel->m_fScheduled.exchange(true, std::memory_order_seq_cst))
+            pLoop->Post(std::bind(&LoopGroup::Drain, pLoop, pChannel));
+    }
+
+    Placement m_placement;
+    std::atomic<size_t> m_next;         // round robin position
+    std::mutex m_lock;                  // guards the members' m_registered
+    std::vector<Member*> m_members;
+    std::vector<Channel*> m_channels;   // [from * Size() + to]
+
+    LoopGroup(const LoopGroup&);
+    LoopGroup& operator=(const LoopGroup&);
+};
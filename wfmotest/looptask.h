@@ -0,0 +1,89 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+/*
+ * C++20 coroutine support for WFMOHandler. WFMOHANDLER_COROUTINES is 1
+ * when the compiler implements coroutines and has <coroutine>, in which
+ * case WFMOHandler gains the Readable(), SleepFor() and Recv() awaitables;
+ * define it as 0 to leave them out anyway.
+ */
+#ifndef WFMOHANDLER_COROUTINES
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define WFMOHANDLER_COROUTINES 1
+#endif
+#endif
+#endif
+#ifndef WFMOHANDLER_COROUTINES
+#define WFMOHANDLER_COROUTINES 0
+#endif
+
+#if WFMOHANDLER_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <iostream>
+#include "blockpool.h"
+
+/*
+ * The return type of a coroutine that runs on a WFMOHandler:
+ *
+ *  LoopTask Session(MyDaemon* pDaemon, AsyncSocket* pSock)
+ *  {
+ *      char buf[512];
+ *      for (;;) {
+ *          AsyncSocket::Datagram d = co_await pDaemon->Recv(*pSock, buf, sizeof(buf));
+ *          ...
+ *          co_await pDaemon->SleepFor(100);
+ *      }
+ *  }
+ *
+ * A LoopTask starts running when it is called, on the calling thread, and
+ * is resumed by the thread that dispatches the handle or timer it awaits
+ * -- the worker thread, or a dispatch pool thread. Nothing waits for it to
+ * finish; its frame is freed when it returns, or when the loop it is
+ * suspended on is stopped.
+ *
+ * Frames come from a process-wide BlockPool, so starting a coroutine
+ * whose frame is up to BlockPool::MAX_BLOCK bytes doesn't allocate once
+ * the pool has grown to the number of coroutines alive at a time.
+ */
+class LoopTask {
+public:
+    struct promise_type {
+        LoopTask get_return_object() noexcept { return LoopTask(); }
+        std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+        std::suspend_never final_suspend() noexcept { return std::suspend_never(); }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept
+        {
+            // like a pooled handler's, the exception doesn't go any further
+            std::cerr << "Unhandled exception in LoopTask" << std::endl;
+        }
+
+        static void* operator new(size_t cb)
+        { return FramePool().Allocate(cb); }
+        static void operator delete(void* p, size_t cb)
+        { FramePool().Free(p, cb); }
+    };
+
+private:
+    LoopTask() {}
+
+    // never destroyed, frames may outlive static destructors
+    static BlockPool& FramePool()
+    {
+        static BlockPool* s_pool = new BlockPool();
+        return *s_pool;
+    }
+};
+
+#endif
@@ -0,0 +1,272 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include "monotonic.h"
+
+/*
+ * Event loop instrumentation for WFMOHandler. It is compiled in unless
+ * WFMOHANDLER_METRICS is defined as 0 before wfmohandler.h is included, in
+ * which case every hook below is an empty inline function and the counters
+ * take no space.
+ *
+ * Counters are written with relaxed atomics by the thread that owns them
+ * -- the worker thread, or whichever thread runs a handle's handler, one
+ * at a time -- so they can be read from any thread without a lock. The
+ * histograms are shared by the dispatch pool threads and use fetch_add.
+ */
+#ifndef WFMOHANDLER_METRICS
+#define WFMOHANDLER_METRICS 1
+#endif
+
+/*
+ * A histogram of nanosecond durations with power of two buckets: bucket 0
+ * holds 0 and 1ns, bucket i the durations in [2^i, 2^(i+1)), up to about
+ * 18 minutes in the last one. This is the snapshot form, see
+ * LiveHistogram for the one that's recorded into.
+ */
+struct MetricsHistogram {
+    static const unsigned BUCKETS = 40;
+    uint64_t m_counts[BUCKETS];
+
+    MetricsHistogram()
+    { ::memset(m_counts, 0, sizeof(m_counts)); }
+
+    uint64_t Count() const
+    {
+        uint64_t n = 0;
+        for (unsigned i=0; i<BUCKETS; i++)
+            n += m_counts[i];
+        return n;
+    }
+
+    /**
+     * The upper bound of the bucket that holds the given percentile (0-100)
+     * of the durations, 0 if there are none.
+     */
+    uint64_t Percentile(double percentile) const
+    {
+        uint64_t count = Count();
+        if (count == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * count + 0.5);
+        if (rank < 1)
+            rank = 1;
+        uint64_t seen = 0;
+        for (unsigned i=0; i<BUCKETS; i++) {
+            seen += m_counts[i];
+            if (seen >= rank)
+                return (static_cast<uint64_t>(2) << i) - 1;
+        }
+        return ~static_cast<uint64_t>(0);
+    }
+
+    static unsigned BucketOf(uint64_t ns)
+    {
+        if (ns < 2)
+            return 0;
+#if defined(__GNUC__)
+        unsigned bucket = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+#elif defined(_MSC_VER)
+        unsigned long index = 0;
+        unsigned bucket;
+        if (_BitScanReverse(&index, static_cast<unsigned long>(ns >> 32)))
+            bucket = index + 32;
+        else {
+            _BitScanReverse(&index, static_cast<unsigned long>(ns));
+            bucket = index;
+        }
+#else
+        unsigned bucket = 0;
+        while (ns >>= 1) bucket++;
+#endif
+        return bucket < BUCKETS ? bucket : BUCKETS-1;
+    }
+};
+
+#if WFMOHANDLER_METRICS
+
+/* adds to a counter that only one thread at a time writes */
+inline void MetricsAdd(std::atomic<uint64_t>& counter, uint64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/* a MetricsHistogram that several threads can record into */
+class LiveHistogram {
+    std::atomic<uint64_t> m_counts[MetricsHistogram::BUCKETS];
+    LiveHistogram(const LiveHistogram&);
+    LiveHistogram& operator=(const LiveHistogram&);
+public:
+    LiveHistogram()
+    {
+        for (unsigned i=0; i<MetricsHistogram::BUCKETS; i++)
+            m_counts[i].store(0, std::memory_order_relaxed);
+    }
+    void Record(uint64_t ns)
+    { m_counts[MetricsHistogram::BucketOf(ns)].fetch_add(1, std::memory_order_relaxed); }
+    void Read(MetricsHistogram& h) const
+    {
+        for (unsigned i=0; i<MetricsHistogram::BUCKETS; i++)
+            h.m_counts[i] = m_counts[i].load(std::memory_order_relaxed);
+    }
+};
+
+/* Counters of a wait handle, kept in its handler object */
+struct HandleCounters {
+    std::atomic<uint64_t> m_dispatches; // times its handler ran
+    std::atomic<uint64_t> m_totalns;    // total time its handler ran for
+    std::atomic<uint64_t> m_maxns;      // longest its handler ran for
+    std::atomic<uint64_t> m_throttled;  // times it was held back by its rate limit
+
+    HandleCounters() : m_dispatches(0), m_totalns(0), m_maxns(0), m_throttled(0) {}
+
+    void Record(uint64_t ns)
+    {
+        MetricsAdd(m_dispatches, 1);
+        MetricsAdd(m_totalns, ns);
+        if (ns > m_maxns.load(std::memory_order_relaxed))
+            m_maxns.store(ns, std::memory_order_relaxed);
+    }
+};
+
+/*
+ * Counters of an event loop. The worker thread calls BeforeWait() and
+ * AfterWait() around its wait, which splits its time into blocked and
+ * running.
+ */
+class LoopMetrics {
+    std::atomic<uint64_t> m_wakeups;
+    std::atomic<uint64_t> m_timers;
+    std::atomic<uint64_t> m_overruns;
+    std::atomic<uint64_t> m_throttled;
+    std::atomic<uint64_t> m_tasks;
+    std::atomic<uint64_t> m_commands;
+    std::atomic<uint64_t> m_rebuilds;   // written by waiter shards, fetch_add
+    std::atomic<uint64_t> m_blockedns;
+    std::atomic<uint64_t> m_runningns;
+    LiveHistogram m_handlerns;
+    LiveHistogram m_timerlateness;
+    uint64_t m_waitstart;               // worker thread only
+    uint64_t m_lastwakeup;
+
+    LoopMetrics(const LoopMetrics&);
+    LoopMetrics& operator=(const LoopMetrics&);
+public:
+    static const bool ENABLED = true;
+
+    LoopMetrics()
+        : m_wakeups(0), m_timers(0), m_overruns(0), m_throttled(0), m_tasks(0), m_commands(0), m_rebuilds(0), m_blockedns(0), m_runningns(0)
+        , m_waitstart(0), m_lastwakeup(0)
+    {}
+
+    /* start time for HandlerRan()/TimerRan() */
+    uint64_t Clock() const
+    { return MonotonicNanos(); }
+
+    void BeforeWait()
+    {
+        m_waitstart = MonotonicNanos();
+        if (m_lastwakeup != 0)
+            MetricsAdd(m_runningns, m_waitstart - m_lastwakeup);
+    }
+    void AfterWait()
+    {
+        m_lastwakeup = MonotonicNanos();
+        MetricsAdd(m_blockedns, m_lastwakeup - m_waitstart);
+        MetricsAdd(m_wakeups, 1);
+    }
+    void HandlerRan(HandleCounters& counters, uint64_t start)
+    {
+        uint64_t ns = MonotonicNanos() - start;
+        counters.Record(ns);
+        m_handlerns.Record(ns);
+    }
+    void TimerRan(uint64_t start)
+    {
+        m_handlerns.Record(MonotonicNanos() - start);
+    }
+    void TaskRan(uint64_t start)
+    {
+        MetricsAdd(m_tasks, 1);
+        m_handlerns.Record(MonotonicNanos() - start);
+    }
+    void TimerFired(uint64_t latenessMs)
+    {
+        MetricsAdd(m_timers, 1);
+        m_timerlateness.Record(latenessMs * 1000000);
+    }
+    void TimerOverran(uint64_t periods)
+    {
+        MetricsAdd(m_overruns, periods);
+    }
+    void Throttled(HandleCounters& counters)
+    {
+        MetricsAdd(counters.m_throttled, 1);
+        MetricsAdd(m_throttled, 1);
+    }
+    void CommandsApplied(uint64_t n)
+    {
+        if (n > 0)
+            MetricsAdd(m_commands, n);
+    }
+    void Rebuilt()
+    { m_rebuilds.fetch_add(1, std::memory_order_relaxed); }
+
+    uint64_t Wakeups() const { return m_wakeups.load(std::memory_order_relaxed); }
+    uint64_t Timers() const { return m_timers.load(std::memory_order_relaxed); }
+    uint64_t Overruns() const { return m_overruns.load(std::memory_order_relaxed); }
+    uint64_t Throttled() const { return m_throttled.load(std::memory_order_relaxed); }
+    uint64_t Tasks() const { return m_tasks.load(std::memory_order_relaxed); }
+    uint64_t Commands() const { return m_commands.load(std::memory_order_relaxed); }
+    uint64_t Rebuilds() const { return m_rebuilds.load(std::memory_order_relaxed); }
+    uint64_t BlockedNs() const { return m_blockedns.load(std::memory_order_relaxed); }
+    uint64_t RunningNs() const { return m_runningns.load(std::memory_order_relaxed); }
+    void ReadHandlerNs(MetricsHistogram& h) const { m_handlerns.Read(h); }
+    void ReadTimerLateness(MetricsHistogram& h) const { m_timerlateness.Read(h); }
+};
+
+#else
+
+struct HandleCounters {
+    void Record(uint64_t) {}
+};
+
+class LoopMetrics {
+public:
+    static const bool ENABLED = false;
+    uint64_t Clock() const { return 0; }
+    void BeforeWait() {}
+    void AfterWait() {}
+    void HandlerRan(HandleCounters&, uint64_t) {}
+    void TimerRan(uint64_t) {}
+    void TaskRan(uint64_t) {}
+    void TimerFired(uint64_t) {}
+    void TimerOverran(uint64_t) {}
+    void Throttled(HandleCounters&) {}
+    void CommandsApplied(uint64_t) {}
+    void Rebuilt() {}
+    uint64_t Wakeups() const { return 0; }
+    uint64_t Timers() const { return 0; }
+    uint64_t Overruns() const { return 0; }
+    uint64_t Throttled() const { return 0; }
+    uint64_t Tasks() const { return 0; }
+    uint64_t Commands() const { return 0; }
+    uint64_t Rebuilds() const { return 0; }
+    uint64_t BlockedNs() const { return 0; }
+    uint64_t RunningNs() const { return 0; }
+    void ReadHandlerNs(MetricsHistogram&) const {}
+    void ReadTimerLateness(MetricsHistogram&) const {}
+};
+
+#endif
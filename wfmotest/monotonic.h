@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+#include <stdint.h>
+
+/*
+ * Nanoseconds on the monotonic clock -- CLOCK_MONOTONIC on Linux,
+ * QueryPerformanceCounter on Windows -- which is the same clock in every
+ * process on a machine.
+ */
+inline uint64_t MonotonicNanos()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER s_freq = { 0, 0 };
+    if (s_freq.QuadPart == 0)
+        ::QueryPerformanceFrequency(&s_freq);
+    LARGE_INTEGER now;
+    ::QueryPerformanceCounter(&now);
+    return static_cast<uint64_t>(now.QuadPart / s_freq.QuadPart) * 1000000000
+        + static_cast<uint64_t>(now.QuadPart % s_freq.QuadPart) * 1000000000 / s_freq.QuadPart;
+#else
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+#endif
+}
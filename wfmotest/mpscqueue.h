@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+
+/**
+ * An intrusive, lock-free multiple producer single consumer queue
+ * (Dmitry Vyukov's design). Push() is wait-free -- a single atomic
+ * exchange -- and neither Push() nor Pop() allocate; the nodes are
+ * embedded in the objects being queued.
+ *
+ * Pop() may briefly not see a node whose Push() is still in progress.
+ * Producers are expected to wake the consumer after Push() returns, so
+ * the consumer gets to see it on its next round.
+ */
+class MpscQueue {
+public:
+    struct Node {
+        std::atomic<Node*> m_qnext;
+        Node() : m_qnext(NULL) {}
+    };
+
+    MpscQueue()
+        : m_head(&m_stub)
+        , m_tail(&m_stub)
+    {}
+
+    /* Appends a node, may be called from any thread */
+    void Push(Node* p)
+    {
+        p->m_qnext.store(NULL, std::memory_order_relaxed);
+        Node* prev = m_head.exchange(p, std::memory_order_acq_rel);
+        prev->m_qnext.store(p, std::memory_order_release);
+    }
+
+    /* Removes the oldest node, NULL if there's none. Consumer thread only. */
+    Node* Pop()
+    {
+        Node* tail = m_tail;
+        Node* next = tail->m_qnext.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (next == NULL)
+                return NULL;
+            m_tail = next;
+            tail = next;
+            next = next->m_qnext.load(std::memory_order_acquire);
+        }
+        if (next != NULL) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load(std::memory_order_acquire))
+            return NULL;    // a Push() is in progress
+        // tail is the last node, put the stub behind it so that it can be taken
+        Push(&m_stub);
+        next = tail->m_qnext.load(std::memory_order_acquire);
+        if (next != NULL) {
+            m_tail = next;
+            return tail;
+        }
+        return NULL;
+    }
+
+private:
+    MpscQueue(const MpscQueue&);
+    MpscQueue& operator=(const MpscQueue&);
+
+    std::atomic<Node*> m_head;  // last pushed
+    Node* m_tail;               // next to pop, consumer only
+    Node m_stub;
+};
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#endif
+#include <stddef.h>
+
+/*
+ * Page granular memory placed on a NUMA node, straight from the OS so
+ * there's no dependency on libnuma: mmap() and mbind() on Linux,
+ * VirtualAllocExNuma() on Windows. The node is a preference -- where it
+ * has no memory left, or the system isn't NUMA, the pages come from
+ * elsewhere.
+ */
+class NumaMemory {
+public:
+    static const int ANY_NODE = -1;
+
+    /**
+     * Allocates zeroed memory.
+     * Parameters:
+     *  cb   - bytes, rounded up to whole pages
+     *  node - the node to place the pages on, ANY_NODE to leave it to
+     *         the OS
+     * Returns:
+     *  the memory, to be freed with Free(), or NULL
+     */
+    static void* Allocate(size_t cb, int node)
+    {
+#ifdef _WIN32
+        if (node < 0)
+            return ::VirtualAlloc(NULL, cb, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE);
+        return ::VirtualAllocExNuma(::GetCurrentProcess(), NULL, cb,
+            MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE, static_cast<DWORD>(node));
+#else
+        void* p = ::mmap(NULL, cb, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+        if (node >= 0 && node < MAX_NODES) {
+            // nothing is touched yet, so every page is faulted in on the node
+            unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+            ::memset(mask, 0, sizeof(mask));
+            mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+            // kernels without NUMA fail the call, the memory is fine anyway
+            ::syscall(SYS_mbind, p, cb, MPOL_PREFERRED, mask, sizeof(mask) * 8 + 1, 0);
+        }
+        return p;
+#endif
+    }
+
+    /* Frees memory from Allocate(), cb being the size it was allocated with */
+    static void Free(void* p, size_t cb)
+    {
+        if (p == NULL)
+            return;
+#ifdef _WIN32
+        (void)cb;
+        ::VirtualFree(p, 0, MEM_RELEASE);
+#else
+        ::munmap(p, cb);
+#endif
+    }
+
+    /**
+     * Returns:
+     *  the node a CPU belongs to, ANY_NODE if that isn't known
+     */
+    static int NodeOfCpu(unsigned cpu)
+    {
+#ifdef _WIN32
+        PROCESSOR_NUMBER pn;
+        pn.Group = static_cast<WORD>(cpu / 64);
+        pn.Number = static_cast<BYTE>(cpu % 64);
+        pn.Reserved = 0;
+        USHORT node = 0;
+        if (!::GetNumaProcessorNodeEx(&pn, &node) || node == 0xffff)
+            return ANY_NODE;
+        return node;
+#else
+        // sysfs links each CPU's directory to its node as "node<N>"
+        char path[64];
+        ::snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+        DIR* pDir = ::opendir(path);
+        if (pDir == NULL)
+            return ANY_NODE;
+        int node = ANY_NODE;
+        while (struct dirent* pEntry = ::readdir(pDir)) {
+            if (::strncmp(pEntry->d_name, "node", 4) == 0 && pEntry->d_name[4] >= '0' && pEntry->d_name[4] <= '9') {
+                node = ::atoi(pEntry->d_name + 4);
+                break;
+            }
+        }
+        ::closedir(pDir);
+        return node;
+#endif
+    }
+
+private:
+#ifndef _WIN32
+    static const int MAX_NODES = 1024;
+    static const int MPOL_PREFERRED = 1;    // <linux/mempolicy.h>, which clashes with <numaif.h>
+#endif
+};
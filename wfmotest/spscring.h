@@ -0,0 +1,80 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <vector>
+
+/**
+ * A bounded, lock-free single producer single consumer ring of values
+ * that are cheap to copy. The slots are allocated once; neither TryPush()
+ * nor TryPop() allocate, and each side only writes its own index, which
+ * lives on a cache line of its own.
+ */
+template<typename T>
+class SpscRing {
+public:
+    /**
+     * Parameters:
+     *  capacity - the most values the ring holds, rounded up to a power of 2
+     */
+    explicit SpscRing(size_t capacity)
+        : m_head(0)
+        , m_tail(0)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_slots.resize(size);
+        m_mask = size - 1;
+    }
+
+    /* Appends a value, false if the ring is full. Producer thread only. */
+    bool TryPush(const T& value)
+    {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+            return false;
+        m_slots[tail & m_mask] = value;
+        // seq_cst, so that a consumer going idle either sees the value or
+        // is seen to have gone idle, see LoopGroup::Send()
+        m_tail.store(tail + 1, std::memory_order_seq_cst);
+        return true;
+    }
+
+    /* Removes the oldest value, false if there's none. Consumer thread only. */
+    bool TryPop(T& value)
+    {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_seq_cst))
+            return false;
+        value = m_slots[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Capacity() const
+    { return m_mask + 1; }
+
+private:
+    static const size_t CACHE_LINE = 64;
+
+    std::vector<T> m_slots;
+    size_t m_mask;
+    char m_pad1[CACHE_LINE];
+    std::atomic<size_t> m_head;         // next slot to pop, written by the consumer
+    char m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail;         // next slot to push to, written by the producer
+    char m_pad3[CACHE_LINE - sizeof(std::atomic<size_t>)];
+
+    SpscRing(const SpscRing&);
+    SpscRing& operator=(const SpscRing&);
+};
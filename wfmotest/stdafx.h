@@ -5,6 +5,7 @@
 
 #pragma once
 
+#ifdef _WIN32
 #include "targetver.h"
 
 #include <stdio.h>
@@ -15,6 +16,17 @@
 // TODO: reference additional headers your program requires here
 #include <WinSock2.h>
 #include <crtdbg.h>
+#else
+// just enough of the Win32/WinSock vocabulary for the sample to build on Linux
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define _tmain main
+typedef char _TCHAR;
+#endif
 
 #include <iostream>
-#include <functional> 
+#include <functional>
+#include <stdexcept>
@@ -0,0 +1,274 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A hierarchical timer wheel (Varghese & Lauck), used by WFMOHandler to run
+ * any number of timers off a single kernel timeout.
+ *
+ * Time is measured in ticks, which are whatever unit the caller chooses
+ * (WFMOHandler uses milliseconds). There are LEVELS wheels of SLOTS slots
+ * each, a slot of level L spanning SLOTS^L ticks. A timer is placed in the
+ * lowest level that can hold its remaining time and is moved down a level
+ * (cascaded) as its expiry draws closer. This makes both Schedule() and
+ * Cancel() O(1) -- the nodes are intrusive, circular doubly linked lists
+ * -- while Advance() does O(1) work per expired timer and per cascade.
+ *
+ * Not thread safe, WFMOHandler serializes access to it.
+ */
+class TimerWheel {
+public:
+    static const unsigned SLOT_BITS = 6;
+    static const unsigned SLOTS = 1 << SLOT_BITS;   // slots per level
+    static const unsigned LEVELS = 6;               // 2^36 ticks, ~795 days at 1ms a tick
+
+    /*
+     * A timer. Derive from this to attach a payload to it. A node is
+     * pending from Schedule() until it is either cancelled or returned
+     * by Advance().
+     */
+    struct Node {
+        Node* m_prev;
+        Node* m_next;
+        uint64_t m_expires;     // tick at which the timer expires
+        unsigned m_slot;        // level*SLOTS + slot, or NO_SLOT
+        Node() : m_prev(NULL), m_next(NULL), m_expires(0), m_slot(NO_SLOT)
+        {}
+        bool IsPending() const { return m_prev != NULL; }
+    };
+
+    /*
+     * Node list as returned by Advance(). Cancelling a node in the list
+     * takes it out of the list.
+     */
+    class List {
+        Node m_head;
+        List(const List&);
+        List& operator=(const List&);
+        friend class TimerWheel;
+    public:
+        List() { m_head.m_prev = m_head.m_next = &m_head; }
+        bool Empty() const { return m_head.m_next == &m_head; }
+        /* removes & returns the first node, NULL if the list is empty */
+        Node* PopFront()
+        {
+            if (Empty())
+                return NULL;
+            Node* p = m_head.m_next;
+            Unlink(p);
+            return p;
+        }
+    };
+
+    static const uint64_t NEVER = ~static_cast<uint64_t>(0);
+
+    TimerWheel(uint64_t now = 0)
+        : m_now(now)
+        , m_count(0)
+    {
+        for (unsigned i=0; i<LEVELS*SLOTS; i++)
+            m_slots[i].m_head.m_prev = m_slots[i].m_head.m_next = &m_slots[i].m_head;
+        for (unsigned i=0; i<LEVELS; i++)
+            m_occupied[i] = 0;
+    }
+
+    /* the current tick, i.e., the last tick Advance() was called with */
+    uint64_t Now() const { return m_now; }
+
+    /* number of pending timers */
+    size_t Size() const { return m_count; }
+
+    /**
+     * Schedules a timer to expire at the given tick. A timer that is
+     * already pending is rescheduled. Expiry times in the past expire
+     * at the next tick.
+     */
+    void Schedule(Node* p, uint64_t expires)
+    {
+        if (p->IsPending())
+            Cancel(p);
+        p->m_expires = expires;
+        Place(p, m_now+1);  // the current tick's slot has been processed already
+        m_count++;
+    }
+
+    /* Cancels a pending timer, a no-op for a timer that's not pending */
+    void Cancel(Node* p)
+    {
+        if (!p->IsPending())
+            return;
+        if (p->m_slot != NO_SLOT) {
+            unsigned slot = p->m_slot;
+            Unlink(p);
+            if (m_slots[slot].Empty())
+                m_occupied[slot / SLOTS] &= ~(static_cast<uint64_t>(1) << (slot % SLOTS));
+            m_count--;
+        } else {
+            Unlink(p);  // in an expired list returned by Advance()
+        }
+    }
+
+    /**
+     * The earliest tick at which Advance() has work to do, or NEVER if there
+     * are no timers. This is usually a timer expiry; it can also be the tick
+     * at which timers far into the future are cascaded down a level, which
+     * at worst costs a spurious wake-up once every SLOTS^L ticks.
+     */
+    uint64_t NextTick() const
+    {
+        if (m_count == 0)
+            return NEVER;
+        uint64_t next = NEVER;
+        for (unsigned level=0; level<LEVELS; level++) {
+            if (m_occupied[level] == 0)
+                continue;
+            unsigned shift = level * SLOT_BITS;
+            uint64_t units = m_now >> shift;        // current tick in this level's units
+            unsigned cur = static_cast<unsigned>(units & (SLOTS-1));
+            // slots after the current one come up in this rotation, the
+            // others in the next one
+            uint64_t later = m_occupied[level] & ~LowMask(cur);
+            uint64_t tick;
+            if (later != 0)
+                tick = (units - cur + FirstSetBit(later)) << shift;
+            else
+                tick = (units - cur + SLOTS + FirstSetBit(m_occupied[level])) << shift;
+            if (tick < next)
+                next = tick;
+        }
+        return next;
+    }
+
+    /**
+     * Advances the wheel to the given tick, moving the timers that have
+     * expired on the way to the expired list, in expiry order.
+     */
+    void Advance(uint64_t now, List& expired)
+    {
+        while (m_now < now) {
+            uint64_t tick = NextTick();
+            if (tick > now) {
+                m_now = now;
+                break;
+            }
+            m_now = tick;
+
+            // cascade the slots of the higher levels whose span starts now
+            for (unsigned level=1; level<LEVELS; level++) {
+                unsigned shift = level * SLOT_BITS;
+                if ((tick & ((static_cast<uint64_t>(1) << shift) - 1)) != 0)
+                    break;
+                Cascade(level, static_cast<unsigned>((tick >> shift) & (SLOTS-1)));
+            }
+
+            // whatever is left in the level 0 slot expires now
+            unsigned slot = static_cast<unsigned>(tick & (SLOTS-1));
+            Slot& s = m_slots[slot];
+            while (!s.Empty()) {
+                Node* p = s.m_head.m_next;
+                Unlink(p);
+                p->m_slot = NO_SLOT;
+                Append(expired.m_head, p);
+                m_count--;
+            }
+            m_occupied[0] &= ~(static_cast<uint64_t>(1) << slot);
+        }
+    }
+
+private:
+    static const unsigned NO_SLOT = ~0u;
+
+    struct Slot {
+        Node m_head;
+        bool Empty() const { return m_head.m_next == &m_head; }
+    };
+
+    TimerWheel(const TimerWheel&);
+    TimerWheel& operator=(const TimerWheel&);
+
+    static void Unlink(Node* p)
+    {
+        p->m_prev->m_next = p->m_next;
+        p->m_next->m_prev = p->m_prev;
+        p->m_prev = p->m_next = NULL;
+    }
+    static void Append(Node& head, Node* p)
+    {
+        p->m_prev = head.m_prev;
+        p->m_next = &head;
+        head.m_prev->m_next = p;
+        head.m_prev = p;
+    }
+    /* bits 0..bit set */
+    static uint64_t LowMask(unsigned bit)
+    {
+        return (static_cast<uint64_t>(2) << bit) - 1;   // wraps to all ones for bit 63
+    }
+    static unsigned FirstSetBit(uint64_t x)
+    {
+#if defined(__GNUC__)
+        return static_cast<unsigned>(__builtin_ctzll(x));
+#elif defined(_MSC_VER)
+        unsigned long index = 0;
+        if (_BitScanForward(&index, static_cast<unsigned long>(x)))
+            return index;
+        _BitScanForward(&index, static_cast<unsigned long>(x >> 32));
+        return index + 32;
+#else
+        unsigned index = 0;
+        while ((x & 1) == 0) { x >>= 1; index++; }
+        return index;
+#endif
+    }
+
+    /* puts a node in the slot for its expiry time, relative to m_now */
+    void Place(Node* p, uint64_t earliest)
+    {
+        uint64_t expires = p->m_expires > earliest ? p->m_expires : earliest;
+        uint64_t delta = expires - m_now;
+        unsigned level = 0;
+        while (level < LEVELS-1 && delta >= (static_cast<uint64_t>(1) << ((level+1) * SLOT_BITS)))
+            level++;
+        unsigned slot = static_cast<unsigned>((expires >> (level * SLOT_BITS)) & (SLOTS-1));
+        p->m_slot = level * SLOTS + slot;
+        Append(m_slots[p->m_slot].m_head, p);
+        m_occupied[level] |= static_cast<uint64_t>(1) << slot;
+    }
+
+    /* re-places all the nodes of a slot, moving them down a level or more */
+    void Cascade(unsigned level, unsigned slot)
+    {
+        Slot& s = m_slots[level * SLOTS + slot];
+        m_occupied[level] &= ~(static_cast<uint64_t>(1) << slot);
+        Node pending;
+        pending.m_prev = pending.m_next = &pending;
+        while (!s.Empty()) {
+            Node* p = s.m_head.m_next;
+            Unlink(p);
+            Append(pending, p);
+        }
+        while (pending.m_next != &pending) {
+            Node* p = pending.m_next;
+            Unlink(p);
+            Place(p, m_now);    // the level 0 slot for m_now is processed next
+        }
+    }
+
+    uint64_t m_now;
+    size_t m_count;
+    Slot m_slots[LEVELS*SLOTS];
+    uint64_t m_occupied[LEVELS];    // bitmap of non-empty slots per level
+};
@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2013 Hariharan Mahadevan, hari@smallpearl.com
+ *
+ * Permission for ussage is hereby given, both for commercial as well as
+ * non-commercial purposes.
+ *
+ * Source code is provided "AS IS" without any warranties expressed or implied.
+ * Use it at your own risk.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * A token bucket rate limit: events may come in bursts of up to the
+ * bucket's depth, and at the rate it's refilled at on average. Time is in
+ * milliseconds, the ticks of WFMOHandler's timers, so the depth should
+ * hold at least a millisecond's worth of tokens.
+ *
+ * Not thread safe, WFMOHandler only uses it on its worker thread.
+ */
+class TokenBucket {
+public:
+    TokenBucket()
+        : m_tokens(0), m_stamp(0), m_rate(0), m_depth(0)
+    {}
+
+    /**
+     * Parameters:
+     *  rate  - tokens added per second, 0 for no limit
+     *  depth - most tokens held, 0 for a tenth of a second's worth
+     *  now   - the time, the bucket starts full
+     */
+    void Set(unsigned rate, unsigned depth, uint64_t now)
+    {
+        m_rate = rate;
+        m_depth = depth > 0 ? depth : rate / 10;
+        if (m_depth == 0)
+            m_depth = 1;
+        m_tokens = m_depth;
+        m_stamp = now;
+    }
+
+    bool IsLimited() const
+    { return m_rate != 0; }
+
+    /* Takes a token, false if there's none to take */
+    bool Take(uint64_t now)
+    {
+        if (m_rate == 0)
+            return true;
+        if (now > m_stamp) {
+            m_tokens += static_cast<double>(now - m_stamp) * m_rate / 1000;
+            if (m_tokens > m_depth)
+                m_tokens = m_depth;
+            m_stamp = now;
+        }
+        if (m_tokens < 1)
+            return false;
+        m_tokens -= 1;
+        return true;
+    }
+
+    /* The time Take() will next succeed at, as of the last call */
+    uint64_t ReadyAt() const
+    {
+        if (m_rate == 0 || m_tokens >= 1)
+            return m_stamp;
+        return m_stamp + static_cast<uint64_t>((1 - m_tokens) * 1000 / m_rate) + 1;
+    }
+
+private:
+    double m_tokens;
+    uint64_t m_stamp;       // when m_tokens was last brought up to date
+    unsigned m_rate;
+    unsigned m_depth;
+};
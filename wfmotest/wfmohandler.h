@@ -9,30 +9,154 @@
  */
 #pragma once
 
+#ifdef _WIN32
 #include <Windows.h>
-#include <vector>
-#include <list>
-#include <iostream>
 #include <crtdbg.h>
 #include <process.h>
+#else
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <cassert>
+#ifndef _ASSERTE
+#define _ASSERTE(expr) assert(expr)
+#endif
+#endif
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include "timerwheel.h"
+#include "dispatchpool.h"
+#include "mpscqueue.h"
+#include "metrics.h"
+#include "callable.h"
+#include "looptask.h"
+#include "iouring.h"
+#include "numa.h"
+#include "busypoll.h"
+#include "monotonic.h"
+#include "tokenbucket.h"
+#if WFMOHANDLER_IO_URING
+#include <poll.h>
+#include <memory>
+#include <functional>
+#include "datagram.h"
+#endif
 
 /**
  * A class to generalize WaitForMultipleObjects API handling.
- * Consists of a worker thread to which 
+ * Consists of a worker thread to which
+ *
+ * On Windows the worker thread blocks in WaitForMultipleObjectsEx. On Linux
+ * the same API is provided on top of epoll -- waitable handles are file
+ * descriptors and the internal events are eventfds.
+ *
+ * Timers do not use any kernel objects. They are kept in a timer wheel and
+ * the worker thread's wait times out when the earliest of them is due.
+ *
+ * The registry of handles and timers belongs to the worker thread. The
+ * Add/Remove/Adjust calls queue commands to it through a lock-free queue,
+ * so no lock is taken on either side and a running handler never holds up
+ * a registration.
+ *
+ * Handlers run on the worker thread, unless EnableDispatchPool() was called
+ * in which case the worker thread only detects readiness and handlers run on
+ * a pool of threads, never more than one at a time for the same handle or
+ * timer.
+ *
+ * Unless WFMOHANDLER_METRICS is defined as 0, the loop keeps counters of its
+ * wake-ups, its handlers' run times and more, see GetMetrics().
+ *
+ * On Linux, EnableIoUring() has the worker thread wait through io_uring
+ * instead of epoll, which also lets AddReceiveHandle() receive datagrams
+ * straight into buffers that the kernel picks.
  */
 class WFMOHandler {
+public:
+#ifdef _WIN32
+    typedef HANDLE WaitHandle;      // any Win32 handle that can be waited upon
+    typedef HANDLE ThreadHandle;
+#else
+    typedef int WaitHandle;         // any file descriptor that epoll accepts
+    typedef pthread_t ThreadHandle;
+#endif
+
+    /*
+     * What a repeat timer does about the periods that came due while it
+     * was late -- its handler ran long or the loop was busy. Either way
+     * the timer stays on its schedule of absolute deadlines, a period
+     * apart from when it was added.
+     */
+    enum OverrunPolicy {
+        OVERRUN_SKIP,       // drop them, the timer next goes off on its next deadline to come
+        OVERRUN_BURST,      // run them all, one after another, until the timer has caught up
+        OVERRUN_COALESCE    // run once for all of them, right away
+    };
+
+    /*
+     * How a handle's dispatches are held back, see AddWaitHandle(). A
+     * handle that has used up its rate leaves the wait set until its token
+     * bucket has refilled, so its events queue in the kernel meanwhile --
+     * a flooded socket drops datagrams there -- instead of taking the loop
+     * from the other handles. The handles that are ready at once are
+     * dispatched in order of priority.
+     */
+    struct HandleLimits {
+        enum Priority {
+            PRIORITY_HIGH,      // control handles: dispatched first
+            PRIORITY_NORMAL,
+            PRIORITY_LOW        // bulk traffic: dispatched last
+        };
+        Priority m_priority;
+        unsigned m_rate;        // most dispatches per second on average, 0 for no limit
+        unsigned m_burst;       // most dispatches in a burst, 0 for a tenth of a second's worth
+
+        HandleLimits(Priority priority = PRIORITY_NORMAL, unsigned rate = 0, unsigned burst = 0)
+            : m_priority(priority), m_rate(rate), m_burst(burst)
+        {}
+    };
+
+private:
     // Simple thread sync'ing objects
     // You may continue to use this or replace these with your project's
     // own synchronization primitives, if there are any.
     class CriticalSection {
+#ifdef _WIN32
         CRITICAL_SECTION m_cs;
+#else
+        pthread_mutex_t m_cs;
+#endif
         CriticalSection(const CriticalSection&);
         CriticalSection& operator=(const CriticalSection&);
     public:
+#ifdef _WIN32
         CriticalSection() { ::InitializeCriticalSection(&m_cs); }
         ~CriticalSection() { ::DeleteCriticalSection(&m_cs); }
         void Lock() { ::EnterCriticalSection(&m_cs); }
         void Unlock() { ::LeaveCriticalSection(&m_cs); }
+#else
+        CriticalSection() {
+            // recursive, just like a CRITICAL_SECTION
+            pthread_mutexattr_t attr;
+            ::pthread_mutexattr_init(&attr);
+            ::pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+            ::pthread_mutex_init(&m_cs, &attr);
+            ::pthread_mutexattr_destroy(&attr);
+        }
+        ~CriticalSection() { ::pthread_mutex_destroy(&m_cs); }
+        void Lock() { ::pthread_mutex_lock(&m_cs); }
+        void Unlock() { ::pthread_mutex_unlock(&m_cs); }
+#endif
     };
     class AutoLock {
         CriticalSection& m_cs;
@@ -41,151 +165,764 @@ class WFMOHandler {
         ~AutoLock() { m_cs.Unlock(); }
     };
 
-    // template that provides a non-type specific mechanism to 
+    // template that provides a non-type specific mechanism to
     // free containers of object pointers while releasing the objects
-    // themselves.
+    // themselves back to m_blocks.
     template<typename T>
     void FreePtrContainer(T& t) {
-        for (T::iterator it=t.begin(); it!=t.end(); it++)
-            delete (*it);
+        for (typename T::iterator it=t.begin(); it!=t.end(); it++)
+            DeleteObject(*it);
         t.clear();
     }
+    template<typename T>
+    void DeleteObject(T* p) {
+        m_blocks.Delete(p);
+    }
+
+    static const unsigned MAX_WAIT_COUNT = 64; // windows limitation
+    static const unsigned RESERVED_WAIT_COUNT = 3; // shutdown, wake-up & shard ready events
+    static const unsigned DEFAULT_BATCH_SIZE = 64;
+
+    // ////////////////////////// //
+    // Platform specific wrappers //
+    // ////////////////////////// //
+
+    // Events are manual reset -- they stay signalled until reset. On Linux
+    // an eventfd that is not drained behaves the same way under epoll's
+    // level triggered mode.
+    static WaitHandle InvalidHandle()
+    {
+#ifdef _WIN32
+        return NULL;
+#else
+        return -1;
+#endif
+    }
+    static WaitHandle CreateSignal()
+    {
+#ifdef _WIN32
+        return ::CreateEvent(NULL, TRUE, FALSE, NULL);
+#else
+        return ::eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+#endif
+    }
+    static void SetSignal(WaitHandle h)
+    {
+#ifdef _WIN32
+        ::SetEvent(h);
+#else
+        uint64_t one = 1;
+        ssize_t rc = ::write(h, &one, sizeof(one));
+        (void)rc;   // EAGAIN only when the counter is saturated, still signalled
+#endif
+    }
+    static void ResetSignal(WaitHandle h)
+    {
+#ifdef _WIN32
+        ::ResetEvent(h);
+#else
+        uint64_t count = 0;
+        ssize_t rc = ::read(h, &count, sizeof(count));
+        (void)rc;   // EAGAIN if it was not signalled
+#endif
+    }
+    static void CloseSignal(WaitHandle h)
+    {
+#ifdef _WIN32
+        ::CloseHandle(h);
+#else
+        ::close(h);
+#endif
+    }
+    // whether a handle refers to an open object, which AddWaitHandle() checks
+    // before it queues anything
+    static bool IsOpenHandle(WaitHandle h)
+    {
+#ifdef _WIN32
+        DWORD flags = 0;
+        return ::GetHandleInformation(h, &flags) != FALSE;
+#else
+        return ::fcntl(h, F_GETFD) != -1;
+#endif
+    }
+    // identifies the calling thread, see IsWorkerThread()
+#ifdef _WIN32
+    typedef DWORD ThreadId;
+    static ThreadId CurrentThreadId() { return ::GetCurrentThreadId(); }
+#else
+    typedef pthread_t ThreadId;
+    static ThreadId CurrentThreadId() { return ::pthread_self(); }
+#endif
+    // monotonic time in milliseconds, the unit of the timer wheel's ticks
+    static uint64_t NowMs()
+    {
+#ifdef _WIN32
+        return ::GetTickCount64();
+#else
+        struct timespec ts;
+        ::clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+#endif
+    }
 
-    static const UINT MAX_WAIT_COUNT = 64; // windows limitation
+    struct WaitHandler;
+    struct TimerHandler;
+    struct PostedTask;
+    struct WaiterShard;
+#if WFMOHANDLER_IO_URING
+    struct Receiver;
+#endif
 
-    // base class for waitable triggers
-    struct WaitHandlerBase {
-        HANDLE m_h;
-        bool m_markfordeletion;
-        WaitHandlerBase(HANDLE h) : m_h(h), m_markfordeletion(false)
+    /*
+     * A change to the registry of handles & timers, which belongs to the
+     * worker thread. Other threads queue commands to it through m_commands.
+     * Commands that refer to a handler or timer object -- adding it,
+     * releasing it, or reporting that its pooled handler has returned --
+     * are embedded in that object; the others are allocated from m_blocks
+     * and freed once they have been applied. Commands made on the worker
+     * thread itself are applied right away, see SubmitCommand().
+     */
+    struct Command : public MpscQueue::Node {
+        enum Type {
+            ADD_HANDLE,         // m_pHandler
+            REMOVE_HANDLE,      // m_h
+            DETACH_HANDLE,      // m_h & m_pTask, run once m_h is released
+            RELEASE_HANDLE,     // m_pHandler, retired by its waiter shard
+            HANDLE_DONE,        // m_pHandler, its pooled handler has returned
+            ADD_TIMER,          // m_pTimer
+            REMOVE_TIMER,       // m_id
+            ADJUST_TIMER,       // m_id, m_interval & m_repeat
+            TIMER_DONE,         // m_pTimer, its pooled handler has returned
+            RUN_TASK            // m_pTask
+        };
+        Type m_type;
+        bool m_fOwned;          // allocated for this command
+        WaitHandle m_h;
+        WaitHandler* m_pHandler;
+        TimerHandler* m_pTimer;
+        PostedTask* m_pTask;
+        unsigned m_id;
+        unsigned m_interval;
+        bool m_repeat;
+        Command(Type type, bool fOwned)
+            : m_type(type), m_fOwned(fOwned), m_h(InvalidHandle()), m_pHandler(NULL)
+            , m_pTimer(NULL), m_pTask(NULL), m_id(0), m_interval(0), m_repeat(false)
         {}
-        virtual ~WaitHandlerBase()
+        // a copy of cmd that can be queued
+        Command(const Command& cmd, bool fOwned)
+            : MpscQueue::Node(), m_type(cmd.m_type), m_fOwned(fOwned), m_h(cmd.m_h), m_pHandler(cmd.m_pHandler)
+            , m_pTimer(cmd.m_pTimer), m_pTask(cmd.m_pTask), m_id(cmd.m_id), m_interval(cmd.m_interval)
+            , m_repeat(cmd.m_repeat)
         {}
-		virtual bool IsTimer() { return false; }
-        virtual void invoke(WFMOHandler*) = 0;
     };
 
-    // for generating a class based on user supplied handler function object
-    template<typename Handler>
-    struct WaitHandler : public WaitHandlerBase {
-        Handler m_handler;
-        WaitHandler(HANDLE h, Handler handler)
-            : WaitHandlerBase(h), m_handler(handler)
-        {}
-        virtual void invoke(WFMOHandler* pHandler) {
-            pHandler;
+    // a waitable trigger and its handler
+    struct WaitHandler {
+#ifdef _WIN32
+        static const size_t NO_SLOT = static_cast<size_t>(-1);
+#endif
+        WaitHandle m_h;
+        // the worker thread sets these three without the lock that a waiter
+        // shard reads them under in BuildShardHandleArray(), then has the
+        // shard rebuild its array
+        std::atomic<bool> m_markfordeletion;
+        std::atomic<bool> m_fInFlight;  // queued or running in the dispatch pool, not waited upon
+        bool m_fOneShot;        // removed once dispatched, see AwaitHandle()
+        std::atomic<bool> m_fThrottled; // out of tokens, left out of the wait set until its bucket refills
+        unsigned char m_priority;   // a HandleLimits::Priority
+        size_t m_index;         // position in m_waithandlers, m_retiredhandlers or m_pShard->m_handlers
+        WaiterShard* m_pShard;  // shard waiting on m_h, NULL if it's the worker thread
+#ifdef _WIN32
+        size_t m_slot;          // position in m_armedhandlers, NO_SLOT if the worker doesn't wait on it
+#endif
+#if WFMOHANDLER_IO_URING
+        Receiver* m_pReceiver;  // owned, NULL unless added by AddReceiveHandle()
+        bool m_fInRing;         // a poll or receive is outstanding on the ring for it
+#endif
+        PostedTask* m_pDetached;    // run instead of OnWaitHandleRemoved(), see DetachWaitHandle()
+        TokenBucket m_bucket;   // its rate limit, see HandleLimits
+        size_t m_throttleindex; // position in m_throttled
+        Command m_cmd;          // for queueing this handler to the worker thread
+        Callable m_handler;     // user supplied handler functor
+        HandleCounters m_counters;
+#if WFMOHANDLER_METRICS
+        size_t m_meteredindex;  // position in m_metered
+#endif
+        WaitHandler(WaitHandle h, Callable&& handler)
+            : m_h(h), m_markfordeletion(false), m_fInFlight(false), m_fOneShot(false), m_fThrottled(false)
+            , m_priority(HandleLimits::PRIORITY_NORMAL), m_index(0), m_pShard(NULL)
+#ifdef _WIN32
+            , m_slot(NO_SLOT)
+#endif
+#if WFMOHANDLER_IO_URING
+            , m_pReceiver(NULL), m_fInRing(false)
+#endif
+            , m_pDetached(NULL), m_bucket(), m_throttleindex(0), m_cmd(Command::ADD_HANDLE, false)
+            , m_handler(std::move(handler))
+        {
+            m_cmd.m_pHandler = this;
+        }
+#if WFMOHANDLER_IO_URING
+        ~WaitHandler() {
+            delete m_pReceiver;
+        }
+#endif
+        void invoke() {
             m_handler();
         }
     };
 
-    // ///////////// //
-    // Timer support //
-    // ///////////// //
+#if WFMOHANDLER_IO_URING
+public:
+    /*
+     * Called on the worker thread with the datagrams a receive handle got,
+     * in the order they arrived. The data is only valid until it returns.
+     */
+    typedef std::function<void (const Datagram* pDatagrams, size_t count)> ReceiveHandler;
 
-    // An intermediate class to distinguish between WaitHandler and TimerHandler
-    // objects given a pointer to WaitHandlerBase object. With this in the derivation
-    // chain of TimerHandler<>, we don't need to add a method to WaitHandlerBase 
-    // specifically designed to distinguish TimerHandler<> children from other 
-    // children. What we can instead do is to use dynamic_cast<> to cast up a 
-    // WaitHandlerBase object pointer to TimerIntermediate*. If that succeeds, 
-    // we know that the object is a type specialized instance of the 
-    // TimerHandler<> class.
-    struct TimerIntermediate {
-        TimerIntermediate(unsigned id)
-            : m_id(id)
-        {}
-        unsigned m_id; // unique id of the timer, can be used to cancel the timer
+private:
+    /*
+     * The state of a handle added by AddReceiveHandle(). A multishot
+     * receive on the ring picks a buffer from m_buffers for each datagram;
+     * the datagrams completed in a wake-up are collected and delivered
+     * together, and their buffers are given back to the ring once the
+     * handler returns. The buffers hold an io_uring_recvmsg_out header and
+     * the sender's address ahead of the datagram.
+     */
+    struct Receiver {
+        ReceiveHandler m_handler;
+        BufferRing m_buffers;
+        size_t m_cbBuffer;              // longest datagram, longer ones are truncated
+        unsigned m_nBuffers;
+        struct msghdr m_msg;            // tells the receive the layout of the buffers
+        std::vector<Datagram> m_datagrams;      // received, not delivered yet
+        std::vector<unsigned short> m_bids;     // their buffers
+        bool m_fQueued;                 // in the batch of the current wake-up
+        bool m_fFailed;                 // the receive failed, it isn't re-armed
+        Receiver(ReceiveHandler&& handler, size_t cbBuffer, unsigned nBuffers)
+            : m_handler(std::move(handler)), m_cbBuffer(cbBuffer), m_nBuffers(nBuffers > 0 ? nBuffers : 1)
+            , m_fQueued(false), m_fFailed(false)
+        {
+            ::memset(&m_msg, 0, sizeof(m_msg));
+            m_msg.msg_namelen = sizeof(struct sockaddr_in);
+        }
+        size_t BufferSize() const
+        { return sizeof(struct io_uring_recvmsg_out) + m_msg.msg_namelen + m_cbBuffer; }
     };
+#endif
 
-    // For generating a class based on the user supplied timer handler functor.
-    // Timer objects are type specialized instantiations of this class
-    template<typename Handler>
-    struct TimerHandler : public WaitHandlerBase, public TimerIntermediate {
-
-        typedef TimerHandler<Handler> thisClass;
+    // ///////////// //
+    // Timer support //
+    // ///////////// //
 
-        TimerHandler(unsigned milliseconds, bool repeat, unsigned id, Handler handler)
-            : WaitHandlerBase(::CreateWaitableTimer(NULL, TRUE, NULL))
-            , TimerIntermediate(id)
-            , m_interval(milliseconds)
-            , m_repeat(repeat)
-            , m_handler(handler)
-        {
-            if (m_h != NULL) { // for SEF C6387
-                LARGE_INTEGER due = {0, 0};
-                due.QuadPart = (LONGLONG)milliseconds*(LONGLONG)-10000; // minus value to indicate relative time (and not absolute time)
-                LONG lPeriod = repeat ? milliseconds : 0;   // repeat time is in milliseconds!
-                ::SetWaitableTimer(m_h,
-                    &due,
-                    lPeriod,
-                    NULL,
-                    NULL,
-                    FALSE);
-            }
-        }
-        ~TimerHandler()
+    // a timer and its handler, timers are nodes of m_timerwheel
+    struct TimerHandler : public TimerWheel::Node {
+        unsigned m_id;          // unique id of the timer, can be used to cancel the timer
+        unsigned m_interval;    // time the timer will expire
+        unsigned m_slack;       // how much later than that it may expire, see AddTimer()
+        uint64_t m_deadline;    // when it's due, before its slack rounds that up
+        uint64_t m_overruns;    // periods it was late for, see TimerOverruns()
+        OverrunPolicy m_policy; // for a repeat timer that is late
+        bool m_repeat;          // whether the timer will repeat
+        bool m_markfordeletion; // removed while its handler was running
+        bool m_fInFlight;       // queued or running in the dispatch pool
+        Command m_cmd;          // for queueing this timer to the worker thread
+        Callable m_handler;     // handler functor to be called when the timer has gone off
+        TimerHandler(unsigned id, unsigned milliseconds, bool repeat, Callable&& handler,
+                unsigned slack = 0, OverrunPolicy policy = OVERRUN_SKIP)
+            : m_id(id), m_interval(milliseconds), m_slack(slack), m_deadline(0), m_overruns(0), m_policy(policy)
+            , m_repeat(repeat), m_markfordeletion(false), m_fInFlight(false)
+            , m_cmd(Command::ADD_TIMER, false), m_handler(std::move(handler))
         {
-            // timer handles are owned internally by us, close them or there'll be handle leak!
-            ::CloseHandle(m_h);
+            m_cmd.m_pTimer = this;
         }
-		virtual bool IsTimer() { return true; }
-        virtual void invoke(WFMOHandler* pHandler) {
-            
+        void invoke() {
             m_handler();    // call the functor
+        }
+    };
 
-            if (m_repeat) {
-                // for repeat timers, reset the timer object so that it will be reset
-                // and signalled when the timeout expires again
-                LARGE_INTEGER due = {0, 0};
-                due.QuadPart = (LONGLONG)m_interval*(LONGLONG)-10000; // minus value to indicate relative time (and not absolute time)
-                LONG lPeriod = m_repeat ? m_interval : 0;   // repeat time is in milliseconds!
-                ::SetWaitableTimer(m_h,
-                    &due,
-                    lPeriod,
-                    NULL,
-                    NULL,
-                    FALSE);
-            } else {
-                // for non-repeat timers (one-off timer), mark the object for deletion
-                // and set the event that will rebuild the wait handle array
-                m_markfordeletion = true;
-                ::SetEvent(pHandler->m_rebuildwaitarrayevent);
-            }
+    // a function object queued by Post()
+    struct PostedTask {
+        Command m_cmd;          // queues the task itself
+        Callable m_handler;
+        PostedTask(Callable&& handler)
+            : m_cmd(Command::RUN_TASK, false), m_handler(std::move(handler))
+        {
+            m_cmd.m_pTask = this;
         }
+    };
 
-        unsigned m_interval;    // time the timer will expire
-        bool m_repeat;          // whether the timer will repeat
-        Handler m_handler;      // handler functor to be called when the timer has gone off
+    // ///////////// //
+    // Waiter shards //
+    // ///////////// //
+
+    /*
+     * WaitForMultipleObjects can only wait on 64 handles. Once the worker
+     * thread's own wait array is full, further handles are given to waiter
+     * shards -- helper threads that wait on up to 63 handles each, plus a
+     * control event. A shard does not invoke handlers. It reports the
+     * signalled handler to the worker thread and parks until the worker has
+     * invoked it, so handlers still run one at a time on the worker thread.
+     *
+     * A shard's state is shared by the worker and the shard thread and is
+     * protected by m_lock, except for m_nlive which belongs to the worker
+     * and m_armed which belongs to the shard thread.
+     *
+     * epoll has no such limit, so shards are only used on Windows.
+     */
+    struct WaiterShard : public MpscQueue::Node {
+        static const size_t MAX_HANDLERS = MAX_WAIT_COUNT-1;
+
+        WFMOHandler* m_owner;
+        CriticalSection m_lock;
+        WaitHandle m_control;       // auto reset event that wakes up the shard
+        ThreadHandle m_hThread;
+        std::vector<WaitHandler*> m_handlers;   // owned
+        std::vector<WaitHandler*> m_armed;      // in wait array order, not in flight
+        size_t m_nlive;             // handlers in m_handlers not marked for deletion
+        WaitHandler* m_pReady;  // handler reported to the worker thread
+        bool m_fParked;             // waiting for the worker to invoke m_pReady
+        bool m_fRebuild;            // m_handlers has changed
+        bool m_fQuit;
+
+        WaiterShard(WFMOHandler* owner)
+            : m_owner(owner)
+            , m_control(InvalidHandle())
+            , m_hThread()
+            , m_nlive(0)
+            , m_pReady(NULL)
+            , m_fParked(false)
+            , m_fRebuild(true)
+            , m_fQuit(false)
+        {}
     };
 
 public:
     WFMOHandler()
         : m_sync()
-        , m_shutdownevent(::CreateEvent(NULL, TRUE, FALSE, NULL))
-        , m_rebuildwaitarrayevent(::CreateEvent(NULL, TRUE, FALSE, NULL))
+        , m_blocks()
+        , m_handles(0, HANDLEMAP::hasher(), HANDLEMAP::key_equal(), HANDLEMAP::allocator_type(m_blocks))
+        , m_timers(0, TIMERMAP::hasher(), TIMERMAP::key_equal(), TIMERMAP::allocator_type(m_blocks))
+        , m_shutdownevent(CreateSignal())
+        , m_wakeupevent(CreateSignal())
+        , m_fWakeupPending(false)
+#ifdef _WIN32
+        , m_shardreadyevent(CreateSignal())
         , m_htWorker(NULL)
-        , m_uWorkerThreadId(0)
+#else
+        , m_epoll(::epoll_create1(EPOLL_CLOEXEC))
+#if WFMOHANDLER_IO_URING
+        , m_ringpending(0)
+        , m_nextbgid(0)
+#endif
+        , m_htWorker()
+        , m_fWorkerStarted(false)
+#endif
+        , m_workerthreadid(ThreadId())
         , m_nexttimertriggerid(1)
-    {}
+        , m_timerwheel(NowMs())
+        , m_pRunningTimer(NULL)
+        , m_fPooled(false)
+        , m_npoolthreads(0)
+        , m_options()
+        , m_batchsize(DEFAULT_BATCH_SIZE)
+        , m_rotation(0)
+        , m_batchwakeups(0)
+        , m_batchevents(0)
+        , m_batchmax(0)
+    {
+#ifdef _WIN32
+        // the client handles follow the internal events in the wait array
+        m_waitarray.push_back(m_shutdownevent);
+        m_waitarray.push_back(m_wakeupevent);
+        m_waitarray.push_back(m_shardreadyevent);
+#else
+        // the two internal events are told apart by the address of the
+        // member that holds them
+        WatchInternalEvent(m_shutdownevent);
+        WatchInternalEvent(m_wakeupevent);
+#endif
+    }
     virtual ~WFMOHandler()
     {
         Stop();
     }
 
+    /**
+     * Have the handlers invoked on a work-stealing thread pool instead of
+     * the worker thread, which is then only left to wait for the handles
+     * and the timers. The handler of a handle is not waited upon again
+     * until it returns, so no handle's (or timer's) handler ever runs
+     * concurrently with itself. Handlers of different handles do run
+     * concurrently -- use m_sync, or your own locks, to protect state that
+     * handlers share.
+     * Must be called before Start().
+     * Parameters:
+     *  nThreads - number of pool threads, 0 for one per processor core
+     */
+    void EnableDispatchPool(unsigned nThreads = 0)
+    {
+        m_fPooled = true;
+        m_npoolthreads = nThreads;
+    }
+
+#if WFMOHANDLER_IO_URING
+    /**
+     * Have the worker thread wait through io_uring instead of epoll. Each
+     * loop iteration then submits the polls & receives it has queued and
+     * waits for completions in a single io_uring_enter() call, and reaps
+     * all the completions that are ready. Handles added with AddWaitHandle()
+     * are polled for one wake-up at a time and polled again once their
+     * handler returns, so they behave the same as with epoll.
+     * Must be called before Start(). Needs Linux 6.0 or later for
+     * AddReceiveHandle().
+     * Parameters:
+     *  nEntries - submission queue size, the most polls & receives armed
+     *             per system call
+     * Returns:
+     *  false if io_uring isn't available, in which case epoll is used
+     */
+    bool EnableIoUring(unsigned nEntries = 256)
+    {
+        return m_ring.IsOpen() || m_ring.Open(nEntries);
+    }
+
+    /* whether EnableIoUring() has succeeded */
+    bool UsesIoUring() const
+    { return m_ring.IsOpen(); }
+#endif
+
+    /*
+     * How the worker thread is created and where the loop's memory lives,
+     * see SetStartOptions()
+     */
+    struct StartOptions {
+        static const int INHERIT = -1;          // m_policy: the starting thread's scheduling
+        static const int LOCAL_NODE = -2;       // m_numanode: the node of m_cpus[0]
+
+        std::vector<unsigned> m_cpus;   // CPUs the worker may run on, as the OS numbers them; any if empty
+        int m_policy;                   // Linux: SCHED_OTHER, SCHED_FIFO, SCHED_RR... or INHERIT
+        int m_priority;                 // Linux: m_policy's sched_priority; Windows: a THREAD_PRIORITY_* value
+        size_t m_stacksize;             // bytes, 0 for the OS's default
+        int m_numanode;                 // node for handler storage and receive buffers, or
+                                        // NumaMemory::ANY_NODE or LOCAL_NODE
+
+        StartOptions()
+            : m_policy(INHERIT), m_priority(0), m_stacksize(0), m_numanode(NumaMemory::ANY_NODE)
+        {}
+    };
+
+    /**
+     * Sets the options Start() creates the worker thread with. Start()
+     * fails if a CPU doesn't exist, if the stack size is too small or if
+     * the scheduling policy isn't permitted -- real-time policies need
+     * CAP_SYS_NICE on Linux.
+     *
+     * The NUMA node applies at once: handlers, timers and commands are
+     * allocated on it from now on, as are the buffers of receive handles
+     * and of AsyncSockets registered with the loop. So call this before
+     * adding anything. The node isn't enforced, the OS falls back to other
+     * nodes when it runs out of memory.
+     * Must be called before Start().
+     */
+    void SetStartOptions(const StartOptions& options)
+    {
+        m_options = options;
+        if (m_options.m_numanode == StartOptions::LOCAL_NODE)
+            m_options.m_numanode = m_options.m_cpus.empty() ? NumaMemory::ANY_NODE : NumaMemory::NodeOfCpu(m_options.m_cpus[0]);
+        m_blocks.PlaceOnNode(m_options.m_numanode);
+    }
+
+    /* the NUMA node the loop allocates on, NumaMemory::ANY_NODE if none */
+    int NumaNode() const
+    { return m_options.m_numanode; }
+
+    /**
+     * Runs the worker thread on the given CPU only, the shorthand for
+     * setting StartOptions::m_cpus to just that CPU. With a loop, and its
+     * sockets, per core -- see AsyncSocket's fReusePort -- each loop then
+     * keeps its handles' state in its own core's caches. Start() fails if
+     * the CPU doesn't exist.
+     * Must be called before Start().
+     * Parameters:
+     *  cpu - CPU number, as the OS counts them from 0
+     */
+    void PinWorkerThread(unsigned cpu)
+    {
+        m_options.m_cpus.assign(1, cpu);
+    }
+
+    /**
+     * Returns:
+     *  the CPUs the process may run on, lowest first, as the OS numbers
+     *  them: its affinity mask, which cpusets, containers and taskset can
+     *  narrow down to fewer CPUs than the machine has. On Windows, those of
+     *  the process's processor group. If the mask can't be read, CPUs 0 to
+     *  std::thread::hardware_concurrency() - 1.
+     */
+    static std::vector<unsigned> AllowedCpus()
+    {
+        std::vector<unsigned> cpus;
+#ifdef _WIN32
+        DWORD_PTR process = 0, system = 0;
+        if (::GetProcessAffinityMask(::GetCurrentProcess(), &process, &system)) {
+            for (unsigned i=0; i<sizeof(DWORD_PTR)*8; i++) {
+                if (process & (static_cast<DWORD_PTR>(1) << i))
+                    cpus.push_back(i);
+            }
+        }
+#else
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        if (::sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+            for (unsigned i=0; i<CPU_SETSIZE; i++) {
+                if (CPU_ISSET(i, &cpuset))
+                    cpus.push_back(i);
+            }
+        }
+#endif
+        if (cpus.empty()) {
+            unsigned n = std::thread::hardware_concurrency();
+            for (unsigned i=0; i<(n > 0 ? n : 1); i++)
+                cpus.push_back(i);
+        }
+        return cpus;
+    }
+
+    /**
+     * Sets the maximum number of signalled handles dispatched off a single
+     * wait -- the size of the epoll_wait event array on Linux. On Windows
+     * there can't be more than the 61 handles of the worker's wait array.
+     * Must be called before Start().
+     */
+    void SetBatchSize(unsigned nEvents)
+    {
+        m_batchsize = nEvents > 0 ? nEvents : 1;
+    }
+
+    /* Readiness batching counters, see GetBatchStats() */
+    struct BatchStats {
+        uint64_t m_wakeups;     // waits that returned signalled handles
+        uint64_t m_events;      // handles dispatched off those waits
+        uint64_t m_maxbatch;    // most handles dispatched off a single wait
+    };
+
+    /**
+     * Returns how many handles the worker thread dispatches per wake-up,
+     * m_events/m_wakeups on average. May be called from any thread.
+     */
+    BatchStats GetBatchStats() const
+    {
+        BatchStats stats;
+        stats.m_wakeups = m_batchwakeups.load(std::memory_order_relaxed);
+        stats.m_events = m_batchevents.load(std::memory_order_relaxed);
+        stats.m_maxbatch = m_batchmax.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    /**
+     * Have the worker thread poll for ready handles, without blocking, for
+     * a while before it blocks in the kernel, so that an event coming in
+     * shortly after a batch is picked up without the cost of a sleep and a
+     * wake-up. The time it spins adapts, see BusyPoll: it grows towards
+     * usMax while events keep coming in soon after the loop has blocked,
+     * and shrinks to nothing once the loop is idle. On Linux the sockets
+     * added from then on also get SO_BUSY_POLL, so that their reads poll
+     * the device queue -- raising it above net.core.busy_read needs
+     * CAP_NET_ADMIN, and is quietly skipped without.
+     * For latency critical loops pinned to a core of their own; a loop
+     * that spins takes CPU from whatever shares its core.
+     * Must be called before Start().
+     * Parameters:
+     *  usMax    - most microseconds to spin per wait, 0 to turn it off
+     *  usSocket - SO_BUSY_POLL microseconds, 0 to leave the sockets alone
+     */
+    void EnableBusyPoll(unsigned usMax = BusyPoll::DEFAULT_MAX_US, unsigned usSocket = BusyPoll::DEFAULT_SOCKET_US)
+    {
+        m_busypoll.Enable(usMax, usSocket);
+    }
+
+    /* Busy polling counters, see GetBusyPollStats() */
+    struct BusyPollStats {
+        uint64_t m_spins;       // waits that spun before blocking
+        uint64_t m_spinhits;    // of those, the ones that found a handle ready or work queued
+        uint64_t m_sleeps;      // waits that blocked
+        uint64_t m_spinningns;  // time the worker thread spent spinning
+        uint64_t m_sleepingns;  // time it spent blocked
+        uint64_t m_budgetns;    // how long it spins per wait at present
+    };
+
+    /**
+     * Returns how the worker thread's waiting time splits between spinning
+     * and sleeping, with EnableBusyPoll(). May be called from any thread.
+     */
+    BusyPollStats GetBusyPollStats() const
+    {
+        BusyPollStats stats;
+        stats.m_spins = m_busypoll.Spins();
+        stats.m_spinhits = m_busypoll.SpinHits();
+        stats.m_sleeps = m_busypoll.Sleeps();
+        stats.m_spinningns = m_busypoll.SpinningNs();
+        stats.m_sleepingns = m_busypoll.SleepingNs();
+        stats.m_budgetns = m_busypoll.BudgetNs();
+        return stats;
+    }
+
+    /* Counters of a wait handle's handler, see GetMetrics() */
+    struct HandleMetrics {
+        WaitHandle m_h;
+        uint64_t m_dispatches;  // times the handler ran
+        uint64_t m_totalns;     // total time it ran for
+        uint64_t m_maxns;       // longest it ran for
+        uint64_t m_throttled;   // times it was held back by its rate limit
+    };
+
+    /* Event loop counters, see GetMetrics() */
+    struct Metrics {
+        uint64_t m_wakeups;     // returns from the worker's wait, for whatever reason
+        uint64_t m_events;      // handles dispatched, as in BatchStats
+        uint64_t m_timers;      // timers that went off
+        uint64_t m_overruns;    // periods repeat timers were late for, see TimerOverruns()
+        uint64_t m_throttled;   // times handles were held back by their rate limits
+        uint64_t m_tasks;       // Post()ed tasks run
+        uint64_t m_commands;    // Add/Remove/Adjust and internal commands applied
+        uint64_t m_rebuilds;    // waiter shard wait array rebuilds; 0 on Linux
+        uint64_t m_ringenters;  // io_uring_enter() calls; 0 unless EnableIoUring()
+        uint64_t m_blockedns;   // time the worker thread spent waiting, spinning included
+        uint64_t m_runningns;   // time it spent doing anything else
+        MetricsHistogram m_handlerns;       // run times of the handle & timer handlers and tasks
+        MetricsHistogram m_timerlateness;   // time from a timer being due to its handler
+                                            // being run or queued, to the millisecond
+        std::vector<HandleMetrics> m_handles;   // filled in on request only
+    };
+
+    /**
+     * Takes a snapshot of the event loop's counters. May be called from any
+     * thread; the counters are read without a lock, so it's cheap enough to
+     * poll. Listing the handles, to find a slow handler, takes a lock that
+     * only handle registrations and releases also take.
+     * Parameters:
+     *  metrics  - receives the counters
+     *  fHandles - also fill in metrics.m_handles
+     * Returns:
+     *  false if metrics were compiled out (WFMOHANDLER_METRICS is 0), in
+     *  which case the counters are all 0
+     */
+    bool GetMetrics(Metrics& metrics, bool fHandles = false)
+    {
+        metrics.m_wakeups = m_metrics.Wakeups();
+        metrics.m_events = m_batchevents.load(std::memory_order_relaxed);
+        metrics.m_timers = m_metrics.Timers();
+        metrics.m_overruns = m_metrics.Overruns();
+        metrics.m_throttled = m_metrics.Throttled();
+        metrics.m_tasks = m_metrics.Tasks();
+        metrics.m_commands = m_metrics.Commands();
+        metrics.m_rebuilds = m_metrics.Rebuilds();
+#if WFMOHANDLER_IO_URING
+        metrics.m_ringenters = m_ring.Enters();
+#else
+        metrics.m_ringenters = 0;
+#endif
+        metrics.m_blockedns = m_metrics.BlockedNs();
+        metrics.m_runningns = m_metrics.RunningNs();
+        m_metrics.ReadHandlerNs(metrics.m_handlerns);
+        m_metrics.ReadTimerLateness(metrics.m_timerlateness);
+        metrics.m_handles.clear();
+#if WFMOHANDLER_METRICS
+        if (fHandles) {
+            AutoLock l(m_meteredlock);
+            metrics.m_handles.resize(m_metered.size());
+            for (size_t i=0; i<m_metered.size(); i++) {
+                const HandleCounters& c = m_metered[i]->m_counters;
+                HandleMetrics& hm = metrics.m_handles[i];
+                hm.m_h = m_metered[i]->m_h;
+                hm.m_dispatches = c.m_dispatches.load(std::memory_order_relaxed);
+                hm.m_totalns = c.m_totalns.load(std::memory_order_relaxed);
+                hm.m_maxns = c.m_maxns.load(std::memory_order_relaxed);
+                hm.m_throttled = c.m_throttled.load(std::memory_order_relaxed);
+            }
+        }
+#else
+        (void)fHandles;
+#endif
+        return LoopMetrics::ENABLED;
+    }
+
     /**
      * Start the worker thread which will block in a WaitForMult...
      * for one of the queued up waitable handles to be triggered.
+     * The thread is created as SetStartOptions() asked.
      */
     bool Start()
     {
+        const std::vector<unsigned>& cpus = m_options.m_cpus;
+#ifdef _WIN32
+        DWORD_PTR mask = 0;
+        for (size_t i=0; i<cpus.size(); i++) {
+            if (cpus[i] >= sizeof(DWORD_PTR)*8)
+                return false;
+            mask |= static_cast<DWORD_PTR>(1) << cpus[i];
+        }
+#else
+        if (m_epoll == -1)
+            return false;
+        cpu_set_t cpuset;
+        CPU_ZERO(&cpuset);
+        for (size_t i=0; i<cpus.size(); i++) {
+            if (cpus[i] >= CPU_SETSIZE)
+                return false;
+            CPU_SET(cpus[i], &cpuset);
+        }
+#endif
+        if (m_fPooled && !m_pool.Start(m_npoolthreads))
+            return false;
+#ifdef _WIN32
+        // the worker is created suspended, so that it never runs elsewhere
+        // or at another priority
+        unsigned uThreadId = 0;
         m_htWorker = reinterpret_cast<HANDLE>(::_beginthreadex(NULL,
-            0,
+            static_cast<unsigned>(m_options.m_stacksize),
             WFMOHandler::_ThreadProc,
             this,
-            0,
-            &m_uWorkerThreadId));
-        if (m_htWorker == NULL)
+            CREATE_SUSPENDED | (m_options.m_stacksize != 0 ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0),
+            &uThreadId));
+        if (m_htWorker == NULL) {
+            m_pool.Stop();
+            return false;
+        }
+        if (mask != 0 && ::SetThreadAffinityMask(m_htWorker, mask) == 0)
+            std::cerr << "SetThreadAffinityMask failed, error code: " << ::GetLastError() << std::endl;
+        if (m_options.m_priority != THREAD_PRIORITY_NORMAL && !::SetThreadPriority(m_htWorker, m_options.m_priority))
+            std::cerr << "SetThreadPriority failed, error code: " << ::GetLastError() << std::endl;
+        ::ResumeThread(m_htWorker);
+#else
+        pthread_attr_t attr;
+        ::pthread_attr_init(&attr);
+        int rc = 0;
+        if (!cpus.empty())
+            rc = ::pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
+        if (rc == 0 && m_options.m_stacksize != 0)
+            rc = ::pthread_attr_setstacksize(&attr, m_options.m_stacksize);
+        if (rc == 0 && m_options.m_policy != StartOptions::INHERIT) {
+            struct sched_param param;
+            ::memset(&param, 0, sizeof(param));
+            param.sched_priority = m_options.m_priority;
+            rc = ::pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+            if (rc == 0)
+                rc = ::pthread_attr_setschedpolicy(&attr, m_options.m_policy);
+            if (rc == 0)
+                rc = ::pthread_attr_setschedparam(&attr, &param);
+        }
+        if (rc == 0)
+            rc = ::pthread_create(&m_htWorker, &attr, WFMOHandler::_ThreadProc, this);
+        ::pthread_attr_destroy(&attr);
+        if (rc != 0) {
+            std::cerr << "Error creating the worker thread, error code: " << rc << std::endl;
+            m_pool.Stop();
             return false;
+        }
+        m_fWorkerStarted = true;
+#endif
         return true;
     }
 
@@ -195,25 +932,67 @@ public:
     void Stop()
     {
         // stop the worker thread if it's been started
+#ifdef _WIN32
         if (m_htWorker != NULL) {
-            SetEvent(m_shutdownevent);
+            SetSignal(m_shutdownevent);
             ::WaitForSingleObject(m_htWorker, INFINITE);
             ::CloseHandle(m_htWorker); m_htWorker = NULL;
         }
+        // runs the handlers still queued, shards are woken up by them
+        m_pool.Stop();
+        ClearMetered();
+        StopShards();
+        if (m_shardreadyevent != NULL) { ::CloseHandle(m_shardreadyevent); m_shardreadyevent = NULL; }
+#else
+        if (m_fWorkerStarted) {
+            SetSignal(m_shutdownevent);
+            ::pthread_join(m_htWorker, NULL);
+            m_fWorkerStarted = false;
+        }
+        // runs the handlers still queued
+        m_pool.Stop();
+        ClearMetered();
+        if (m_epoll != -1) { ::close(m_epoll); m_epoll = -1; }
+#if WFMOHANDLER_IO_URING
+        m_ring.Close();
+#endif
+#endif
+        // the worker thread is gone, so this thread may consume the commands
+        DiscardCommands();
 
-        if (m_shutdownevent) { ::CloseHandle(m_shutdownevent); m_shutdownevent = NULL; }
-        if (m_rebuildwaitarrayevent) { ::CloseHandle(m_rebuildwaitarrayevent); m_rebuildwaitarrayevent = NULL; }
+        if (m_shutdownevent != InvalidHandle()) { CloseSignal(m_shutdownevent); m_shutdownevent = InvalidHandle(); }
+        if (m_wakeupevent != InvalidHandle()) { CloseSignal(m_wakeupevent); m_wakeupevent = InvalidHandle(); }
 
         FreePtrContainer(m_waithandlers);
+        FreePtrContainer(m_retiredhandlers);
+        FreePtrContainer(m_removedhandlers);
+        m_throttled.clear();    // all in m_waithandlers
+        m_handles.clear();
+        for (TIMERMAP::iterator it=m_timers.begin(); it!=m_timers.end(); it++) {
+            m_timerwheel.Cancel(it->second);
+            m_blocks.Delete(it->second);
+        }
+        m_timers.clear();
+#ifdef _WIN32
+        m_armedhandlers.clear();
+        m_waitarray.resize(RESERVED_WAIT_COUNT);
+#endif
     }
 
     /**
-     * Add a handler that will be set off when a win32 handle 
-     * is set. Handlers are function objects internally and 
+     * Add a handler that will be set off when a win32 handle
+     * is set. Handlers are function objects internally and
      * when the Win32 handle specified by first argument is set,
      * the handler functor will be invoked.
-     * 
-     * @param A Win32 handle that can be waited upon
+     *
+     * The handler is queued to the worker thread, which adds it to
+     * its wait set; this neither takes a lock nor waits for a handler
+     * that may be running. Called on the worker thread, the handle is
+     * added right away.
+     *
+     * @param A Win32 handle that can be waited upon. On Linux, a file
+     *        descriptor that becomes readable when the handler has work
+     *        to do.
      * @param a function object that can be invoked when
      *        the Win32 handle specified in the first argument is
      *        detected to have been set. Hint: use std::bind() to
@@ -221,72 +1000,118 @@ public:
      *        use std::ptr_fun/std::mem_fun. std::bind() is more
      *        flexible as it supports variadic template arguments.
      *
-     * @throw None, but std::bad_alloc by the underlying STL 
+     * @return false if the handle isn't open, in which case nothing is
+     *      queued; true once the handler has been queued. If the worker
+     *      thread finds the handle already registered, or can't wait on
+     *      it, it drops the handler and calls OnWaitHandleRejected().
+     *
+     * @throw None, but std::bad_alloc by the underlying STL
      *      container classes.
      */
     template<typename Handler>
-    bool AddWaitHandle(HANDLE h, Handler handler)
+    bool AddWaitHandle(WaitHandle h, Handler handler)
     {
-        AutoLock l(m_sync);
+        return AddWaitHandle(h, std::move(handler), HandleLimits());
+    }
 
-        // make sure we don't exceed the WaitForMultipleObjects limit of 64 handles
-        if (!IsWaitHandleSlotAvailable())
+    /**
+     * Adds a handle as above, with a priority and a rate limit for its
+     * handler. While the handle is out of tokens it is left out of the
+     * wait set; the times it was held back are counted in GetMetrics().
+     */
+    template<typename Handler>
+    bool AddWaitHandle(WaitHandle h, Handler handler, const HandleLimits& limits)
+    {
+        // there is no limit on the number of handles, once the worker thread's
+        // wait array is full AddToWaitSet() hands the handle to a waiter shard
+        if (!IsOpenHandle(h))
             return false;
+        Callable callable(std::move(handler), m_blocks);
+        WaitHandler* pT = new (m_blocks.Allocate(sizeof(WaitHandler))) WaitHandler(h, std::move(callable));
+        SetLimits(pT, limits);
+        SubmitCommand(&pT->m_cmd);
+        return true;
+    }
 
-        typedef WaitHandler<Handler> MyWaitHandler;
-        MyWaitHandler* pT = new MyWaitHandler(h, handler);
-        m_waithandlers.push_back(pT);
-        ::SetEvent(m_rebuildwaitarrayevent);    // HARI 02/26/2013
-
+#if WFMOHANDLER_IO_URING
+    /**
+     * Add a datagram socket whose datagrams are received by the ring and
+     * handed to a handler, without a system call per datagram or per
+     * wake-up: a multishot receive stays armed on the socket and picks a
+     * buffer from the socket's own ring of nBuffers buffers for every
+     * datagram. The datagrams that arrive by the time the worker thread
+     * wakes up are handed over in one call, and their buffers go back to
+     * the ring when it returns. Remove the socket with RemoveWaitHandle().
+     *
+     * Receive handlers always run on the worker thread, with or without
+     * the dispatch pool.
+     * Parameters:
+     *  h        - a UDP socket
+     *  handler  - a ReceiveHandler, or a function object it can be made of
+     *  cbBuffer - longest datagram, longer ones are truncated
+     *  nBuffers - number of buffers, rounded up to a power of 2; once they
+     *             are all waiting to be delivered, the receive is re-armed
+     *             after the handler returns
+     *  limits   - see AddWaitHandle(); a throttled receiver's datagrams are
+     *             held in its buffers, and once those are full, in the
+     *             socket
+     * Returns:
+     *  false unless EnableIoUring() has succeeded; otherwise as
+     *  AddWaitHandle()
+     */
+    template<typename Handler>
+    bool AddReceiveHandle(WaitHandle h, Handler handler, size_t cbBuffer = 2048, unsigned nBuffers = 64,
+        const HandleLimits& limits = HandleLimits())
+    {
+        if (!m_ring.IsOpen() || !IsOpenHandle(h))
+            return false;
+        std::unique_ptr<Receiver> pReceiver(new Receiver(ReceiveHandler(std::move(handler)), cbBuffer, nBuffers));
+        Callable callable(std::bind(&WFMOHandler::DeliverReceived, this, pReceiver.get()), m_blocks);
+        WaitHandler* pT = new (m_blocks.Allocate(sizeof(WaitHandler))) WaitHandler(h, std::move(callable));
+        pT->m_pReceiver = pReceiver.release();
+        SetLimits(pT, limits);
+        SubmitCommand(&pT->m_cmd);
         return true;
     }
+#endif
 
     /*
-     * Remove a handle and its handler, previously registered through the 
-     * AddWaitHandle() call.
+     * Remove a handle and its handler, previously registered through the
+     * AddWaitHandle() call. Once WFMOHandler holds no reference to the
+     * handle any more, OnWaitHandleRemoved() is called from the worker
+     * thread, which is when the derived class can release the handle.
+     * Called on the worker thread -- from a handler, say -- the handle
+     * leaves the wait set right away, otherwise the removal is queued.
      */
-    void RemoveWaitHandle(HANDLE h)
+    void RemoveWaitHandle(WaitHandle h)
     {
-        AutoLock l(m_sync);
-        bool rebuild = false;
-        for (WAITHANDLERLIST::iterator it=m_waithandlers.begin(); it!=m_waithandlers.end(); it++) {
-            if ((*it)->m_h == h) {
-                (*it)->m_markfordeletion = true;
-                rebuild = true;
-                break;
-            }
-        }
-        if (rebuild) {
-            /* 
-               If the RemoveWaitHandle() is called from the context of the 
-               this class' worker thread, we can technically rebuild the waitable 
-               handle array here without having to wait for the signal on rebuild 
-               handle array event to be picked up by the worker thread.
-
-               However, we defer this implementation for now as if the removeWa...()
-               is called in the context another thread (a worker that is spawned
-               by the WFMOHandler derived class), then we would have to use the 
-               build handle array event signalling method. In this approach
-               the derived class still needs to know when the handle has 
-               been removed from the handle array so that it can safely do
-               its own handle resource deallocation tasks. To facilitate
-               this we use another callback (OnWaitHandleRemoved) which
-               the derived class can override. This is called whenever WFMOHandler
-               has cleared all its references to the handle which is a safe
-               time for the derived class to do its deallocation.
-               
-               Since this mechanism can be used for both scenarios, we only 
-               implement this 'normalized' approach which would minimize 
-               behavior that the class consumer has to understand, 
-               a key design requirement when developing libraries.
-
-                if (::GetCurrentThreadId() == m_uWorkerThreadId)
-                    BuildHandleArray();
-                else
-                    ::SetEvent(m_rebuildwaitarrayevent);
-            */
-            ::SetEvent(m_rebuildwaitarrayevent);
-        }
+        Command cmd(Command::REMOVE_HANDLE, false);
+        cmd.m_h = h;
+        SubmitCopy(cmd);
+    }
+
+    /**
+     * Removes a handle as RemoveWaitHandle() does, but hands it over
+     * instead of releasing it: once the loop holds no reference to it any
+     * more -- its handler, if it was running, has returned -- the task is
+     * run on the worker thread in place of OnWaitHandleRemoved(). The
+     * task can then register the handle with another loop, say, which
+     * never sees it dispatched by both. If the handle isn't registered,
+     * the task runs right away. Like a Post()ed task, it's dropped if the
+     * loop is stopped first.
+     * Parameters:
+     *  h    - the handle
+     *  then - a void() function object
+     */
+    template<typename Handler>
+    void DetachWaitHandle(WaitHandle h, Handler then)
+    {
+        Callable callable(std::move(then), m_blocks);
+        PostedTask* pTask = new (m_blocks.Allocate(sizeof(PostedTask))) PostedTask(std::move(callable));
+        Command cmd(Command::DETACH_HANDLE, false);
+        cmd.m_h = h;
+        cmd.m_pTask = pTask;
+        SubmitCopy(cmd);
     }
 
     /**
@@ -296,28 +1121,65 @@ public:
      *                 will result in a call to the functor, handler.
      *  repeat       - a boolean indicating if this is a repeat timer.
      *                 Repeat timers will keep calling the timer handler
-     *                 functor after every interval time had elapsed.
+     *                 functor after every interval time had elapsed,
+     *                 on deadlines an interval apart, however long the
+     *                 handler takes. Periods a late timer missed are
+     *                 skipped, see AddPeriodicTimer() for the others.
      *  handler      - the functor that will be called when the timer
      *                 interval has elapsed.
+     *  slack        - milliseconds by which the timer may go off late.
+     *                 Expiries are rounded up to a multiple of the
+     *                 largest power of two that is no more than the
+     *                 slack, so timers with a slack that are due around
+     *                 the same time go off together, in one wake-up of
+     *                 the worker thread.
      * Returns:
      *  unsigned - A unique id that can later be supplied to RemoveTimer()
      *             to remove this timer.
+     *
+     * Timers don't take up a wait handle slot, adding and removing them is
+     * O(1) regardless of the number of timers.
      */
     template<typename Handler>
-    unsigned AddTimer(unsigned milliseconds, bool repeat, Handler handler)
+    unsigned AddTimer(unsigned milliseconds, bool repeat, Handler handler, unsigned slack = 0)
     {
-        AutoLock l(m_sync);
-        typedef TimerHandler<Handler> MyTimerHandler;
+        return NewTimer(milliseconds, repeat, OVERRUN_SKIP, std::move(handler), slack);
+    }
 
-        // make sure we don't exceed the WaitForMultipleObjects limit of 64 handles
-        if (!IsWaitHandleSlotAvailable())
-            return false;
+    /**
+     * Adds a repeat timer that goes off on absolute deadlines, a period
+     * apart, and catches up on overruns as the policy says.
+     * Parameters:
+     *  period  - milliseconds between deadlines, the first one a period
+     *            from now
+     *  policy  - what to do about the periods that come due while the
+     *            timer is late. With the dispatch pool, a deadline that
+     *            comes up while the handler is still running is always
+     *            skipped.
+     *  handler - the functor to call
+     *  slack   - as for AddTimer(), the deadlines stay exact
+     * Returns:
+     *  an id for RemoveTimer(), AdjustTimer() and TimerOverruns()
+     */
+    template<typename Handler>
+    unsigned AddPeriodicTimer(unsigned period, OverrunPolicy policy, Handler handler, unsigned slack = 0)
+    {
+        return NewTimer(period, true, policy, std::move(handler), slack);
+    }
 
-        MyTimerHandler* pT = new MyTimerHandler(milliseconds, repeat, m_nexttimertriggerid++, handler);
-        m_waithandlers.push_back(pT);    // always push to the back of the list!
-        ::SetEvent(m_rebuildwaitarrayevent);
-            
-        return (m_nexttimertriggerid-1);
+    /**
+     * Returns the number of periods a repeat timer has been late for so
+     * far: the deadlines that had passed already when it was rescheduled,
+     * whichever way its OverrunPolicy then dealt with them. Metrics has
+     * the total over all timers.
+     * Calling context: worker thread -- the timer's handler, unless the
+     * dispatch pool is enabled, or a Post()ed task
+     */
+    uint64_t TimerOverruns(unsigned id)
+    {
+        _ASSERTE(IsWorkerThread());
+        TimerHandler* pT = FindTimer(id);
+        return pT != NULL ? pT->m_overruns : 0;
     }
 
     /**
@@ -330,83 +1192,204 @@ public:
      */
     void RemoveTimer(unsigned id)
     {
-        AutoLock l(m_sync);
-        for (WAITHANDLERLIST::iterator it=m_waithandlers.begin(); it!=m_waithandlers.end(); it++) {
-            // dynamic cast would fail on WaitHandler<> objects
-            TimerIntermediate* pTimer = dynamic_cast<TimerIntermediate*>((*it));
-            if (pTimer && pTimer->m_id == id) {
-                // set flag and trigger the wait array rebuild event
-                // the relevant object would be deleted from the worker thread
-                ::CancelWaitableTimer((*it)->m_h);
-                (*it)->m_markfordeletion = true;
-                ::SetEvent(m_rebuildwaitarrayevent);
-                break;
-            }
-        }
+        Command cmd(Command::REMOVE_TIMER, false);
+        cmd.m_id = id;
+        SubmitCopy(cmd);
     }
 
+    /**
+     * Change the interval and the repeat setting of an existing timer.
+     * The timer is restarted, i.e., it next expires after interval
+     * milliseconds from now, and its deadlines follow on from there. Its
+     * slack and overrun policy are kept.
+     */
 	void AdjustTimer(unsigned id, unsigned interval, bool repeat)
 	{
-        AutoLock l(m_sync);
-        for (WAITHANDLERLIST::iterator it=m_waithandlers.begin(); it!=m_waithandlers.end(); it++) {
-            // dynamic cast would fail on WaitHandler<> objects
-            TimerIntermediate* pTimer = dynamic_cast<TimerIntermediate*>((*it));
-			if (pTimer && pTimer->m_id == id && !(*it)->m_markfordeletion) {
-                LARGE_INTEGER due = {0, 0};
-                due.QuadPart = (LONGLONG)interval*(LONGLONG)-10000; // minus value to indicate relative time (and not absolute time)
-                LONG lPeriod = repeat ? interval : 0;   // repeat time is in milliseconds!
-                ::SetWaitableTimer((*it)->m_h,
-                    &due,
-                    lPeriod,
-                    NULL,
-                    NULL,
-                    FALSE);
-			}
-		}
+        Command cmd(Command::ADJUST_TIMER, false);
+        cmd.m_id = id;
+        cmd.m_interval = interval;
+        cmd.m_repeat = repeat;
+        SubmitCopy(cmd);
 	}
 
-    /* returns the worker thread handle */
-    HANDLE GetThreadHandle()
-    { return m_htWorker; }
-
-protected:
     /**
-     * Called from the I/O loop worker thread on entry just before it enters its loop. 
-     * Calling context: I/O thread
-     *
-     * @param None.
-     * @return None
+     * Runs a function object on the worker thread, after the commands and
+     * tasks queued before it. The task is allocated from the loop's
+     * lock-free BlockPool and goes through the same lock-free queue as the
+     * Add/Remove calls, so posting takes no lock. Wake-ups are coalesced: a
+     * burst of posts that arrives while the worker thread is busy costs it
+     * a single wake-up. The task runs on the worker thread even with the
+     * dispatch pool enabled, and is dropped without being run if the loop
+     * is stopped first.
+     * Parameters:
+     *  handler - the function object, a void() callable
+     * Throws:
+     *  std::bad_alloc only if the pool has to grow and can't
      */
-    virtual void OnBeginIOLoop()
+    template<typename Handler>
+    void Post(Handler handler)
     {
+        Callable callable(std::move(handler), m_blocks);
+        PostedTask* pTask = new (m_blocks.Allocate(sizeof(PostedTask))) PostedTask(std::move(callable));
+        PostCommand(&pTask->m_cmd);
     }
 
-    /**
-     * Called from the I/O loop worker thread on entry just
-     * before it exits. If you override, make sure you don't
-     * throw any exceptions.
-     * Calling context: I/O thread
-     *
-     * @param fGracefulExit A boolean that is set to true if
-     *      the worker thread is exiting gracefully. If set to
-     *      false, indicates that the worker thread terminated
+    /*
+     * Runs a function object right away when called from the worker
+     * thread -- from a handler, say -- and Post()s it otherwise.
+     */
+    template<typename Handler>
+    void Dispatch(Handler handler)
+    {
+        if (IsWorkerThread())
+            handler();
+        else
+            Post(std::move(handler));
+    }
+
+#if WFMOHANDLER_COROUTINES
+    // ////////// //
+    // Coroutines //
+    // ////////// //
+
+    /* see Readable() */
+    struct ReadableAwaiter {
+        WFMOHandler* m_pLoop;
+        WaitHandle m_h;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> coroutine)
+        { m_pLoop->AwaitHandle(m_h, coroutine, NULL, NULL); }
+        void await_resume() const noexcept {}
+    };
+
+    /* see SleepFor() */
+    struct SleepAwaiter {
+        WFMOHandler* m_pLoop;
+        unsigned m_milliseconds;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> coroutine)
+        { m_pLoop->AwaitTimer(m_milliseconds, coroutine); }
+        void await_resume() const noexcept {}
+    };
+
+    /* see Recv() */
+    template<typename Socket>
+    struct RecvAwaiter {
+        typedef typename Socket::Datagram Datagram;
+        WFMOHandler* m_pLoop;
+        Socket* m_pSocket;
+        char* m_buf;
+        size_t m_cbBuf;
+        Datagram m_datagram;
+        static bool TryReceive(void* pAwaiter)
+        {
+            RecvAwaiter* pThis = static_cast<RecvAwaiter*>(pAwaiter);
+            return pThis->m_pSocket->ReceiveFrom(pThis->m_buf, pThis->m_cbBuf, pThis->m_datagram);
+        }
+        // a datagram that is already there is returned without suspending
+        bool await_ready() { return TryReceive(this); }
+        void await_suspend(std::coroutine_handle<> coroutine)
+        { m_pLoop->AwaitHandle(*m_pSocket, coroutine, &RecvAwaiter::TryReceive, this); }
+        Datagram await_resume() const { return m_datagram; }
+    };
+
+    /**
+     * co_await Readable(h) suspends a LoopTask until h is signalled and
+     * resumes it from the thread that dispatches h. h is registered for
+     * that one wake-up -- it must not be registered already, and leaving
+     * the wait set doesn't call OnWaitHandleRemoved().
+     */
+    ReadableAwaiter Readable(WaitHandle h)
+    {
+        ReadableAwaiter a = { this, h };
+        return a;
+    }
+
+    /* co_await SleepFor(ms) resumes a LoopTask from the timer's dispatch */
+    SleepAwaiter SleepFor(unsigned milliseconds)
+    {
+        SleepAwaiter a = { this, milliseconds };
+        return a;
+    }
+
+    /**
+     * co_await Recv(sock, buf, cb) returns the next datagram that arrives on
+     * sock, received into buf, suspending until there is one. The socket
+     * -- an AsyncSocket, or anything with its Datagram type, WaitHandle
+     * conversion and ReceiveFrom() -- must not be registered with
+     * AddWaitHandle().
+     */
+    template<typename Socket>
+    RecvAwaiter<Socket> Recv(Socket& sock, char* buf, size_t cb)
+    {
+        RecvAwaiter<Socket> a = { this, &sock, buf, cb, typename Socket::Datagram() };
+        return a;
+    }
+#endif
+
+    /* returns the worker thread handle */
+    ThreadHandle GetThreadHandle()
+    { return m_htWorker; }
+
+    /* whether the calling thread is the worker thread */
+    bool IsWorkerThread() const
+    {
+        // only the worker thread can read back its own id
+        return m_workerthreadid.load(std::memory_order_relaxed) == CurrentThreadId();
+    }
+
+protected:
+    /**
+     * Called from the I/O loop worker thread on entry just before it enters its loop.
+     * Calling context: I/O thread
+     *
+     * @param None.
+     * @return None
+     */
+    virtual void OnBeginIOLoop()
+    {
+    }
+
+    /**
+     * Called from the I/O loop worker thread on entry just
+     * before it exits. If you override, make sure you don't
+     * throw any exceptions.
+     * Calling context: I/O thread
+     *
+     * @param fGracefulExit A boolean that is set to true if
+     *      the worker thread is exiting gracefully. If set to
+     *      false, indicates that the worker thread terminated
      *      due to an error.
      *
      * @return None
      */
     virtual void OnEndIOLoop(bool fGracefulExit)
     {
-        fGracefulExit;
+        (void)fGracefulExit;
     }
 
     /**
-     * Called when a waitable trigger removal is completed. 
+     * Called when a waitable trigger removal is completed.
      * Derived classes can use this callback to complete their
      * handle related resource de-allocation.
+     * Calling context: I/O thread
      */
-    virtual void OnWaitHandleRemoved(HANDLE hTrigger)
+    virtual void OnWaitHandleRemoved(WaitHandle hTrigger)
     {
-        hTrigger;
+        (void)hTrigger;
+    }
+
+    /**
+     * Called when a handle queued by AddWaitHandle() or
+     * AddReceiveHandle() could not be added: it is registered already, or
+     * can't be waited upon. Its new handler has been dropped and the
+     * handle, which WFMOHandler holds no reference to, is the derived
+     * class's to release.
+     * Calling context: I/O thread
+     */
+    virtual void OnWaitHandleRejected(WaitHandle hTrigger)
+    {
+        (void)hTrigger;
     }
 
 private:
@@ -422,41 +1405,101 @@ private:
 
             bool fMore = true;
 
-            std::vector<HANDLE> ahandles(MAX_WAIT_COUNT);
-            unsigned nHandles = BuildHandleArray(ahandles);
-
+#ifdef _WIN32
+            // The wait array is kept up to date as handles are added, removed
+            // and dispatched to the pool, so there is nothing to rebuild.
             do {
-                DWORD dwRet = ::WaitForMultipleObjectsEx(ahandles.size(), &ahandles[0], FALSE, INFINITE, TRUE);
-                {
-                    AutoLock l(m_sync);
-                    switch (dwRet) {
-                    case WAIT_OBJECT_0:
+                // apply the queued commands and run the timers that are due,
+                // the wait times out when the next one is
+                DrainCommands();
+                ReleaseRemoved();
+                uint64_t timeout = ProcessTimers();
+                DWORD dwTimeout = timeout == TimerWheel::NEVER ? INFINITE
+                    : static_cast<DWORD>(timeout < INFINITE-1 ? timeout : INFINITE-1);
+                m_metrics.BeforeWait();
+                DWORD dwRet = WaitForHandles(dwTimeout);
+                m_metrics.AfterWait();
+                switch (dwRet) {
+                case WAIT_TIMEOUT:
+                    // a timer is due
+                    break;
+                case WAIT_OBJECT_0:
+                    // shutdown
+                    fGracefulExit = true;
+                    fMore = false;
+                    break;
+                case WAIT_OBJECT_0+1:
+                    // commands queued, applied at the top of the loop
+                    break;
+                case WAIT_OBJECT_0+2:
+                    // handles signalled in waiter shards
+                    InvokeShardHandlers();
+                    break;
+                default:
+                    if ((dwRet >= (WAIT_OBJECT_0+RESERVED_WAIT_COUNT)) && (dwRet < (WAIT_OBJECT_0+MAX_WAIT_COUNT))) {
+                        InvokeWaitHandleHandlers(dwRet-(WAIT_OBJECT_0+RESERVED_WAIT_COUNT));
+                    } else {
+                        std::cerr << "Unhandled WaitForMultipleObjects return code: " << dwRet << std::endl;
+                        fMore = false;
+                    }
+                    break;
+                }
+            } while (fMore) ;
+#else
+            // Every handle that is ready is collected per wake-up, up to
+            // m_batchsize of them, and dispatched as one batch. Handles are
+            // registered with epoll as they are added, so there is no handle
+            // array to rebuild.
+#if WFMOHANDLER_IO_URING
+            if (m_ring.IsOpen()) {
+                fGracefulExit = RingLoop();
+                fMore = false;
+            }
+#endif
+            std::vector<struct epoll_event> events(m_batchsize);
+            while (fMore) {
+                // apply the queued commands and run the timers that are due,
+                // the wait times out when the next one is
+                DrainCommands();
+                ReleaseRemoved();
+                uint64_t timeout = ProcessTimers();
+                int msTimeout = timeout == TimerWheel::NEVER ? -1
+                    : static_cast<int>(timeout < 0x7fffffff ? timeout : 0x7fffffff);
+                m_metrics.BeforeWait();
+                int n = EpollWait(&events[0], static_cast<int>(events.size()), msTimeout);
+                m_metrics.AfterWait();
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    std::cerr << "Unhandled epoll_wait error: " << errno << std::endl;
+                    break;
+                }
+                if (n == 0)
+                    continue;   // a timer is due
+                m_batch.clear();
+                for (int i=0; i<n; i++) {
+                    void* p = events[i].data.ptr;
+                    if (p == &m_shutdownevent) {
                         // shutdown
                         fGracefulExit = true;
                         fMore = false;
-                        break;
-                    case WAIT_OBJECT_0+1:
-                        // rebuild wait handle array
-                        nHandles = BuildHandleArray(ahandles);
-                        break;
-                    default:
-                        if ((dwRet > (WAIT_OBJECT_0+1)) && (dwRet < (WAIT_OBJECT_0+MAX_WAIT_COUNT))) {
-                            InvokeWaitHandleHandler(dwRet-(WAIT_OBJECT_0+2), ahandles);
-                        } else {
-                            std::cerr << "Unhandled WaitForMultipleObjects return code: " << dwRet << std::endl;
-                            fMore = false;
-                        }
-                        break;
+                    } else if (p == &m_wakeupevent) {
+                        // commands queued, applied at the top of the loop
+                    } else {
+                        m_batch.push_back(static_cast<WaitHandler*>(p));
                     }
                 }
-            } while (fMore) ;
+                if (fMore)
+                    DispatchBatch();
+            }
+#endif
 
-        } catch (std::bad_alloc) {
+        } catch (std::bad_alloc&) {
             // out of memory
             std::cerr << "Memory allocation exception" << std::endl;
         } catch (...) {
             // unknown error
-            std::cerr << L"Unknown exception" << std::endl;
+            std::cerr << "Unknown exception" << std::endl;
         }
 
         std::cerr << "WFMOHandler worker thread terminated, graceful termination: "
@@ -470,106 +1513,1653 @@ private:
         return 0;
     }
 
+#ifdef _WIN32
+    /**
+     * The worker thread's wait. With busy polling on it first polls the
+     * wait array, for up to the spin budget, before it blocks.
+     * Returns:
+     *  as WaitForMultipleObjectsEx()
+     */
+    DWORD WaitForHandles(DWORD dwTimeout)
+    {
+        DWORD nCount = static_cast<DWORD>(m_waitarray.size());
+        if (!m_busypoll.IsEnabled() || dwTimeout == 0)
+            return ::WaitForMultipleObjectsEx(nCount, &m_waitarray[0], FALSE, dwTimeout, TRUE);
+        uint64_t spin = m_busypoll.Budget(dwTimeout == INFINITE ? -1 : static_cast<int64_t>(dwTimeout));
+        uint64_t start = MonotonicNanos();
+        if (spin > 0) {
+            DWORD dwRet;
+            uint64_t now;
+            do {
+                dwRet = ::WaitForMultipleObjectsEx(nCount, &m_waitarray[0], FALSE, 0, TRUE);
+                now = MonotonicNanos();
+            } while (dwRet == WAIT_TIMEOUT && now - start < spin);
+            m_busypoll.Spun(now - start, dwRet != WAIT_TIMEOUT);
+            if (dwRet != WAIT_TIMEOUT)
+                return dwRet;
+            start = now;
+        }
+        DWORD dwRet = ::WaitForMultipleObjectsEx(nCount, &m_waitarray[0], FALSE, dwTimeout, TRUE);
+        m_busypoll.Slept(MonotonicNanos() - start, dwRet != WAIT_TIMEOUT);
+        return dwRet;
+    }
+#else
+    /**
+     * The worker thread's wait. With busy polling on it first polls epoll,
+     * for up to the spin budget, before it blocks.
+     * Returns:
+     *  as epoll_wait()
+     */
+    int EpollWait(struct epoll_event* pEvents, int nEvents, int msTimeout)
+    {
+        if (!m_busypoll.IsEnabled() || msTimeout == 0)
+            return ::epoll_wait(m_epoll, pEvents, nEvents, msTimeout);
+        uint64_t spin = m_busypoll.Budget(msTimeout);
+        uint64_t start = MonotonicNanos();
+        if (spin > 0) {
+            int n;
+            uint64_t now;
+            do {
+                n = ::epoll_wait(m_epoll, pEvents, nEvents, 0);
+                now = MonotonicNanos();
+            } while (n == 0 && now - start < spin);
+            m_busypoll.Spun(now - start, n > 0);
+            if (n != 0)
+                return n;
+            start = now;
+        }
+        int n = ::epoll_wait(m_epoll, pEvents, nEvents, msTimeout);
+        m_busypoll.Slept(MonotonicNanos() - start, n > 0);
+        return n;
+    }
+
+    /* Sets SO_BUSY_POLL on a handle, if busy polling is on and it's a socket */
+    void SetSocketBusyPoll(WaitHandle h)
+    {
+#ifdef SO_BUSY_POLL
+        int us = static_cast<int>(m_busypoll.SocketUs());
+        if (m_busypoll.IsEnabled() && us > 0)
+            ::setsockopt(h, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us));   // ENOTSOCK, EPERM: left as it is
+#else
+        (void)h;
+#endif
+    }
+#endif
+
+#ifdef _WIN32
     static unsigned int __stdcall _ThreadProc(void* p)
     {
         _ASSERTE(p != NULL);
-        return reinterpret_cast<WFMOHandler*>(p)->ThreadProc();
+        WFMOHandler* pThis = reinterpret_cast<WFMOHandler*>(p);
+        pThis->m_workerthreadid.store(CurrentThreadId(), std::memory_order_relaxed);
+        unsigned int rc = pThis->ThreadProc();
+        pThis->m_workerthreadid.store(ThreadId(), std::memory_order_relaxed);
+        return rc;
+    }
+#else
+    static void* _ThreadProc(void* p)
+    {
+        _ASSERTE(p != NULL);
+        WFMOHandler* pThis = reinterpret_cast<WFMOHandler*>(p);
+        pThis->m_workerthreadid.store(CurrentThreadId(), std::memory_order_relaxed);
+        pThis->ThreadProc();
+        pThis->m_workerthreadid.store(ThreadId(), std::memory_order_relaxed);
+        return NULL;
+    }
+#endif
+
+    // //////// //
+    // Commands //
+    // //////// //
+
+    /*
+     * Applies a command right away when called on the worker thread -- by
+     * a handler, a task or a coroutine -- which saves it the queue and a
+     * wake-up of itself, and queues it to the worker thread otherwise.
+     */
+    void SubmitCommand(Command* pCmd)
+    {
+        if (!IsWorkerThread()) {
+            PostCommand(pCmd);
+            return;
+        }
+        ApplyCommand(pCmd);
+        m_metrics.CommandsApplied(1);
     }
 
-    void InvokeWaitHandleHandler(size_t index, std::vector<HANDLE>& ahandles)
+    /*
+     * Submits a command made on the stack, queueing a copy allocated from
+     * m_blocks, which is freed once it has been applied.
+     */
+    void SubmitCopy(Command& cmd)
     {
-        _ASSERTE(index >= 0);
-        ahandles;
-        size_t i = 0;
-        WAITHANDLERLIST::iterator it=m_waithandlers.begin();
-        for (; i++ < index && it!=m_waithandlers.end(); it++)
-            ;
-		if (it != m_waithandlers.end() && !(*it)->m_markfordeletion) {
-            (*it)->invoke(this);
+        if (!IsWorkerThread()) {
+            PostCommand(new (m_blocks.Allocate(sizeof(Command))) Command(cmd, true));
+            return;
         }
+        ApplyCommand(&cmd);
+        m_metrics.CommandsApplied(1);
+    }
+
+#if WFMOHANDLER_COROUTINES
+    /*
+     * The handler of an awaiter's registration. It owns the suspended
+     * coroutine until it resumes it, so a coroutine whose handle or timer
+     * is dropped unresumed -- when the loop stops -- is destroyed with it.
+     * With a pfnReady, the coroutine is only resumed once that returns
+     * true; until then the handle is awaited again.
+     */
+    struct Resumer {
+        WFMOHandler* m_pLoop;
+        WaitHandle m_h;
+        std::coroutine_handle<> m_coroutine;
+        bool (*m_pfnReady)(void* pAwaiter);
+        void* m_pAwaiter;
+
+        Resumer(WFMOHandler* pLoop, WaitHandle h, std::coroutine_handle<> coroutine,
+                bool (*pfnReady)(void*), void* pAwaiter) noexcept
+            : m_pLoop(pLoop), m_h(h), m_coroutine(coroutine), m_pfnReady(pfnReady), m_pAwaiter(pAwaiter)
+        {}
+        Resumer(Resumer&& other) noexcept
+            : m_pLoop(other.m_pLoop), m_h(other.m_h), m_coroutine(other.m_coroutine)
+            , m_pfnReady(other.m_pfnReady), m_pAwaiter(other.m_pAwaiter)
+        {
+            other.m_coroutine = nullptr;
+        }
+        ~Resumer()
+        {
+            if (m_coroutine)
+                m_coroutine.destroy();
+        }
+        void operator()()
+        {
+            std::coroutine_handle<> coroutine = m_coroutine;
+            m_coroutine = nullptr;
+            if (m_pfnReady != NULL && !m_pfnReady(m_pAwaiter)) {
+                try {
+                    m_pLoop->AwaitHandle(m_h, coroutine, m_pfnReady, m_pAwaiter);
+                } catch (...) {
+                    m_coroutine = coroutine;
+                    throw;
+                }
+                return;
+            }
+            coroutine.resume();
+        }
+    private:
+        Resumer(const Resumer&);
+        Resumer& operator=(const Resumer&);
+    };
+
+    /*
+     * Registers a handle for one dispatch that resumes a coroutine. The
+     * node is allocated before the Resumer takes the coroutine over, so
+     * that a failure leaves the coroutine to its awaiter.
+     */
+    void AwaitHandle(WaitHandle h, std::coroutine_handle<> coroutine, bool (*pfnReady)(void*), void* pAwaiter)
+    {
+        static_assert(Callable::FitsInline<Resumer>::value, "Resumer must not allocate");
+        void* p = m_blocks.Allocate(sizeof(WaitHandler));
+        WaitHandler* pT = new (p) WaitHandler(h, Callable(Resumer(this, h, coroutine, pfnReady, pAwaiter), m_blocks));
+        pT->m_fOneShot = true;
+        SubmitCommand(&pT->m_cmd);
+    }
+
+    /* Adds a one-off timer that resumes a coroutine, see AwaitHandle() */
+    void AwaitTimer(unsigned milliseconds, std::coroutine_handle<> coroutine)
+    {
+        void* p = m_blocks.Allocate(sizeof(TimerHandler));
+        TimerHandler* pT = new (p) TimerHandler(m_nexttimertriggerid++, milliseconds, false,
+            Callable(Resumer(this, InvalidHandle(), coroutine, NULL, NULL), m_blocks));
+        SubmitCommand(&pT->m_cmd);
+    }
+#endif
+
+    /* Queues a command to the worker thread, waking it up if need be */
+    void PostCommand(Command* pCmd)
+    {
+        m_commands.Push(pCmd);
+        // wake-ups are coalesced, one SetSignal() per drain of the queue
+        if (!m_fWakeupPending.exchange(true))
+            SetSignal(m_wakeupevent);
     }
 
     /**
-     * Returns a boolean indicating if we've reached the limit
-     * for number of triggers.
-     * Parameters:
-     *  None
+     * Applies the commands queued to the worker thread.
+     * Calling context: worker thread
+     */
+    void DrainCommands()
+    {
+        // commands queued from here on wake the worker up again
+        m_fWakeupPending.exchange(false);
+        ResetSignal(m_wakeupevent);
+        uint64_t n = 0;
+        while (Command* pCmd = static_cast<Command*>(m_commands.Pop())) {
+            bool fOwned = pCmd->m_fOwned;   // the object an embedded command is part of may be deleted
+            ApplyCommand(pCmd);
+            if (fOwned)
+                m_blocks.Delete(pCmd);
+            n++;
+        }
+        m_metrics.CommandsApplied(n);
+    }
+
+    void ApplyCommand(Command* pCmd)
+    {
+        switch (pCmd->m_type) {
+        case Command::ADD_HANDLE: {
+            WaitHandle h = pCmd->m_pHandler->m_h;
+            if (FindWaitHandler(h) != NULL) {
+                // a handle can only be registered once
+                std::cerr << "AddWaitHandle: handle is already registered" << std::endl;
+                m_blocks.Delete(pCmd->m_pHandler);
+                OnWaitHandleRejected(h);
+            } else if (!AddToWaitSet(pCmd->m_pHandler)) {
+                OnWaitHandleRejected(h);
+            }
+            break;
+        }
+        case Command::REMOVE_HANDLE:
+            if (WaitHandler* pT = FindWaitHandler(pCmd->m_h))
+                MarkForDeletion(pT);
+            break;
+        case Command::DETACH_HANDLE:
+            if (WaitHandler* pT = FindWaitHandler(pCmd->m_h)) {
+                pT->m_pDetached = pCmd->m_pTask;
+                MarkForDeletion(pT);
+            } else {
+                RunTask(pCmd->m_pTask);
+            }
+            break;
+        case Command::RELEASE_HANDLE:
+            ReleaseHandler(pCmd->m_pHandler);
+            break;
+        case Command::HANDLE_DONE:
+            pCmd->m_pHandler->m_fInFlight = false;
+            RearmWaitHandle(pCmd->m_pHandler);
+            break;
+        case Command::ADD_TIMER:
+            m_timers[pCmd->m_pTimer->m_id] = pCmd->m_pTimer;
+            ScheduleTimer(pCmd->m_pTimer, NowMs() + pCmd->m_pTimer->m_interval);
+            break;
+        case Command::REMOVE_TIMER:
+            if (TimerHandler* pT = FindTimer(pCmd->m_id)) {
+                m_timers.erase(pCmd->m_id);
+                m_timerwheel.Cancel(pT);
+                if (pT == m_pRunningTimer || pT->m_fInFlight)
+                    pT->m_markfordeletion = true;   // deleted once its handler returns
+                else
+                    m_blocks.Delete(pT);
+            }
+            break;
+        case Command::ADJUST_TIMER:
+            if (TimerHandler* pT = FindTimer(pCmd->m_id)) {
+                pT->m_interval = pCmd->m_interval;
+                pT->m_repeat = pCmd->m_repeat;
+                ScheduleTimer(pT, NowMs() + pCmd->m_interval);
+            }
+            break;
+        case Command::TIMER_DONE:
+            FinishPooledTimer(pCmd->m_pTimer);
+            break;
+        case Command::RUN_TASK:
+            RunTask(pCmd->m_pTask);
+            break;
+        }
+    }
+
+    /* Runs & frees a posted task, calling context: worker thread */
+    void RunTask(PostedTask* pTask)
+    {
+        uint64_t start = m_metrics.Clock();
+        try {
+            pTask->m_handler();
+        } catch (...) {
+            std::cerr << "Unhandled exception in posted task" << std::endl;
+        }
+        m_metrics.TaskRan(start);
+        m_blocks.Delete(pTask);
+    }
+
+    /**
+     * Releases the objects of the commands that were never applied.
+     * Calling context: Stop(), once the worker & pool threads have exited
+     */
+    void DiscardCommands()
+    {
+        while (Command* pCmd = static_cast<Command*>(m_commands.Pop())) {
+            bool fOwned = pCmd->m_fOwned;
+            switch (pCmd->m_type) {
+            case Command::ADD_HANDLE:
+            case Command::RELEASE_HANDLE:
+                DeleteObject(pCmd->m_pHandler);    // not referenced from anywhere else
+                break;
+            case Command::ADD_TIMER:
+                m_blocks.Delete(pCmd->m_pTimer);
+                break;
+            case Command::TIMER_DONE:
+                if (pCmd->m_pTimer->m_markfordeletion)
+                    m_blocks.Delete(pCmd->m_pTimer);  // no longer in m_timers
+                break;
+            case Command::RUN_TASK:
+            case Command::DETACH_HANDLE:
+                m_blocks.Delete(pCmd->m_pTask);
+                break;
+            default:
+                // the handlers of HANDLE_DONE are still held by a container
+                break;
+            }
+            if (fOwned)
+                m_blocks.Delete(pCmd);
+        }
+    }
+
+    /**
+     * Appends a new handler to the handler list and makes its handle part of
+     * the wait set. On Windows the handle is appended to the worker's wait
+     * array, or the handler goes to a waiter shard if the worker's array is
+     * full; on Linux the handle is registered with epoll, or polled on the
+     * ring.
      * Returns:
-     *  true if we still have slots available for adding new triggers
-     *  false if we've reached the maximum trigger limit
+     *  true if the handler was added, false otherwise (the handler is deleted)
+     * Calling context: worker thread
      */
-    bool IsWaitHandleSlotAvailable() {
-        AutoLock l(m_sync);
-        size_t nUsed = 0;
-        for (auto it=m_waithandlers.begin(); it!=m_waithandlers.end(); it++) {
-            if (!(*it)->m_markfordeletion) // don't include those marked for deletion
-                nUsed++;
+    bool AddToWaitSet(WaitHandler* pT)
+    {
+#ifdef _WIN32
+        if (!IsWaitHandleSlotAvailable()) {
+            if (!AddToShard(pT))
+                return false;
+        } else {
+            pT->m_index = m_waithandlers.size();
+            m_waithandlers.push_back(pT);
+            Arm(pT);
         }
-        if (nUsed >= (MAX_WAIT_COUNT-2))    // 2 handles are reserved
+#else
+        pT->m_index = m_waithandlers.size();
+        m_waithandlers.push_back(pT);
+        if (!Watch(pT)) {
+            m_waithandlers.pop_back();
+            m_blocks.Delete(pT);
             return false;
+        }
+#endif
+        m_handles[pT->m_h] = pT;
+        Meter(pT);
         return true;
     }
 
     /**
-     * Rebuilds the wait handle array that can be supplied to
-     * WaitForMultipleObjects
-     * Parameters:
-     *  std::vector<HANDLE>& - vector of HANDLEs which will be filled
-     *      in with the handles to wait upon
+     * Marks a handler for deletion and takes its handle out of the wait
+     * set, which is O(1): the epoll set or the ring on Linux, the worker's
+     * wait array, whose last handle takes its slot, on Windows. The handler object
+     * itself is released by ReleaseRemoved() -- it may still be referenced
+     * from up the stack, as the handler running or part of the batch being
+     * dispatched -- or, if its handler is in flight in the dispatch pool,
+     * once that returns. OnWaitHandleRemoved() is called then.
+     * Calling context: worker thread
+     */
+    void MarkForDeletion(WaitHandler* pT)
+    {
+        pT->m_markfordeletion = true;
+        m_handles.erase(pT->m_h);
+        if (pT->m_fThrottled)
+            Unpark(pT);     // it's out of the wait set already
+#ifdef _WIN32
+        if (pT->m_pShard != NULL) {
+            // the shard drops it from its wait array & retires it
+            WaiterShard* pShard = pT->m_pShard;
+            pShard->m_nlive--;
+            AutoLock l(pShard->m_lock);
+            pShard->m_fRebuild = true;
+            SetSignal(pShard->m_control);
+            return;
+        }
+        Disarm(pT);
+#else
+        Unwatch(pT);
+#endif
+        // swap with the last one, the order of m_waithandlers doesn't matter
+        WaitHandler* pLast = m_waithandlers.back();
+        m_waithandlers[pT->m_index] = pLast;
+        pLast->m_index = pT->m_index;
+        m_waithandlers.pop_back();
+        bool fBusy = pT->m_fInFlight;
+#if WFMOHANDLER_IO_URING
+        fBusy = fBusy || pT->m_fInRing;
+#endif
+        if (fBusy) {
+            // released once its pooled handler returns, or its poll or
+            // receive has been cancelled
+            pT->m_index = m_retiredhandlers.size();
+            m_retiredhandlers.push_back(pT);
+        } else {
+            m_removedhandlers.push_back(pT);
+        }
+    }
+
+    /**
+     * Releases the handlers removed since the last call, including those
+     * that the OnWaitHandleRemoved() calls remove.
+     * Calling context: worker thread, between handler invocations
+     */
+    void ReleaseRemoved()
+    {
+        while (!m_removedhandlers.empty()) {
+            WaitHandler* pT = m_removedhandlers.back();
+            m_removedhandlers.pop_back();
+            ReleaseHandler(pT);
+        }
+    }
+
+    /*
+     * Deletes a handler that's no longer referenced & notifies the derived
+     * class, unless the handler was an awaiter's
+     */
+    void ReleaseHandler(WaitHandler* pT)
+    {
+#if WFMOHANDLER_IO_URING
+        if (pT->m_pReceiver != NULL)
+            CloseBuffers(pT->m_pReceiver);
+#endif
+        Unmeter(pT);
+        PostedTask* pDetached = pT->m_pDetached;
+        if (pDetached == NULL && !pT->m_fOneShot)
+            OnWaitHandleRemoved(pT->m_h);
+        m_blocks.Delete(pT);
+        if (pDetached != NULL)
+            RunTask(pDetached);
+    }
+
+    /* Deletes a handler that won't be released, dropping the task it was detached for */
+    void DeleteObject(WaitHandler* pT)
+    {
+        m_blocks.Delete(pT->m_pDetached);
+        m_blocks.Delete(pT);
+    }
+
+#if WFMOHANDLER_METRICS
+    /* Lists a handler for GetMetrics() */
+    void Meter(WaitHandler* pT)
+    {
+        AutoLock l(m_meteredlock);
+        pT->m_meteredindex = m_metered.size();
+        m_metered.push_back(pT);
+    }
+    void Unmeter(WaitHandler* pT)
+    {
+        AutoLock l(m_meteredlock);
+        WaitHandler* pLast = m_metered.back();
+        m_metered[pT->m_meteredindex] = pLast;
+        pLast->m_meteredindex = pT->m_meteredindex;
+        m_metered.pop_back();
+    }
+    /* Called by Stop() before the handlers are deleted */
+    void ClearMetered()
+    {
+        AutoLock l(m_meteredlock);
+        m_metered.clear();
+    }
+#else
+    void Meter(WaitHandler*) {}
+    void Unmeter(WaitHandler*) {}
+    void ClearMetered() {}
+#endif
+
+    /* Returns the live handler registered for handle h, NULL if there's none */
+    WaitHandler* FindWaitHandler(WaitHandle h)
+    {
+        HANDLEMAP::iterator it = m_handles.find(h);
+        return it != m_handles.end() ? it->second : NULL;
+    }
+
+    /* Returns the timer with the given id, NULL if there's none */
+    TimerHandler* FindTimer(unsigned id)
+    {
+        TIMERMAP::iterator it = m_timers.find(id);
+        return it != m_timers.end() ? it->second : NULL;
+    }
+
+    /* Allocates a timer and queues it to be added */
+    template<typename Handler>
+    unsigned NewTimer(unsigned milliseconds, bool repeat, OverrunPolicy policy, Handler handler, unsigned slack)
+    {
+        Callable callable(std::move(handler), m_blocks);
+        TimerHandler* pT = new (m_blocks.Allocate(sizeof(TimerHandler)))
+            TimerHandler(m_nexttimertriggerid++, milliseconds, repeat, std::move(callable), slack, policy);
+        unsigned id = pT->m_id;     // pT belongs to the worker thread once queued
+        SubmitCommand(&pT->m_cmd);
+
+        return id;
+    }
+
+    /**
+     * (Re)schedules a timer to be due at the given time, its next deadline,
+     * and to expire then rounded up by its slack. The rounding is to
+     * absolute multiples of a power of two, so it lines up the timers of
+     * different slacks too: a multiple of 64ms is one of 16ms. The worker
+     * thread computes its wait timeout after applying the commands, so the
+     * new expiry is taken into account.
+     * Calling context: worker thread
+     */
+    void ScheduleTimer(TimerHandler* pT, uint64_t due)
+    {
+        pT->m_deadline = due;
+        if (pT->m_slack > 1) {
+            uint64_t granule = 1;
+            while (granule * 2 <= pT->m_slack)
+                granule *= 2;
+            due = (due + granule - 1) & ~(granule - 1);
+        }
+        m_timerwheel.Schedule(pT, due);
+    }
+
+    /**
+     * Runs the handlers of the timers that are due, rescheduling the
+     * repeat timers, and lets the throttled handles that are due back
+     * into the wait set. Called from the worker thread before it waits.
      * Returns:
-     *  unsigned - the number of handles filled in the HANDLEs vector
-     * Throws:
-     *  None
-     * Pre-condition: 
-     *  - waitable trigger count + timer trigger count <= 62
+     *  uint64_t - milliseconds until the next timer or throttled handle
+     *             is due, the timeout for the wait; TimerWheel::NEVER if
+     *             there are none
+     */
+    uint64_t ProcessTimers()
+    {
+        uint64_t now = NowMs();
+        TimerWheel::List expired;
+        m_timerwheel.Advance(now, expired);
+        while (TimerWheel::Node* p = expired.PopFront()) {
+            TimerHandler* pT = static_cast<TimerHandler*>(p);
+            m_metrics.TimerFired(now - pT->m_expires);
+            if (m_fPooled) {
+                DispatchTimer(pT, now);
+                continue;
+            }
+            // the RemoveTimer()/AdjustTimer() calls the handler makes are
+            // applied right away, m_pRunningTimer keeps pT alive meanwhile
+            m_pRunningTimer = pT;
+            uint64_t start = m_metrics.Clock();
+            pT->invoke();
+            m_metrics.TimerRan(start);
+            m_pRunningTimer = NULL;
+            ReleaseRemoved();
+
+            if (pT->m_markfordeletion) {
+                m_blocks.Delete(pT);  // RemoveTimer() was called from the handler
+            } else if (pT->IsPending()) {
+                // AdjustTimer() was called from the handler
+            } else if (pT->m_repeat) {
+                // as of after the handler, which may have overrun
+                ScheduleTimer(pT, NextDeadline(pT, NowMs()));
+            } else {
+                // one-off timer
+                m_timers.erase(pT->m_id);
+                m_blocks.Delete(pT);
+            }
+        }
+
+        uint64_t timeout = ResumeThrottled(NowMs());
+        uint64_t next = m_timerwheel.NextTick();
+        if (next == TimerWheel::NEVER)
+            return timeout;
+        return next > now ? (next - now < timeout ? next - now : timeout) : 0;
+    }
+
+    /**
+     * Invokes the handler of a signalled handle, or queues it to the
+     * dispatch pool, unless it's out of tokens, see Throttle(). A queued
+     * handle must be left out of the wait set until its handler returns --
+     * on Linux EPOLLONESHOT, or the ring's one-shot poll, has taken care of
+     * that, on Windows it leaves the worker's wait array here, or the
+     * caller has its shard rebuild the shard's array without it. An
+     * awaiter's handle leaves the wait set once dispatched.
+     * Calling context: worker thread
+     */
+    void DispatchHandle(WaitHandler* pT)
+    {
+        if (pT->m_markfordeletion || pT->m_fInFlight || pT->m_fThrottled)
+            return;
+        if (pT->m_bucket.IsLimited() && !pT->m_bucket.Take(NowMs())) {
+            Throttle(pT);
+            return;
+        }
+        bool fPooled = m_fPooled;
+#if WFMOHANDLER_IO_URING
+        // a receiver gives its buffers back to the ring, which is this thread's
+        fPooled = fPooled && pT->m_pReceiver == NULL;
+#endif
+        if (fPooled) {
+            pT->m_fInFlight = true;
+#ifdef _WIN32
+            if (pT->m_pShard == NULL)
+                Disarm(pT);
+#endif
+        }
+        // before its handler runs, which may await the handle again
+        if (pT->m_fOneShot)
+            MarkForDeletion(pT);
+        if (fPooled) {
+            m_pool.Submit(&WFMOHandler::_RunWaitHandler, this, pT);
+            return;
+        }
+        uint64_t start = m_metrics.Clock();
+        pT->invoke();
+        m_metrics.HandlerRan(pT->m_counters, start);
+#if WFMOHANDLER_IO_URING
+        // polls on the ring are one-shot, like EPOLLONESHOT
+        if (m_ring.IsOpen() && !pT->m_markfordeletion && !pT->m_fInRing
+            && (pT->m_pReceiver == NULL || !pT->m_pReceiver->m_fFailed))
+            RingArm(pT);
+#endif
+    }
+
+    static void _RunWaitHandler(void* pContext, void* pArg)
+    {
+        reinterpret_cast<WFMOHandler*>(pContext)->RunWaitHandler(reinterpret_cast<WaitHandler*>(pArg));
+    }
+
+    /* Dispatch pool thread body for a handle */
+    void RunWaitHandler(WaitHandler* pT)
+    {
+        uint64_t start = m_metrics.Clock();
+        try {
+            pT->invoke();
+        } catch (...) {
+            std::cerr << "Unhandled exception in pooled wait handler" << std::endl;
+        }
+        m_metrics.HandlerRan(pT->m_counters, start);
+        // the worker thread re-arms the handle
+        pT->m_cmd.m_type = Command::HANDLE_DONE;
+        PostCommand(&pT->m_cmd);
+    }
+
+    /**
+     * Puts a handle whose pooled handler has returned back into the wait
+     * set or, if it was removed meanwhile, has it released.
+     * Calling context: worker thread
+     */
+    void RearmWaitHandle(WaitHandler* pT)
+    {
+#ifdef _WIN32
+        if (pT->m_pShard != NULL) {
+            AutoLock l(pT->m_pShard->m_lock);
+            pT->m_pShard->m_fRebuild = true;
+            SetSignal(pT->m_pShard->m_control);
+            return;
+        }
+#endif
+        if (pT->m_markfordeletion) {
+            Unretire(pT);
+            ReleaseHandler(pT);
+            return;
+        }
+#ifdef _WIN32
+        Arm(pT);
+#else
+        Rewatch(pT);
+#endif
+    }
+
+    /* Takes a handler that is no longer busy out of m_retiredhandlers */
+    void Unretire(WaitHandler* pT)
+    {
+        WaitHandler* pLast = m_retiredhandlers.back();
+        m_retiredhandlers[pT->m_index] = pLast;
+        pLast->m_index = pT->m_index;
+        m_retiredhandlers.pop_back();
+    }
+
+    /* Applies the limits a handle is added with, before it's queued */
+    void SetLimits(WaitHandler* pT, const HandleLimits& limits)
+    {
+        pT->m_priority = static_cast<unsigned char>(limits.m_priority);
+        pT->m_bucket.Set(limits.m_rate, limits.m_burst, NowMs());
+    }
+
+    /**
+     * Holds back a handle that is out of tokens: it leaves the wait set
+     * until ResumeThrottled() finds its bucket refilled. On Windows it
+     * leaves the worker's wait array here, or the caller has its shard
+     * rebuild the shard's array without it; on Linux epoll stops reporting
+     * it, while on the ring its one-shot poll has fired already and a
+     * receiver's datagrams stay queued.
+     * Calling context: worker thread
+     */
+    void Throttle(WaitHandler* pT)
+    {
+        pT->m_fThrottled = true;
+        pT->m_throttleindex = m_throttled.size();
+        m_throttled.push_back(pT);
+        m_metrics.Throttled(pT->m_counters);
+#ifdef _WIN32
+        if (pT->m_pShard == NULL)
+            Disarm(pT);
+#else
+#if WFMOHANDLER_IO_URING
+        if (m_ring.IsOpen())
+            return;
+#endif
+        if (!m_fPooled) {
+            // EPOLLONESHOT has disarmed it otherwise
+            struct epoll_event ev;
+            ::memset(&ev, 0, sizeof(ev));
+            ev.data.ptr = pT;
+            ::epoll_ctl(m_epoll, EPOLL_CTL_MOD, pT->m_h, &ev);
+        }
+#endif
+    }
+
+    /* Takes a throttled handler out of m_throttled */
+    void Unpark(WaitHandler* pT)
+    {
+        WaitHandler* pLast = m_throttled.back();
+        m_throttled[pT->m_throttleindex] = pLast;
+        pLast->m_throttleindex = pT->m_throttleindex;
+        m_throttled.pop_back();
+    }
+
+    /**
+     * Puts the throttled handles whose buckets have refilled back into
+     * the wait set. A receiver with datagrams queued is dispatched instead.
+     * Returns:
+     *  milliseconds until the next throttled handle is due back,
+     *  TimerWheel::NEVER if there's none
+     * Calling context: worker thread
+     */
+    uint64_t ResumeThrottled(uint64_t now)
+    {
+        uint64_t next = TimerWheel::NEVER;
+        // the handlers run here may add & remove handles, so the handles
+        // due back are collected first
+        m_resumed.clear();
+        for (size_t i=0; i<m_throttled.size(); ) {
+            WaitHandler* pT = m_throttled[i];
+            uint64_t at = pT->m_bucket.ReadyAt();
+            if (at > now) {
+                if (at - now < next)
+                    next = at - now;
+                i++;
+                continue;
+            }
+            Unpark(pT);
+            m_resumed.push_back(pT);
+        }
+        for (size_t i=0; i<m_resumed.size(); i++) {
+            WaitHandler* pT = m_resumed[i];
+            if (pT->m_markfordeletion)
+                continue;   // removed by a handler run before it
+#ifdef _WIN32
+            if (pT->m_pShard != NULL) {
+                AutoLock l(pT->m_pShard->m_lock);
+                pT->m_fThrottled = false;
+                pT->m_pShard->m_fRebuild = true;
+                SetSignal(pT->m_pShard->m_control);
+                continue;
+            }
+            pT->m_fThrottled = false;
+            Arm(pT);
+#else
+            pT->m_fThrottled = false;
+#if WFMOHANDLER_IO_URING
+            if (m_ring.IsOpen()) {
+                if (pT->m_pReceiver != NULL && pT->m_pReceiver->m_fQueued)
+                    DispatchHandle(pT);
+                else if (!pT->m_fInRing)
+                    RingArm(pT);
+                continue;
+            }
+#endif
+            Rewatch(pT);
+#endif
+        }
+        return next;
+    }
+
+    /**
+     * The deadline a timer is due at after the one it has just expired
+     * for: an interval on from that, so that neither how late it went off
+     * nor how long its handler took pushes the timer back. The deadlines
+     * that have passed by now are overruns, dealt with as the timer's
+     * policy says.
+     * Calling context: worker thread
      */
-    size_t BuildHandleArray(std::vector<HANDLE>& ahandles)
+    uint64_t NextDeadline(TimerHandler* pT, uint64_t now)
     {
-        AutoLock l(m_sync);
+        uint64_t next = pT->m_deadline + pT->m_interval;
+        if (next > now || pT->m_interval == 0)
+            return next;
+        uint64_t missed = (now - next) / pT->m_interval + 1;
+        switch (pT->m_policy) {
+        case OVERRUN_BURST:
+            // the next one runs at once, the others are counted as they come up
+            missed = 1;
+            break;
+        case OVERRUN_COALESCE:
+            next += (missed - 1) * pT->m_interval;
+            break;
+        default:
+            next += missed * pT->m_interval;
+            break;
+        }
+        pT->m_overruns += missed;
+        m_metrics.TimerOverran(missed);
+        return next;
+    }
 
-        WAITHANDLERLIST::iterator itWaitable = m_waithandlers.begin();  // waitable handle triggers
-        while (itWaitable != m_waithandlers.end()) {
-            if ((*itWaitable)->m_markfordeletion) {
-                WAITHANDLERLIST::iterator itDel = itWaitable++;
-                OnWaitHandleRemoved((*itDel)->m_h);
-                delete (*itDel);
-                m_waithandlers.erase(itDel);
+    /**
+     * Queues the handler of an expired timer to the dispatch pool. Repeat
+     * timers are rescheduled right away. A timer whose handler is still
+     * running when it expires again is pushed back: a repeat timer to its
+     * next deadline, the one it expired for being an overrun, a one-off
+     * timer by its interval.
+     * Calling context: worker thread
+     */
+    void DispatchTimer(TimerHandler* pT, uint64_t now)
+    {
+        if (pT->m_fInFlight) {
+            if (pT->m_repeat) {
+                pT->m_overruns++;
+                m_metrics.TimerOverran(1);
+                ScheduleTimer(pT, NextDeadline(pT, now));
             } else {
-                itWaitable++;
+                ScheduleTimer(pT, now + pT->m_interval);
+            }
+            return;
+        }
+        if (pT->m_repeat)
+            ScheduleTimer(pT, NextDeadline(pT, now));
+        pT->m_fInFlight = true;
+        m_pool.Submit(&WFMOHandler::_RunTimer, this, pT);
+    }
+
+    static void _RunTimer(void* pContext, void* pArg)
+    {
+        reinterpret_cast<WFMOHandler*>(pContext)->RunTimer(reinterpret_cast<TimerHandler*>(pArg));
+    }
+
+    /* Dispatch pool thread body for a timer */
+    void RunTimer(TimerHandler* pT)
+    {
+        uint64_t start = m_metrics.Clock();
+        try {
+            pT->invoke();
+        } catch (...) {
+            std::cerr << "Unhandled exception in pooled timer handler" << std::endl;
+        }
+        m_metrics.TimerRan(start);
+        pT->m_cmd.m_type = Command::TIMER_DONE;
+        PostCommand(&pT->m_cmd);
+    }
+
+    /* Calling context: worker thread */
+    void FinishPooledTimer(TimerHandler* pT)
+    {
+        pT->m_fInFlight = false;
+        if (pT->m_markfordeletion) {
+            m_blocks.Delete(pT);  // RemoveTimer() was called while it ran
+        } else if (!pT->IsPending()) {
+            // one-off timer that wasn't adjusted meanwhile
+            m_timers.erase(pT->m_id);
+            m_blocks.Delete(pT);
+        }
+    }
+
+    /**
+     * Dispatches the handlers collected in m_batch. The batch is started at
+     * a different position on every wake-up, so that no handle is always
+     * served last.
+     * Calling context: worker thread
+     */
+    void DispatchBatch()
+    {
+        size_t n = m_batch.size();
+        if (n == 0)
+            return;
+        // in order of priority, and within that from a rotating start
+        size_t first = m_rotation++ % n;
+        for (unsigned priority=HandleLimits::PRIORITY_HIGH; priority<=HandleLimits::PRIORITY_LOW; priority++) {
+            for (size_t i=0; i<n; i++) {
+                WaitHandler* pT = m_batch[(first + i) % n];
+                if (pT->m_priority == priority)
+                    DispatchHandle(pT);
+            }
+        }
+
+        // only the worker thread writes the counters
+        m_batchwakeups.store(m_batchwakeups.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        m_batchevents.store(m_batchevents.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        if (n > m_batchmax.load(std::memory_order_relaxed))
+            m_batchmax.store(n, std::memory_order_relaxed);
+    }
+
+#ifdef _WIN32
+    /**
+     * Dispatches the handle WaitForMultipleObjects returned along with all
+     * the other signalled handles after it in the wait array, which are
+     * found through zero-timeout waits on the rest of the array. Without
+     * this, a busy handle would starve all the ones after it.
+     * Parameters:
+     *  index - client wait array index WaitForMultipleObjects returned
+     */
+    void InvokeWaitHandleHandlers(size_t index)
+    {
+        // m_armedhandlers is parallel to the client part of the wait array
+        _ASSERTE(index < m_armedhandlers.size());
+        m_batch.clear();
+        m_batch.push_back(m_armedhandlers[index]);
+        size_t next = index+1;
+        while (next < m_armedhandlers.size() && m_batch.size() < m_batchsize) {
+            DWORD nCount = static_cast<DWORD>(m_armedhandlers.size() - next);
+            DWORD dwRet = ::WaitForMultipleObjectsEx(nCount, &m_waitarray[RESERVED_WAIT_COUNT+next], FALSE, 0, FALSE);
+            if (dwRet >= WAIT_OBJECT_0+nCount)
+                break;  // none of the rest is signalled
+            next += dwRet-WAIT_OBJECT_0;
+            m_batch.push_back(m_armedhandlers[next++]);
+        }
+        // the batch is complete before its handlers can change the array
+        DispatchBatch();
+    }
+
+    /**
+     * Places a handler with the least loaded waiter shard that has room for
+     * it, starting a new shard if they are all full.
+     * Returns:
+     *  true if the handler was added, false otherwise (the handler is deleted)
+     */
+    bool AddToShard(WaitHandler* pT)
+    {
+        WaiterShard* pShard = NULL;
+        for (size_t i=0; i<m_shards.size(); i++) {
+            if (m_shards[i]->m_nlive < WaiterShard::MAX_HANDLERS
+                && (pShard == NULL || m_shards[i]->m_nlive < pShard->m_nlive))
+                pShard = m_shards[i];
+        }
+        if (pShard == NULL && (pShard = StartShard()) == NULL) {
+            m_blocks.Delete(pT);
+            return false;
+        }
+
+        pT->m_pShard = pShard;
+        pShard->m_nlive++;
+        AutoLock l(pShard->m_lock);
+        pT->m_index = pShard->m_handlers.size();
+        pShard->m_handlers.push_back(pT);
+        pShard->m_fRebuild = true;
+        ::SetEvent(pShard->m_control);
+        return true;
+    }
+
+    WaiterShard* StartShard()
+    {
+        WaiterShard* pShard = new WaiterShard(this);
+        pShard->m_control = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (pShard->m_control != NULL) {
+            unsigned uThreadId = 0;
+            pShard->m_hThread = reinterpret_cast<HANDLE>(::_beginthreadex(NULL,
+                0,
+                WFMOHandler::_ShardProc,
+                pShard,
+                0,
+                &uThreadId));
+            if (pShard->m_hThread != NULL) {
+                m_shards.push_back(pShard);
+                return pShard;
             }
+            ::CloseHandle(pShard->m_control);
         }
+        std::cerr << "Error starting waiter shard, error code: " << ::GetLastError() << std::endl;
+        delete pShard;
+        return NULL;
+    }
+
+    /* Stops all the waiter shards & releases their handlers */
+    void StopShards()
+    {
+        for (size_t i=0; i<m_shards.size(); i++) {
+            AutoLock l(m_shards[i]->m_lock);
+            m_shards[i]->m_fQuit = true;
+            ::SetEvent(m_shards[i]->m_control);
+        }
+        for (size_t i=0; i<m_shards.size(); i++) {
+            WaiterShard* pShard = m_shards[i];
+            ::WaitForSingleObject(pShard->m_hThread, INFINITE);
+            ::CloseHandle(pShard->m_hThread);
+            ::CloseHandle(pShard->m_control);
+            FreePtrContainer(pShard->m_handlers);
+            delete pShard;
+        }
+        m_shards.clear();
+    }
+
+    /* Invokes the handlers that waiter shards have reported as signalled */
+    void InvokeShardHandlers()
+    {
+        ::ResetEvent(m_shardreadyevent);
+        while (MpscQueue::Node* p = m_readyshards.Pop()) {
+            WaiterShard* pShard = static_cast<WaiterShard*>(p);
+            WaitHandler* pT = pShard->m_pReady;
+            DispatchHandle(pT);
+            // let the shard go back to waiting
+            AutoLock l(pShard->m_lock);
+            if (pT->m_fInFlight || pT->m_fThrottled)
+                pShard->m_fRebuild = true;  // wait without it until its handler returns, or it's resumed
+            pShard->m_pReady = NULL;
+            pShard->m_fParked = false;
+            ::SetEvent(pShard->m_control);
+        }
+    }
 
-        // precondition
-        _ASSERTE(m_waithandlers.size() <= (MAX_WAIT_COUNT-2));
+    static unsigned int __stdcall _ShardProc(void* p)
+    {
+        _ASSERTE(p != NULL);
+        WaiterShard* pShard = reinterpret_cast<WaiterShard*>(p);
+        return pShard->m_owner->ShardProc(pShard);
+    }
+
+    /* Waiter shard thread body */
+    unsigned int ShardProc(WaiterShard* pShard)
+    {
+        std::vector<HANDLE> ahandles;
+        for (;;) {
+            {
+                AutoLock l(pShard->m_lock);
+                if (pShard->m_fQuit)
+                    break;
+                if (pShard->m_fRebuild)
+                    BuildShardHandleArray(pShard, ahandles);
+            }
+
+            DWORD dwRet = ::WaitForMultipleObjects(ahandles.size(), &ahandles[0], FALSE, INFINITE);
+            if (dwRet == WAIT_OBJECT_0)
+                continue;   // quit or rebuild, checked above
+            if (dwRet < WAIT_OBJECT_0+1 || dwRet >= WAIT_OBJECT_0+ahandles.size()) {
+                std::cerr << "Unhandled WaitForMultipleObjects return code in waiter shard: " << dwRet << std::endl;
+                break;
+            }
 
-        ahandles.resize(2+m_waithandlers.size());
-        ahandles[0] = m_shutdownevent;
-        ahandles[1] = m_rebuildwaitarrayevent;
+            {
+                // m_armed only changes in BuildShardHandleArray(), on this
+                // thread, so the index is still good
+                AutoLock l(pShard->m_lock);
+                pShard->m_pReady = pShard->m_armed[dwRet-(WAIT_OBJECT_0+1)];
+                pShard->m_fParked = true;
+            }
+            m_readyshards.Push(pShard);
+            ::SetEvent(m_shardreadyevent);
 
-        // 2..63 (62) can be used by client wait routines
-        size_t i = 2;
-        for (WAITHANDLERLIST::iterator it=m_waithandlers.begin();
-            it!=m_waithandlers.end(); it++) {
-            ahandles[i++] = (*it)->m_h;
+            // park until the worker thread has invoked the handler, the
+            // handle is most likely still signalled until then
+            for (;;) {
+                ::WaitForSingleObject(pShard->m_control, INFINITE);
+                AutoLock l(pShard->m_lock);
+                if (!pShard->m_fParked || pShard->m_fQuit)
+                    break;
+            }
         }
+        return 0;
+    }
 
-        ::ResetEvent(m_rebuildwaitarrayevent);
-        return i;
+    /**
+     * Rebuilds a waiter shard's wait array, retiring the handlers that
+     * were marked for deletion. Retired handlers are released by the
+     * worker thread so that OnWaitHandleRemoved() is always called from it.
+     * Handlers in flight in the dispatch pool are neither waited upon nor
+     * retired until they return.
+     * Pre-condition:
+     *  - pShard->m_lock is held
+     */
+    void BuildShardHandleArray(WaiterShard* pShard, std::vector<HANDLE>& ahandles)
+    {
+        std::vector<WaitHandler*>& handlers = pShard->m_handlers;
+        pShard->m_armed.clear();
+        size_t j = 0;
+        for (size_t i=0; i<handlers.size(); i++) {
+            WaitHandler* pT = handlers[i];
+            if (pT->m_markfordeletion && !pT->m_fInFlight) {
+                pT->m_cmd.m_type = Command::RELEASE_HANDLE;
+                PostCommand(&pT->m_cmd);
+                continue;
+            }
+            pT->m_index = j;
+            handlers[j++] = pT;
+            if (!pT->m_markfordeletion && !pT->m_fInFlight && !pT->m_fThrottled)
+                pShard->m_armed.push_back(pT);
+        }
+        handlers.resize(j);
+
+        ahandles.resize(1+pShard->m_armed.size());
+        ahandles[0] = pShard->m_control;
+        for (size_t i=0; i<pShard->m_armed.size(); i++)
+            ahandles[1+i] = pShard->m_armed[i]->m_h;
+        pShard->m_fRebuild = false;
+        m_metrics.Rebuilt();
+    }
+#else
+    /* epoll events for client handles, one-shot when handlers are pooled */
+    uint32_t HandleEvents() const
+    {
+        return m_fPooled ? EPOLLIN|EPOLLONESHOT : EPOLLIN;
+    }
+
+    void WatchInternalEvent(WaitHandle& h)
+    {
+        struct epoll_event ev;
+        ::memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = &h;
+        ::epoll_ctl(m_epoll, EPOLL_CTL_ADD, h, &ev);
     }
 
+    /**
+     * Puts a handle in the wait set: registers it with epoll or, on the
+     * ring, arms its poll or receive.
+     * Returns:
+     *  false if it can't be waited upon, which has been reported
+     */
+    bool Watch(WaitHandler* pT)
+    {
+        SetSocketBusyPoll(pT->m_h);
+#if WFMOHANDLER_IO_URING
+        if (m_ring.IsOpen()) {
+            if (pT->m_pReceiver != NULL && !OpenBuffers(pT->m_pReceiver))
+                return false;
+            if (RingArm(pT))
+                return true;
+            if (pT->m_pReceiver != NULL)
+                CloseBuffers(pT->m_pReceiver);
+            return false;
+        }
+#endif
+        struct epoll_event ev;
+        ::memset(&ev, 0, sizeof(ev));
+        ev.events = HandleEvents();
+        ev.data.ptr = pT;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_ADD, pT->m_h, &ev) != 0) {
+            std::cerr << "epoll_ctl(EPOLL_CTL_ADD) failed, error code: " << errno << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /* Takes a handle out of the wait set, the ring's is cancelled */
+    void Unwatch(WaitHandler* pT)
+    {
+#if WFMOHANDLER_IO_URING
+        if (m_ring.IsOpen()) {
+            if (pT->m_fInRing)
+                RingCancel(pT);
+            return;
+        }
+#endif
+        ::epoll_ctl(m_epoll, EPOLL_CTL_DEL, pT->m_h, NULL);
+    }
+
+    /* Waits on a handle again once its pooled handler has returned */
+    void Rewatch(WaitHandler* pT)
+    {
+#if WFMOHANDLER_IO_URING
+        if (m_ring.IsOpen()) {
+            RingArm(pT);
+            return;
+        }
+#endif
+        struct epoll_event ev;
+        ::memset(&ev, 0, sizeof(ev));
+        ev.events = HandleEvents();
+        ev.data.ptr = pT;
+        if (::epoll_ctl(m_epoll, EPOLL_CTL_MOD, pT->m_h, &ev) != 0)
+            std::cerr << "epoll_ctl(EPOLL_CTL_MOD) failed, error code: " << errno << std::endl;
+    }
+#endif
+
+#if WFMOHANDLER_IO_URING
+    // //////// //
+    // io_uring //
+    // //////// //
+
+    static const unsigned RING_DRAIN_WAITS = 10;        // of RING_DRAIN_MS each, see DrainRing()
+    static const int RING_DRAIN_MS = 100;
+
+    /**
+     * The worker thread's loop once EnableIoUring() has succeeded. The
+     * polls & receives armed since the last wait are submitted by the same
+     * io_uring_enter() call that waits, and all the completions that are
+     * ready are reaped in one go: the handles that are ready make up the batch,
+     * and a receiver's datagrams are collected for a single delivery.
+     * Completions carry the address of their WaitHandler, or of the member
+     * holding an internal event, as their user_data.
+     * Returns:
+     *  true if the loop was shut down, false if it failed
+     */
+    bool RingLoop()
+    {
+        bool fGracefulExit = false;
+        bool fMore = RingPoll(m_shutdownevent, &m_shutdownevent) && RingPoll(m_wakeupevent, &m_wakeupevent);
+        while (fMore) {
+            // apply the queued commands and run the timers that are due,
+            // the wait times out when the next one is
+            DrainCommands();
+            ReleaseRemoved();
+            uint64_t timeout = ProcessTimers();
+            int msTimeout = timeout == TimerWheel::NEVER ? -1
+                : static_cast<int>(timeout < 0x7fffffff ? timeout : 0x7fffffff);
+            if (!RetryRingCancels())
+                msTimeout = 0;  // reap, so that the kernel takes submissions again
+            m_metrics.BeforeWait();
+            int rc = RingWait(msTimeout);
+            m_metrics.AfterWait();
+            if (rc < 0 && rc != -ETIME && rc != -EINTR) {
+                std::cerr << "Unhandled io_uring_enter error: " << -rc << std::endl;
+                break;
+            }
+            m_batch.clear();
+            while (struct io_uring_cqe* pCqe = m_ring.PeekCqe()) {
+                void* p = reinterpret_cast<void*>(static_cast<uintptr_t>(pCqe->user_data));
+                int res = pCqe->res;
+                unsigned flags = pCqe->flags;
+                m_ring.PopCqe();
+                if (p == NULL)
+                    continue;   // a cancellation's own completion
+                if (!(flags & IORING_CQE_F_MORE))
+                    m_ringpending--;
+                if (p == &m_shutdownevent) {
+                    fGracefulExit = true;
+                    fMore = false;
+                } else if (p == &m_wakeupevent) {
+                    // commands queued, applied at the top of the loop,
+                    // which resets the event before the poll is submitted
+                    if (!RingPoll(m_wakeupevent, &m_wakeupevent))
+                        fMore = false;
+                } else {
+                    RingCompleted(static_cast<WaitHandler*>(p), res, flags);
+                }
+            }
+            if (fMore)
+                DispatchBatch();
+        }
+        DrainRing();
+        return fGracefulExit;
+    }
+
+    /**
+     * The ring's wait. With busy polling on it first reaps completions
+     * without blocking, for up to the spin budget, before it blocks.
+     * io_uring_enter() with a zero timeout runs the task work that posts
+     * completions, which a look at the completion queue alone wouldn't.
+     * Returns:
+     *  as IoUring::Enter()
+     */
+    int RingWait(int msTimeout)
+    {
+        if (!m_busypoll.IsEnabled() || msTimeout == 0)
+            return m_ring.Enter(msTimeout);
+        uint64_t spin = m_busypoll.Budget(msTimeout);
+        uint64_t start = MonotonicNanos();
+        if (spin > 0) {
+            int rc;
+            bool fReady;
+            uint64_t now;
+            do {
+                rc = m_ring.Enter(0);
+                fReady = m_ring.PeekCqe() != NULL;
+                now = MonotonicNanos();
+            } while (!fReady && rc == -ETIME && now - start < spin);
+            m_busypoll.Spun(now - start, fReady);
+            if (fReady || rc != -ETIME)
+                return rc;
+            start = now;
+        }
+        int rc = m_ring.Enter(msTimeout);
+        m_busypoll.Slept(MonotonicNanos() - start, m_ring.PeekCqe() != NULL);
+        return rc;
+    }
+
+    /**
+     * Handles the completion of a handler's poll, or of one of the
+     * datagrams of its multishot receive, queueing the handler to the
+     * batch. A handler removed meanwhile is released once its last
+     * completion is in.
+     */
+    void RingCompleted(WaitHandler* pT, int res, unsigned flags)
+    {
+        if (!(flags & IORING_CQE_F_MORE))
+            pT->m_fInRing = false;
+        if (pT->m_markfordeletion) {
+            // the buffers it still holds go with its buffer ring
+            if (!pT->m_fInRing && !pT->m_fInFlight) {
+                // done before a deferred cancellation got to it
+                for (size_t i=0; i<m_ringcancels.size(); i++) {
+                    if (m_ringcancels[i] == pT) {
+                        m_ringcancels[i] = m_ringcancels.back();
+                        m_ringcancels.pop_back();
+                        break;
+                    }
+                }
+                Unretire(pT);
+                m_removedhandlers.push_back(pT);
+            }
+            return;
+        }
+        Receiver* pReceiver = pT->m_pReceiver;
+        if (pReceiver == NULL) {
+            if (res < 0) {
+                std::cerr << "io_uring poll failed, error code: " << -res << std::endl;
+                return;
+            }
+            m_batch.push_back(pT);
+            return;
+        }
+
+        if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+            unsigned short bid = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+            const char* pBuffer = pReceiver->m_buffers.Buffer(bid);
+            const struct io_uring_recvmsg_out* pOut = reinterpret_cast<const struct io_uring_recvmsg_out*>(pBuffer);
+            size_t cbName = pReceiver->m_msg.msg_namelen;
+            size_t cbHeader = sizeof(*pOut) + cbName;
+            size_t cbData = static_cast<size_t>(res) > cbHeader ? res - cbHeader : 0;
+            Datagram d;
+            ::memset(&d.m_addr, 0, sizeof(d.m_addr));
+            ::memcpy(&d.m_addr, pBuffer + sizeof(*pOut), pOut->namelen < cbName ? pOut->namelen : cbName);
+            d.m_data = pBuffer + cbHeader;
+            d.m_len = pOut->payloadlen < cbData ? pOut->payloadlen : cbData;
+            d.m_truncated = (pOut->flags & MSG_TRUNC) != 0;
+            pReceiver->m_datagrams.push_back(d);
+            pReceiver->m_bids.push_back(bid);
+        } else if (res < 0 && res != -ENOBUFS) {
+            // -ENOBUFS: all the buffers are waiting to be delivered, the
+            // receive is re-armed once they have been
+            std::cerr << "io_uring receive failed, error code: " << -res << std::endl;
+            pReceiver->m_fFailed = true;
+        }
+        if (!pReceiver->m_fQueued) {
+            pReceiver->m_fQueued = true;
+            m_batch.push_back(pT);
+        }
+    }
+
+    /* A receive handle's handler: delivers its datagrams & recycles their buffers */
+    void DeliverReceived(Receiver* pReceiver)
+    {
+        pReceiver->m_fQueued = false;
+        if (pReceiver->m_datagrams.empty())
+            return;
+        pReceiver->m_handler(&pReceiver->m_datagrams[0], pReceiver->m_datagrams.size());
+        for (size_t i=0; i<pReceiver->m_bids.size(); i++)
+            pReceiver->m_buffers.Recycle(pReceiver->m_bids[i]);
+        pReceiver->m_buffers.Publish();
+        pReceiver->m_datagrams.clear();
+        pReceiver->m_bids.clear();
+    }
+
+    /* Queues a one-shot poll for h to become readable */
+    bool RingPoll(WaitHandle h, void* pData)
+    {
+        struct io_uring_sqe* pSqe = m_ring.GetSqe();
+        if (pSqe == NULL) {
+            std::cerr << "io_uring submission queue is full" << std::endl;
+            return false;
+        }
+        pSqe->opcode = IORING_OP_POLL_ADD;
+        pSqe->fd = h;
+        pSqe->poll32_events = POLLIN;
+        pSqe->user_data = reinterpret_cast<uintptr_t>(pData);
+        m_ringpending++;
+        return true;
+    }
+
+    /* Polls a handle, or arms its multishot receive, on the ring */
+    bool RingArm(WaitHandler* pT)
+    {
+        Receiver* pReceiver = pT->m_pReceiver;
+        if (pReceiver == NULL) {
+            if (!RingPoll(pT->m_h, pT))
+                return false;
+        } else {
+            struct io_uring_sqe* pSqe = m_ring.GetSqe();
+            if (pSqe == NULL) {
+                std::cerr << "io_uring submission queue is full" << std::endl;
+                return false;
+            }
+            pSqe->opcode = IORING_OP_RECVMSG;
+            pSqe->fd = pT->m_h;
+            pSqe->addr = reinterpret_cast<uintptr_t>(&pReceiver->m_msg);
+            pSqe->len = 1;
+            pSqe->ioprio = IORING_RECV_MULTISHOT;
+            pSqe->flags = IOSQE_BUFFER_SELECT;
+            pSqe->buf_group = pReceiver->m_buffers.GroupId();
+            pSqe->user_data = reinterpret_cast<uintptr_t>(pT);
+            m_ringpending++;
+        }
+        pT->m_fInRing = true;
+        return true;
+    }
+
+    /**
+     * Cancels a handler's poll or receive, its last completion follows. If
+     * the submission queue is full and the kernel won't take it until
+     * completions have been reaped, the cancellation is queued again by
+     * RetryRingCancels() after the next wait.
+     */
+    void RingCancel(WaitHandler* pT)
+    {
+        struct io_uring_sqe* pSqe = m_ring.GetSqe();
+        if (pSqe == NULL) {
+            m_ringcancels.push_back(pT);
+            return;
+        }
+        pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+        pSqe->fd = -1;
+        pSqe->addr = reinterpret_cast<uintptr_t>(pT);
+    }
+
+    /**
+     * Queues the cancellations RingCancel() couldn't.
+     * Returns:
+     *  false if some are still left over
+     */
+    bool RetryRingCancels()
+    {
+        while (!m_ringcancels.empty()) {
+            struct io_uring_sqe* pSqe = m_ring.GetSqe();
+            if (pSqe == NULL)
+                return false;
+            pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+            pSqe->fd = -1;
+            pSqe->addr = reinterpret_cast<uintptr_t>(m_ringcancels.back());
+            m_ringcancels.pop_back();
+        }
+        return true;
+    }
+
+    /**
+     * Cancels all that's outstanding on the ring and reaps the
+     * completions, so that the kernel is done with the handlers and their
+     * buffers before Stop() frees them. Gives up after RING_DRAIN_WAITS
+     * waits without a completion; Stop() closing the ring cancels the rest.
+     */
+    void DrainRing()
+    {
+        m_ringcancels.clear();  // cancelled along with all the rest
+        if (struct io_uring_sqe* pSqe = m_ring.GetSqe()) {
+            pSqe->opcode = IORING_OP_ASYNC_CANCEL;
+            pSqe->fd = -1;
+            pSqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+        }
+        unsigned nWaits = 0;
+        while (m_ringpending > 0 && nWaits < RING_DRAIN_WAITS) {
+            int rc = m_ring.Enter(RING_DRAIN_MS);
+            if (rc == -ETIME)
+                nWaits++;
+            else if (rc < 0 && rc != -EINTR)
+                break;
+            while (struct io_uring_cqe* pCqe = m_ring.PeekCqe()) {
+                if (pCqe->user_data != 0 && !(pCqe->flags & IORING_CQE_F_MORE))
+                    m_ringpending--;
+                m_ring.PopCqe();
+            }
+        }
+    }
+
+    /* Registers a receiver's buffer ring under a free group id */
+    bool OpenBuffers(Receiver* pReceiver)
+    {
+        unsigned short bgid = m_nextbgid;
+        if (!m_freebgids.empty()) {
+            bgid = m_freebgids.back();
+            m_freebgids.pop_back();
+        } else {
+            m_nextbgid++;
+        }
+        int rc = pReceiver->m_buffers.Open(m_ring, bgid, pReceiver->BufferSize(), pReceiver->m_nBuffers, m_options.m_numanode);
+        if (rc < 0) {
+            std::cerr << "io_uring buffer ring registration failed, error code: " << -rc << std::endl;
+            m_freebgids.push_back(bgid);
+            return false;
+        }
+        // a datagram per buffer at most is waiting to be delivered
+        pReceiver->m_datagrams.reserve(pReceiver->m_buffers.Count());
+        pReceiver->m_bids.reserve(pReceiver->m_buffers.Count());
+        return true;
+    }
+
+    void CloseBuffers(Receiver* pReceiver)
+    {
+        if (!pReceiver->m_buffers.IsOpen())
+            return;
+        pReceiver->m_buffers.Close(m_ring);
+        m_freebgids.push_back(pReceiver->m_buffers.GroupId());
+    }
+#endif
+
+    /**
+     * Returns a boolean indicating if we've reached the limit
+     * for number of triggers on the worker thread's own wait array.
+     * Parameters:
+     *  None
+     * Returns:
+     *  true if we still have slots available for adding new triggers
+     *  false if we've reached the maximum trigger limit
+     */
+    bool IsWaitHandleSlotAvailable() {
+#ifdef _WIN32
+        // m_waithandlers doesn't include those marked for deletion
+        if (m_waithandlers.size() >= (MAX_WAIT_COUNT-RESERVED_WAIT_COUNT))
+            return false;
+#endif
+        // epoll has no such limit
+        return true;
+    }
+
+#ifdef _WIN32
+    /**
+     * Appends a handler's handle to the worker's wait array. O(1).
+     * Pre-condition:
+     *  - the handler is not in the wait array, which has room for it
+     * Calling context: worker thread
+     */
+    void Arm(WaitHandler* pT)
+    {
+        _ASSERTE(pT->m_slot == WaitHandler::NO_SLOT);
+        _ASSERTE(m_waitarray.size() < MAX_WAIT_COUNT);
+        pT->m_slot = m_armedhandlers.size();
+        m_armedhandlers.push_back(pT);
+        m_waitarray.push_back(pT->m_h);
+    }
+
+    /**
+     * Takes a handler's handle out of the worker's wait array, if it's in
+     * it, moving the last handle into its slot. O(1).
+     * Calling context: worker thread
+     */
+    void Disarm(WaitHandler* pT)
+    {
+        if (pT->m_slot == WaitHandler::NO_SLOT)
+            return;
+        WaitHandler* pLast = m_armedhandlers.back();
+        m_armedhandlers[pT->m_slot] = pLast;
+        m_waitarray[RESERVED_WAIT_COUNT+pT->m_slot] = pLast->m_h;
+        pLast->m_slot = pT->m_slot;
+        m_armedhandlers.pop_back();
+        m_waitarray.pop_back();
+        pT->m_slot = WaitHandler::NO_SLOT;
+    }
+#endif
+
 protected:
-    // allow derived class to access this
+    // allow derived class to access this. WFMOHandler itself doesn't hold
+    // it while invoking handlers, or at all.
     CriticalSection m_sync;
 
 private:
+    // Handler, timer and command objects, oversized handler functors and
+    // the nodes of the maps below come from m_blocks, so once the pool has
+    // grown to the working set, registrations don't touch the heap. It is
+    // declared first, to outlive everything allocated from it.
+    BlockPool m_blocks;
+
     // NOTE: container of pointer to objects of base type. To be properly
     // released from destructor!
-    typedef std::list<WaitHandlerBase*> WAITHANDLERLIST;
-    WAITHANDLERLIST m_waithandlers;
-
-    HANDLE m_shutdownevent;
-    HANDLE m_rebuildwaitarrayevent;
-    HANDLE m_htWorker;
-    unsigned m_uWorkerThreadId;
-    unsigned m_nexttimertriggerid;
+    // All of the registry belongs to the worker thread; other threads
+    // change it by queueing commands to m_commands.
+    // m_armedhandlers is in the same order as the client part of the wait
+    // array, so a signalled index maps straight to its handler; both are
+    // patched in place as handles come and go. The maps only hold live
+    // handlers, i.e., those not marked for deletion.
+    typedef std::vector<WaitHandler*> WAITHANDLERARRAY;
+    typedef std::unordered_map<WaitHandle, WaitHandler*, std::hash<WaitHandle>, std::equal_to<WaitHandle>,
+        PoolAllocator<std::pair<const WaitHandle, WaitHandler*> > > HANDLEMAP;
+    typedef std::unordered_map<unsigned, TimerHandler*, std::hash<unsigned>, std::equal_to<unsigned>,
+        PoolAllocator<std::pair<const unsigned, TimerHandler*> > > TIMERMAP;
+    WAITHANDLERARRAY m_waithandlers;    // handlers waited upon by the worker thread
+    WAITHANDLERARRAY m_retiredhandlers; // removed while in flight, released once they return
+    WAITHANDLERARRAY m_removedhandlers; // removed, released by ReleaseRemoved()
+    WAITHANDLERARRAY m_throttled;       // out of tokens, see Throttle()
+    WAITHANDLERARRAY m_resumed;         // ResumeThrottled()'s
+    HANDLEMAP m_handles;                // wait handles, including those in shards
+    TIMERMAP m_timers;                  // timers by id
+
+    MpscQueue m_commands;               // Command objects for the worker thread
+    WaitHandle m_shutdownevent;
+    WaitHandle m_wakeupevent;           // commands have been queued
+    std::atomic<bool> m_fWakeupPending; // m_wakeupevent signalled and not yet drained
+#ifdef _WIN32
+    WAITHANDLERARRAY m_armedhandlers;   // m_waithandlers in the wait array
+    std::vector<HANDLE> m_waitarray;    // the internal events, then m_armedhandlers' handles
+    WaitHandle m_shardreadyevent;
+    std::vector<WaiterShard*> m_shards;
+    MpscQueue m_readyshards;            // shards parked on a signalled handle
+#else
+    int m_epoll;
+#if WFMOHANDLER_IO_URING
+    IoUring m_ring;                     // waited upon instead of m_epoll, if open
+    int m_ringpending;                  // polls & receives outstanding on m_ring
+    WAITHANDLERARRAY m_ringcancels;     // removed handlers whose cancellation is still to be queued
+    unsigned short m_nextbgid;          // buffer group ids of the receivers
+    std::vector<unsigned short> m_freebgids;
+#endif
+#endif
+    ThreadHandle m_htWorker;
+#ifndef _WIN32
+    bool m_fWorkerStarted;
+#endif
+    std::atomic<ThreadId> m_workerthreadid;     // set by the worker thread while it runs
+    std::atomic<unsigned> m_nexttimertriggerid;
+    TimerWheel m_timerwheel;            // all the timers in m_timers
+    TimerHandler* m_pRunningTimer;         // timer whose handler is being invoked
+    DispatchPool m_pool;                // runs the handlers if m_fPooled
+    bool m_fPooled;
+    unsigned m_npoolthreads;
+    StartOptions m_options;             // see SetStartOptions()
+    unsigned m_batchsize;               // most handles dispatched per wake-up
+    WAITHANDLERARRAY m_batch;           // handles signalled in the last wake-up
+    size_t m_rotation;                  // where the next batch starts
+    std::atomic<uint64_t> m_batchwakeups;
+    std::atomic<uint64_t> m_batchevents;
+    std::atomic<uint64_t> m_batchmax;
+    BusyPoll m_busypoll;                // see EnableBusyPoll()
+    LoopMetrics m_metrics;
+#if WFMOHANDLER_METRICS
+    CriticalSection m_meteredlock;      // guards m_metered
+    WAITHANDLERARRAY m_metered;         // registered handlers, for GetMetrics()
+#endif
 };
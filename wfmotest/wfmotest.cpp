@@ -7,123 +7,138 @@
 
 #include "stdafx.h"
 #include "wfmohandler.h"
-
-/*
- * A simple class that implements an asynchronous 'recv' UDP socket.
- * Socket binds to loopback address!
- */
-class AsyncSocket {
-    USHORT m_port;
-    WSAEVENT m_event;
-    SOCKET m_socket;
-    AsyncSocket();
-    AsyncSocket(const AsyncSocket&);
-public:
-    AsyncSocket(USHORT port)
-        : m_port(port)
-        , m_event(::WSACreateEvent())
-        , m_socket(::WSASocket(AF_INET, SOCK_DGRAM, IPPROTO_UDP, NULL, 0, 0))
-    {
-        // bind the socket
-        struct sockaddr_in sin = {0};
-        sin.sin_family = AF_INET;
-        sin.sin_port = ::htons(port);
-        sin.sin_addr.s_addr = ::inet_addr("127.0.0.1");
-        if (m_event != NULL 
-            && m_socket != INVALID_SOCKET 
-            && ::bind(m_socket, reinterpret_cast<const sockaddr*>(&sin), sizeof(sin)) == 0) {
-            // put it in 'async' mode
-            if (::WSAEventSelect(m_socket, m_event, FD_READ) == 0)
-                return;
-        }
-
-        std::cerr << "Error initializing AsyncSocket, error code: " << WSAGetLastError() << std::endl;
-
-        // something went wrong, release resources and raise an exception
-        if (m_event != NULL) ::WSACloseEvent(m_event);
-        if (m_socket != INVALID_SOCKET) ::closesocket(m_socket);
-        throw std::exception("socket creation error");
-    }
-    ~AsyncSocket()
-    {
-        ::closesocket(m_socket);
-        ::WSACloseEvent(m_event);
-    }
-    /* for direct access to the embedded event handle */
-    operator HANDLE() { return m_event; }
-    /*
-     * Read all incoming packets in the socket's recv buffer. When all the packets 
-     * in the buffer have been read, resets the associated Win32 event preparing it
-     * for subsequent signalling when a new packet is copied into the buffer.
-     */
-    void ReadIncomingPacket()
-    {
-        std::vector<char> buf(64*1024);
-        struct sockaddr_in from = {0};
-        int fromlen = sizeof(from);
-        int cbRecd = ::recvfrom(m_socket, 
-            &buf[0], 
-            buf.size(), 
-            0, 
-            reinterpret_cast<sockaddr*>(&from), 
-            &fromlen);
-        if (cbRecd > 0) {
-            std::cerr << cbRecd << " bytes received on port " << m_port << std::endl;
-        } else {
-            int rc = ::WSAGetLastError();
-            if (rc == WSAEWOULDBLOCK) {
-                // no more data, reset the event so that WaitForMult..will block on it
-                ::WSAResetEvent(m_event);
-            } else {
-                // something else went wrong
-                std::cerr << "Error receiving data from port " << m_port 
-                      << ", error code: " << ::WSAGetLastError() << std::endl;
-            }
-        }
-    }
-};
+#include "asyncsocket.h"
+#include "latency.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
 
 /*
     A sample daemon that uses WFMO to process its internal events.
 
     The daemon creates two UDP sockets on ports 5000 and 6000 and reads
-    any incoming packets.
+    any incoming packets. Probes sent by 'netsend -l' are timed rather
+    than logged: the send to handler latency and the loss and reordering
+    are printed every few seconds and when the daemon stops.
 
     Though only sockets are shown, the same can be extended to include
     any other types of object to which a Win32 waitable handle can be
     associated.
+
+    On Linux, 'wfmotest --uring' has the loop receive the datagrams
+    through io_uring, and 'wfmotest --cores N' runs a daemon per core on
+    the first N cores the process may run on (all of them if N is 0), each
+    with its own loop pinned to its core and its own pair of sockets bound
+    to the two ports with SO_REUSEPORT, so that the kernel spreads the
+    flows across them.
  */
 class MyDaemon : public WFMOHandler {
     AsyncSocket m_socket1;
     AsyncSocket m_socket2;
     unsigned m_timerid;
     unsigned m_oneofftimerid;
+    LatencyHistogram m_latency;
+    SequenceTracker m_sequence;
+    uint64_t m_reported;        // m_latency.Count() when last printed
+    int m_cpu;                  // the loop is pinned to, -1 if it isn't
 public:
-    MyDaemon() 
+    static const unsigned LATENCY_REPORT_INTERVAL = 5000;
+
+    /**
+     * Parameters:
+     *  fUring - receive through io_uring, if the kernel has it (Linux)
+     *  cpu    - CPU to pin the loop to, sharing the ports with the
+     *           daemons on the other CPUs; -1 for the only daemon
+     */
+    MyDaemon(bool fUring = false, int cpu = -1)
         : WFMOHandler()
-        , m_socket1(5000)
-        , m_socket2(6000)
+        , m_socket1(5000, std::bind(&MyDaemon::OnDatagrams, this, &m_socket1, std::placeholders::_1, std::placeholders::_2),
+            AsyncSocket::DEFAULT_BUFFER_SIZE, AsyncSocket::DEFAULT_BUFFER_COUNT, cpu >= 0)
+        , m_socket2(6000, std::bind(&MyDaemon::OnDatagrams, this, &m_socket2, std::placeholders::_1, std::placeholders::_2),
+            AsyncSocket::DEFAULT_BUFFER_SIZE, AsyncSocket::DEFAULT_BUFFER_COUNT, cpu >= 0)
         , m_timerid(0)
         , m_oneofftimerid(0)
+        , m_reported(0)
+        , m_cpu(cpu)
     {
-        // setup two handlers on the two AsyncSockets that we created
-        WFMOHandler::AddWaitHandle(m_socket1, 
-            std::bind(&AsyncSocket::ReadIncomingPacket, &m_socket1));
-        WFMOHandler::AddWaitHandle(m_socket2, 
-            std::bind(&AsyncSocket::ReadIncomingPacket, &m_socket2));
-        m_timerid = WFMOHandler::AddTimer(1000, true, std::bind(&MyDaemon::RoutineTimer, this, &m_socket1));
-        m_oneofftimerid = WFMOHandler::AddTimer(3000, false, std::bind(&MyDaemon::OneOffTimer, this));
+        if (cpu >= 0) {
+            // pinned, and with the sockets' buffers and the handlers on the CPU's node
+            StartOptions options;
+            options.m_cpus.assign(1, cpu);
+            options.m_numanode = StartOptions::LOCAL_NODE;
+            SetStartOptions(options);
+        }
+#if WFMOHANDLER_IO_URING
+        if (fUring && !EnableIoUring())
+            std::cerr << "io_uring is not available, using epoll" << std::endl;
+#else
+        (void)fUring;
+#endif
+        // setup handlers on the two AsyncSockets that we created
+        m_socket1.Register(*this);
+        m_socket2.Register(*this);
+        // only the first daemon shows the timers off
+        if (cpu <= 0) {
+#if WFMOHANDLER_COROUTINES
+            Timers();
+#else
+            // a routine timer can run a little late, along with other timers due then
+            m_timerid = WFMOHandler::AddTimer(1000, true, std::bind(&MyDaemon::RoutineTimer, this, &m_socket1), 50);
+            m_oneofftimerid = WFMOHandler::AddTimer(3000, false, std::bind(&MyDaemon::OneOffTimer, this));
+#endif
+        }
+        WFMOHandler::AddTimer(LATENCY_REPORT_INTERVAL, true, std::bind(&MyDaemon::ReportLatency, this));
     }
     virtual ~MyDaemon()
     {
         Stop();
+        if (m_latency.Count() > 0)
+            PrintLatency(std::cout, Label("latency").c_str(), m_latency, m_sequence);
+        Metrics metrics;
+        if (GetMetrics(metrics)) {
+            uint64_t total = metrics.m_blockedns + metrics.m_runningns;
+            std::cout << Label("loop") << ": " << metrics.m_wakeups << " wake-ups, "
+                << metrics.m_events << " events, "
+                << metrics.m_timers << " timers, busy "
+                << (total > 0 ? 100.0 * metrics.m_runningns / total : 0) << "%, handler p99 "
+                << metrics.m_handlerns.Percentile(99) / 1000.0 << "us" << std::endl;
+        }
         // just being graceful, WFMOHandler dtor will cleanup anyways 
         WFMOHandler::RemoveWaitHandle(m_socket2);
         WFMOHandler::RemoveWaitHandle(m_socket1);
     }
+    void OnDatagrams(AsyncSocket* pSock, const AsyncSocket::Datagram* pDatagrams, size_t count)
+    {
+        uint64_t now = MonotonicNanos();
+        for (size_t i=0; i<count; i++) {
+            const AsyncSocket::Datagram& d = pDatagrams[i];
+            ProbeHeader h;
+            if (ProbeHeader::Read(d.m_data, d.m_len, h)) {
+                m_latency.Record(now > h.m_sendns ? now - h.m_sendns : 0);
+                // sequence numbers run per sending socket and destination port
+                m_sequence.Record((static_cast<uint32_t>(ntohs(d.m_addr.sin_port)) << 16) | pSock->Port(), h.m_seq);
+            } else {
+                std::cerr << d.m_len << " bytes received on port " << pSock->Port() << std::endl;
+            }
+        }
+    }
+    /* what, followed by the CPU of the loop if there's one per CPU */
+    std::string Label(const char* what) const
+    {
+        return m_cpu >= 0 ? what + (" cpu " + std::to_string(m_cpu)) : std::string(what);
+    }
+    void ReportLatency()
+    {
+        if (m_latency.Count() == m_reported)
+            return;
+        m_reported = m_latency.Count();
+        PrintLatency(std::cout, Label("latency").c_str(), m_latency, m_sequence);
+    }
     void RoutineTimer(AsyncSocket* pSock)
     {
-        pSock;
+        (void)pSock;
         std::cout << "Routine timer has expired!" << std::endl;
     }
     void OneOffTimer()
@@ -132,8 +147,22 @@ public:
         RemoveTimer(m_oneofftimerid);
         m_oneofftimerid = 0;
     }
+#if WFMOHANDLER_COROUTINES
+    // the routine and one off timers as a single coroutine, which is
+    // destroyed when the daemon stops
+    LoopTask Timers()
+    {
+        for (unsigned elapsed=1000; ; elapsed+=1000) {
+            co_await SleepFor(1000);
+            RoutineTimer(&m_socket1);
+            if (elapsed == 3000)
+                std::cout << "One off tmer has expired!" << std::endl;
+        }
+    }
+#endif
 };
 
+#ifdef _WIN32
 HANDLE __hStopEvent = NULL;
 // Ctrl+C/Ctrl+Break handler function
 BOOL WINAPI ConsoleCtrlHandler(DWORD dwCode)
@@ -181,3 +210,58 @@ int _tmain(int argc, _TCHAR* argv[])
 
     return 0;
 }
+#else
+int _tmain(int argc, _TCHAR* argv[])
+{
+    bool fUring = false;
+    int nCores = -1;        // a single daemon
+    for (int i=1; i<argc; i++) {
+        if (::strcmp(argv[i], "--uring") == 0) {
+            fUring = true;
+        } else if (::strcmp(argv[i], "--cores") == 0 && i+1 < argc) {
+            nCores = ::atoi(argv[++i]);
+        } else {
+            std::cerr << "usage: wfmotest [--uring] [--cores N]" << std::endl;
+            return 1;
+        }
+    }
+    // the CPUs of the affinity mask, which may leave some of the machine's out
+    std::vector<unsigned> cpus = WFMOHandler::AllowedCpus();
+    if (nCores == 0 || nCores > static_cast<int>(cpus.size()))
+        nCores = static_cast<int>(cpus.size());
+
+    // block Ctrl+C & friends before any thread is started so that only
+    // sigwait() below gets to see them
+    sigset_t stopsignals;
+    ::sigemptyset(&stopsignals);
+    ::sigaddset(&stopsignals, SIGINT);
+    ::sigaddset(&stopsignals, SIGTERM);
+    ::sigaddset(&stopsignals, SIGHUP);
+    ::pthread_sigmask(SIG_BLOCK, &stopsignals, NULL);
+
+    try {
+        // one daemon per core, each pinned to its own
+        std::vector<std::unique_ptr<MyDaemon> > daemons;
+        for (int i=0; i<(nCores > 0 ? nCores : 1); i++) {
+            int cpu = nCores > 0 ? static_cast<int>(cpus[i]) : -1;
+            daemons.push_back(std::unique_ptr<MyDaemon>(new MyDaemon(fUring, cpu)));
+            if (!daemons.back()->Start()) {
+                std::cerr << "Error starting the daemon on cpu " << cpu << std::endl;
+                return 1;
+            }
+        }
+
+        std::cout << "Daemon started, press Ctrl+C to stop." << std::endl;
+
+        int sig = 0;
+        ::sigwait(&stopsignals, &sig);
+
+    } catch (std::exception& e) {
+        std::cerr << "std::exception: " << e.what() << std::endl;
+    } catch (...) {
+        std::cerr << "Unknown exception" << std::endl;
+    }
+
+    return 0;
+}
+#endif